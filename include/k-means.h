@@ -24,20 +24,506 @@
 #ifndef __K_MEANS_H
 #define __K_MEANS_H
 
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <sys/types.h>
 
-size_t k_means_f(size_t points, size_t dimension, uint8_t k,
+enum k_means_algorithm {
+  k_means_lloyd,   // Compute every point to centroid distance
+  k_means_hamerly, // One lower bound per point, for low dimensions
+  k_means_elkan,   // k lower bounds per point, for higher dimensions
+  k_means_yinyang, // One lower bound per group of centroids, for large k
+};
+
+enum k_means_init {
+  k_means_init_random,   // k distinct points drawn uniformly
+  k_means_init_plusplus, // k-means++, D² sampling of one point per centroid
+  k_means_init_parallel, // k-means||, a few rounds oversampling 2k points
+  k_means_init_given,    // k_means_config.initial_centroids, e.g. the result
+                         // of a run on a subsample of the data
+};
+
+// Additional stopping criteria, a zero field disables the criterion. Without
+// any the iterations stop once no point changes of centroid.
+struct k_means_termination {
+  size_t max_iterations;
+  // Stop when the centroids moved by less than this fraction of their norm,
+  // sqrt(sum ||c' - c||²) <= shift_tolerance * sqrt(sum ||c'||²)
+  double shift_tolerance;
+  // Stop when the inertia (sum of the squared distances between the points and
+  // their centroid) decreased by less than this fraction
+  double inertia_tolerance;
+  // Stop when at most this fraction of the points changed of centroid
+  double reassigned_fraction;
+  // Wall clock budget in seconds, checked after every iteration
+  double time_budget;
+};
+
+enum k_means_stop_reason {
+  k_means_stop_converged, // No point changed of centroid
+  k_means_stop_max_iterations,
+  k_means_stop_shift_tolerance,
+  k_means_stop_inertia_tolerance,
+  k_means_stop_reassigned_fraction,
+  k_means_stop_time_budget,
+  k_means_stop_abandoned, // Restart losing to the others, see k_means_restarts
+};
+
+// Measurements of one iteration, passed to k_means_config.iteration_callback
+struct k_means_iteration_stats {
+  size_t iteration;
+  // Assignment of the slowest thread, and merge of the partial sums with the
+  // update of the centroids and of the bounds, in seconds
+  double assign_time;
+  double update_time;
+  size_t reassigned;
+  // Sum of the squared distances between the points and the centroid they
+  // were assigned to, before the update
+  double inertia;
+  size_t empty_clusters;
+  // Centroid shift of the update, sqrt(sum ||c' - c||²)
+  double shift;
+  // Summed over the threads during the assignment and the update, -1 when the
+  // counters are disabled or unavailable
+  int64_t cycles;
+  int64_t cache_misses;
+  // Bytes of points read per second of assignment
+  double bandwidth;
+  // Time spent waiting for the streamed points, see k_means_stream
+  double io_wait_time;
+};
+
+typedef void (*k_means_iteration_callback)(
+    const struct k_means_iteration_stats *stats, void *data);
+
+struct k_means_config {
+  // The points are split in num_threads contiguous blocks. Each thread keeps
+  // its own partial centroid sums which are merged in thread order, hence the
+  // result only depends on the random seed and on the number of threads.
+  unsigned num_threads;
+  // Hamerly, Elkan and Yinyang skip the distance computations ruled out by the
+  // triangle inequality, the labels are the same as the Lloyd ones.
+  enum k_means_algorithm algorithm;
+  // The seeding draws its random numbers from a counter based generator keyed
+  // by seed, which any thread can query without synchronization.
+  enum k_means_init init;
+  unsigned long seed;
+  struct k_means_termination termination;
+  // Called by the first thread after every iteration when the library is
+  // built with K_MEANS_STATS (the KMEANS_STATS CMake option). Otherwise the
+  // instrumentation is compiled out and the callback is ignored.
+  k_means_iteration_callback iteration_callback;
+  void *callback_data;
+  // Count the cycles and cache misses with perf_event_open (Linux only)
+  bool hardware_counters;
+  // Number of occurrences of every point, NULL when each point occurs once.
+  // The points are then drawn, summed and counted as many times as their
+  // weight, e.g. the distinct colours of an image weighted by their pixel
+  // counts (see k_means_unique_points) minimise the inertia of the pixels.
+  // From the same initial centroids (k_means_init_given) the integer engines,
+  // whose sums are exact, give the labels of the unweighted run. The float
+  // sums round weight * point once rather than weight times, and the seedings
+  // draw the same distribution over another order of the points, so the
+  // other runs can converge to another local minimum of the same problem.
+  const uint32_t *weights;
+  // k rows of dimension coordinates for k_means_init_given, in double
+  // precision for the double entry points and in single precision otherwise
+  const void *initial_centroids;
+  // Keep the sums of the clusters across the iterations in double precision
+  // and update them with the points which changed of cluster only, rather
+  // than summing every point again. The late iterations, which move few
+  // points, then mostly compute distances. The sums are recomputed from
+  // every point periodically to bound the rounding drift.
+  bool delta_update;
+  // Bind the threads to the NUMA nodes in contiguous blocks. The partial sums
+  // are merged node by node before the nodes are merged, and each node reads
+  // its own copy of the centroids. Allocate the points with k_means_numa_alloc
+  // so that they reside on the node of the threads reading them.
+  bool numa;
+  // From this dimension, the Lloyd iterations of the single precision
+  // centroids compute the distances as ||x||² + ||c||² - 2 x.c, multiplying
+  // blocks of points with blocks of centroids rather than reading every
+  // centroid for every point. The rounding differs, points almost equidistant
+  // to two centroids may be labelled differently. 0 selects
+  // K_MEANS_GEMM_DIMENSION and SIZE_MAX never uses it.
+  size_t gemm_dimension;
+};
+
+#define K_MEANS_GEMM_DIMENSION 32
+
+#define K_MEANS_DEFAULT_CONFIG                                                 \
+  {                                                                            \
+    .num_threads = 1, .algorithm = k_means_lloyd,                              \
+    .init = k_means_init_plusplus, .seed = 0                                   \
+  }
+
+struct k_means_stats {
+  size_t iterations;
+  // Point to centroid distances computed, and skipped compared to Lloyd
+  size_t distance_computations;
+  size_t distance_computations_avoided;
+  // Wall clock time of the seeding and of the Lloyd iterations, in seconds
+  double seeding_time;
+  double iteration_time;
+  enum k_means_stop_reason stop_reason;
+  // Sum of the squared distances between the points and their final centroid
+  double inertia;
+  // Part of the iteration time spent waiting for the streamed points
+  double io_wait_time;
+  // The assignments used the dot products, see k_means_config.gemm_dimension
+  bool gemm;
+};
+
+// At most 2^24 centroids, their indices are exact in single precision
+#define K_MEANS_MAX_K ((size_t)1 << 24)
+
+// Returned by the entry points instead of the number of iterations when the
+// run could not be completed: out of memory, a thread could not be created,
+// the streamed points could not be read or the configuration is invalid
+// (k_means_init_given without initial centroids, weighted streamed points).
+// The labels, the stats and the centroids of the context are then undefined.
+#define K_MEANS_ERROR SIZE_MAX
+
+// Size in bytes of a label, the point to centroid map holds uint8_t labels up
+// to 256 centroids, uint16_t up to 65536 and uint32_t above
+#define K_MEANS_LABEL_SIZE(k)                                                  \
+  ((k) <= (size_t)UINT8_MAX + 1 ? 1u : (k) <= (size_t)UINT16_MAX + 1 ? 2u : 4u)
+
+static inline size_t k_means_label(const void *point_to_centroid_map, size_t k,
+                                   size_t point) {
+  switch (K_MEANS_LABEL_SIZE(k)) {
+  case 1:
+    return ((const uint8_t *)point_to_centroid_map)[point];
+  case 2:
+    return ((const uint16_t *)point_to_centroid_map)[point];
+  default:
+    return ((const uint32_t *)point_to_centroid_map)[point];
+  }
+}
+
+// A NULL config uses K_MEANS_DEFAULT_CONFIG, stats may be NULL. The map holds
+// points labels of K_MEANS_LABEL_SIZE(k) bytes. Returns the number of
+// iterations, or K_MEANS_ERROR.
+size_t k_means_f(size_t points, size_t dimension, size_t k,
                  float data[restrict points][dimension],
-                 uint8_t point_to_centroid_map[points]);
+                 void *point_to_centroid_map,
+                 const struct k_means_config *config,
+                 struct k_means_stats *stats);
 
-size_t k_means_d(size_t points, size_t dimension, uint8_t k,
+size_t k_means_d(size_t points, size_t dimension, size_t k,
                  double data[restrict points][dimension],
-                 uint8_t point_to_centroid_map[points]);
+                 void *point_to_centroid_map,
+                 const struct k_means_config *config,
+                 struct k_means_stats *stats);
+
+// Integer samples, such as 8 or 16 bits pixels, read without any conversion
+// of the data set. The centroids and the distances are in single precision
+// and the sums of the points of every centroid are exact integers, whereas
+// k_means_f rounds its sums. The centroids of an iteration can then differ in
+// their last bits from those of k_means_f on the converted data, and the runs
+// can diverge into different iterations and labels of a similar inertia.
+size_t k_means_u8(size_t points, size_t dimension, size_t k,
+                  uint8_t data[restrict points][dimension],
+                  void *point_to_centroid_map,
+                  const struct k_means_config *config,
+                  struct k_means_stats *stats);
+
+size_t k_means_u16(size_t points, size_t dimension, size_t k,
+                   uint16_t data[restrict points][dimension],
+                   void *point_to_centroid_map,
+                   const struct k_means_config *config,
+                   struct k_means_stats *stats);
+
+// Points stored as IEEE half precision or bfloat16 floats, halving the memory
+// traffic of the single precision points. The coordinates are converted to
+// single precision as they are loaded and the labels are the ones of k_means_f
+// on the converted data.
+typedef struct {
+  uint16_t bits;
+} k_means_half;
+
+typedef struct {
+  uint16_t bits;
+} k_means_bfloat16;
+
+size_t k_means_h(size_t points, size_t dimension, size_t k,
+                 k_means_half data[restrict points][dimension],
+                 void *point_to_centroid_map,
+                 const struct k_means_config *config,
+                 struct k_means_stats *stats);
+
+size_t k_means_bf16(size_t points, size_t dimension, size_t k,
+                    k_means_bfloat16 data[restrict points][dimension],
+                    void *point_to_centroid_map,
+                    const struct k_means_config *config,
+                    struct k_means_stats *stats);
+
+// Round count single precision values to the nearest 16 bits floats, ties to
+// even
+void k_means_float_to_half(size_t count, const float *values,
+                           k_means_half *halves);
+
+void k_means_float_to_bfloat16(size_t count, const float *values,
+                               k_means_bfloat16 *bfloats);
+
+// A context keeps the scratch memory of the runs, the following runs with the
+// same or a smaller problem size do not allocate memory. A context must not be
+// used by two runs at the same time.
+struct k_means_context;
+
+struct k_means_context *k_means_context_create(void);
+
+void k_means_context_destroy(struct k_means_context *context);
+
+size_t k_means_with_context_f(struct k_means_context *context, size_t points,
+                              size_t dimension, size_t k,
+                              float data[restrict points][dimension],
+                              void *point_to_centroid_map,
+                              const struct k_means_config *config,
+                              struct k_means_stats *stats);
+
+size_t k_means_with_context_d(struct k_means_context *context, size_t points,
+                              size_t dimension, size_t k,
+                              double data[restrict points][dimension],
+                              void *point_to_centroid_map,
+                              const struct k_means_config *config,
+                              struct k_means_stats *stats);
+
+size_t k_means_with_context_u8(struct k_means_context *context, size_t points,
+                               size_t dimension, size_t k,
+                               uint8_t data[restrict points][dimension],
+                               void *point_to_centroid_map,
+                               const struct k_means_config *config,
+                               struct k_means_stats *stats);
+
+size_t k_means_with_context_u16(struct k_means_context *context,
+                                size_t points, size_t dimension, size_t k,
+                                uint16_t data[restrict points][dimension],
+                                void *point_to_centroid_map,
+                                const struct k_means_config *config,
+                                struct k_means_stats *stats);
 
-#define k_means(points, dims, k, data, ptcm)                                   \
+size_t k_means_with_context_h(struct k_means_context *context, size_t points,
+                              size_t dimension, size_t k,
+                              k_means_half data[restrict points][dimension],
+                              void *point_to_centroid_map,
+                              const struct k_means_config *config,
+                              struct k_means_stats *stats);
+
+size_t
+k_means_with_context_bf16(struct k_means_context *context, size_t points,
+                          size_t dimension, size_t k,
+                          k_means_bfloat16 data[restrict points][dimension],
+                          void *point_to_centroid_map,
+                          const struct k_means_config *config,
+                          struct k_means_stats *stats);
+
+// Starts from the given centroids, overwritten by the final ones, rather than
+// seeding, e.g. from the centroids of the previous frame of a video. The
+// integer and 16 bits float entry points take single precision centroids,
+// which are left unchanged on K_MEANS_ERROR.
+size_t k_means_warm_start_f(size_t points, size_t dimension, size_t k,
+                            float data[restrict points][dimension],
+                            void *point_to_centroid_map,
+                            const struct k_means_config *config,
+                            float centroids[k][dimension],
+                            struct k_means_stats *stats);
+
+size_t k_means_warm_start_d(size_t points, size_t dimension, size_t k,
+                            double data[restrict points][dimension],
+                            void *point_to_centroid_map,
+                            const struct k_means_config *config,
+                            double centroids[k][dimension],
+                            struct k_means_stats *stats);
+
+size_t k_means_warm_start_u8(size_t points, size_t dimension, size_t k,
+                             uint8_t data[restrict points][dimension],
+                             void *point_to_centroid_map,
+                             const struct k_means_config *config,
+                             float centroids[k][dimension],
+                             struct k_means_stats *stats);
+
+size_t k_means_warm_start_u16(size_t points, size_t dimension, size_t k,
+                              uint16_t data[restrict points][dimension],
+                              void *point_to_centroid_map,
+                              const struct k_means_config *config,
+                              float centroids[k][dimension],
+                              struct k_means_stats *stats);
+
+size_t k_means_warm_start_h(size_t points, size_t dimension, size_t k,
+                            k_means_half data[restrict points][dimension],
+                            void *point_to_centroid_map,
+                            const struct k_means_config *config,
+                            float centroids[k][dimension],
+                            struct k_means_stats *stats);
+
+size_t
+k_means_warm_start_bf16(size_t points, size_t dimension, size_t k,
+                        k_means_bfloat16 data[restrict points][dimension],
+                        void *point_to_centroid_map,
+                        const struct k_means_config *config,
+                        float centroids[k][dimension],
+                        struct k_means_stats *stats);
+
+// Outcome of one of the restarts of k_means_restarts
+struct k_means_restart {
+  unsigned long seed;
+  size_t iterations;
+  // Final inertia, of the centroids reached when abandoned
+  double inertia;
+  enum k_means_stop_reason stop_reason;
+};
+
+// Runs restarts clusterings concurrently over the same data, the restart r
+// seeded with config->seed + r and each on config->num_threads threads. After
+// every iteration, a restart whose inertia exceeds the lowest inertia of the
+// restarts at the same iteration by more than the abandon_margin fraction is
+// abandoned (0 never abandons). The labels, the stats and the context, which
+// may be NULL, hold the result of the restart with the lowest final inertia.
+// restart_results, which may be NULL, receives the outcome of every restart.
+// Returns the index of the best restart, or K_MEANS_ERROR when one of the
+// restarts failed.
+size_t k_means_restarts_f(struct k_means_context *context, size_t points,
+                          size_t dimension, size_t k,
+                          float data[restrict points][dimension],
+                          void *point_to_centroid_map,
+                          const struct k_means_config *config,
+                          size_t restarts, double abandon_margin,
+                          struct k_means_stats *stats,
+                          struct k_means_restart *restart_results);
+
+size_t k_means_restarts_d(struct k_means_context *context, size_t points,
+                          size_t dimension, size_t k,
+                          double data[restrict points][dimension],
+                          void *point_to_centroid_map,
+                          const struct k_means_config *config,
+                          size_t restarts, double abandon_margin,
+                          struct k_means_stats *stats,
+                          struct k_means_restart *restart_results);
+
+size_t k_means_restarts_u8(struct k_means_context *context, size_t points,
+                           size_t dimension, size_t k,
+                           uint8_t data[restrict points][dimension],
+                           void *point_to_centroid_map,
+                           const struct k_means_config *config,
+                           size_t restarts, double abandon_margin,
+                           struct k_means_stats *stats,
+                           struct k_means_restart *restart_results);
+
+size_t k_means_restarts_u16(struct k_means_context *context, size_t points,
+                            size_t dimension, size_t k,
+                            uint16_t data[restrict points][dimension],
+                            void *point_to_centroid_map,
+                            const struct k_means_config *config,
+                            size_t restarts, double abandon_margin,
+                            struct k_means_stats *stats,
+                            struct k_means_restart *restart_results);
+
+size_t k_means_restarts_h(struct k_means_context *context, size_t points,
+                          size_t dimension, size_t k,
+                          k_means_half data[restrict points][dimension],
+                          void *point_to_centroid_map,
+                          const struct k_means_config *config,
+                          size_t restarts, double abandon_margin,
+                          struct k_means_stats *stats,
+                          struct k_means_restart *restart_results);
+
+size_t k_means_restarts_bf16(struct k_means_context *context, size_t points,
+                             size_t dimension, size_t k,
+                             k_means_bfloat16 data[restrict points][dimension],
+                             void *point_to_centroid_map,
+                             const struct k_means_config *config,
+                             size_t restarts, double abandon_margin,
+                             struct k_means_stats *stats,
+                             struct k_means_restart *restart_results);
+
+// Lloyd iterations over points too large for the memory, read from the file
+// descriptor at offset as rows of dimension values. Every pass reads the file
+// in chunks of chunk_points rows (0 for chunks of about 16 MiB), the next chunk
+// being read in the background while the threads process the current one, so
+// that only the labels, the centroids and two chunks reside in memory.
+// k-means++ and k-means|| seed from a sample of the points, a last pass
+// computes the inertia of the final centroids and the weights are not
+// supported. The algorithm of the configuration is ignored.
+size_t k_means_stream_f(struct k_means_context *context, int fd, off_t offset,
+                        size_t points, size_t dimension, size_t k,
+                        size_t chunk_points, void *point_to_centroid_map,
+                        const struct k_means_config *config,
+                        struct k_means_stats *stats);
+
+size_t k_means_stream_d(struct k_means_context *context, int fd, off_t offset,
+                        size_t points, size_t dimension, size_t k,
+                        size_t chunk_points, void *point_to_centroid_map,
+                        const struct k_means_config *config,
+                        struct k_means_stats *stats);
+
+// Memory for points rows of row_size bytes, each of the num_threads blocks of
+// rows placed on the NUMA node of the thread partitioning it with
+// k_means_config.numa. NULL when out of memory.
+void *k_means_numa_alloc(size_t points, size_t row_size, unsigned num_threads);
+
+void k_means_numa_free(void *data, size_t points, size_t row_size);
+
+// Final centroids of the last run (k rows of dimension coordinates), valid
+// until the next run of the context. NULL when the last run used the other
+// floating point type, the integer runs have single precision centroids.
+const float *k_means_context_centroids_f(const struct k_means_context *context);
+
+const double *
+k_means_context_centroids_d(const struct k_means_context *context);
+
+double k_means_context_inertia(const struct k_means_context *context);
+
+// Merges the points whose row_size bytes are equal, such as the pixels of the
+// same colour. Writes the distinct points in order of first occurrence to
+// unique and their number of occurrences to weights, which both need room for
+// every point, and the index of the distinct point of every point to
+// point_unique. Returns the number of distinct points, or K_MEANS_ERROR from
+// UINT32_MAX points on or when out of memory.
+size_t k_means_unique_points(size_t points, size_t row_size,
+                             const void *data, void *unique, uint32_t *weights,
+                             uint32_t *point_unique);
+
+// Labels of the points from the labels of their distinct points, the inverse
+// of k_means_unique_points once the distinct points are partitioned
+void k_means_scatter_labels(size_t points, size_t k,
+                            const uint32_t *point_unique,
+                            const void *unique_to_centroid_map,
+                            void *point_to_centroid_map);
+
+// Selects the entry point matching the data type. Each entry point then runs
+// an engine compiled for the given dimension when it is at most 8 (RGBA images
+// use 4), or the generic engine otherwise.
+#define k_means(points, dims, k, data, ptcm, config, stats)                    \
   _Generic((data[0][0]), float                                                 \
            : k_means_f, double                                                 \
-           : k_means_d)(points, dims, k, data, ptcm)
+           : k_means_d, uint8_t                                                \
+           : k_means_u8, uint16_t                                              \
+           : k_means_u16, k_means_half                                         \
+           : k_means_h, k_means_bfloat16                                       \
+           : k_means_bf16)(points, dims, k, data, ptcm, config, stats)
+
+#define k_means_with_context(context, points, dims, k, data, ptcm, config,     \
+                             stats)                                            \
+  _Generic((data[0][0]), float                                                 \
+           : k_means_with_context_f, double                                    \
+           : k_means_with_context_d, uint8_t                                   \
+           : k_means_with_context_u8, uint16_t                                 \
+           : k_means_with_context_u16, k_means_half                            \
+           : k_means_with_context_h, k_means_bfloat16                          \
+           : k_means_with_context_bf16)(context, points, dims, k, data, ptcm,  \
+                                        config, stats)
+
+#define k_means_warm_start(points, dims, k, data, ptcm, config, centroids,     \
+                           stats)                                              \
+  _Generic((data[0][0]), float                                                 \
+           : k_means_warm_start_f, double                                      \
+           : k_means_warm_start_d, uint8_t                                     \
+           : k_means_warm_start_u8, uint16_t                                   \
+           : k_means_warm_start_u16, k_means_half                              \
+           : k_means_warm_start_h, k_means_bfloat16                            \
+           : k_means_warm_start_bf16)(points, dims, k, data, ptcm, config,     \
+                                      centroids, stats)
 
 #endif // __K-MEANS_H
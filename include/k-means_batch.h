@@ -0,0 +1,49 @@
+#ifndef K_MEANS_BATCH_H_
+#define K_MEANS_BATCH_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "k-means.h"
+#include "k-means_png.h"
+
+enum batch_stage {
+  batch_decode,
+  batch_cluster,
+  batch_encode,
+  batch_num_stages,
+};
+
+struct batch_options {
+  // A directory of png files, or a file listing one png file per line
+  const char *input;
+  // The labels of every image are written there under the name of the image,
+  // NULL skips the encoding
+  const char *output_directory;
+  size_t k;
+  // Configuration of every run, num_threads is the number of threads
+  // clustering one image
+  struct k_means_config config;
+  enum png_point_type type; // png_points_float or png_points_integer
+  // Indexed images of the colours of the centroids rather than grey levels
+  bool palette;
+  struct png_encoder encoder;
+  // Threads of every stage, the decoded and clustered images wait in queues
+  // of queue_capacity images which block the previous stage when full
+  unsigned threads[batch_num_stages];
+  size_t queue_capacity;
+};
+
+// Decodes, clusters and encodes the images in a pipeline, the stages process
+// different images at the same time. Prints the throughput and the share of
+// time each stage was busy. Returns false when an image failed or a thread
+// could not be created.
+bool run_batch(const struct batch_options *options);
+
+// Clusters the images one after the other as the frames of a video, each
+// frame starting from the centroids of the previous one, and prints the
+// difference of iterations with the last seeded frame, a different image. The
+// threads of the stages and the queue capacity are ignored.
+bool run_sequence(const struct batch_options *options);
+
+#endif // K_MEANS_BATCH_H_
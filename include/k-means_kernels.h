@@ -0,0 +1,118 @@
+#ifndef K_MEANS_KERNELS_H_
+#define K_MEANS_KERNELS_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "k-means.h"
+
+#ifdef __F16C__
+#include <immintrin.h>
+#endif
+
+// The kernels receive the centroids transposed (structure of arrays): the
+// coordinate dim of the centroid c is stored at centroids[dim * stride + c].
+// The stride is a multiple of the widest vector, the block is aligned on
+// K_MEANS_KERNEL_ALIGNMENT and the padding centroids must hold HUGE_VAL
+// coordinates so that they are never the closest ones.
+#define K_MEANS_KERNEL_ALIGNMENT 64
+
+#define K_MEANS_KERNEL_STRIDE(k, type)                                         \
+  ((((k) + K_MEANS_KERNEL_ALIGNMENT / sizeof(type) - 1) /                      \
+    (K_MEANS_KERNEL_ALIGNMENT / sizeof(type))) *                               \
+   (K_MEANS_KERNEL_ALIGNMENT / sizeof(type)))
+
+// Kernels are compiled for every dimension up to this one, index 0 holds the
+// kernel working with any dimension
+#define K_MEANS_SPECIALIZED_DIMENSIONS 8
+#define K_MEANS_SPECIALIZATION(dimension)                                      \
+  ((dimension) <= K_MEANS_SPECIALIZED_DIMENSIONS ? (dimension) : 0)
+
+// Return the index of the closest centroid, the lowest index wins on ties
+typedef size_t (*k_means_nearest_f_kernel)(size_t dimension, size_t k,
+                                           const float *point,
+                                           const float *centroids,
+                                           size_t stride);
+
+typedef size_t (*k_means_nearest_d_kernel)(size_t dimension, size_t k,
+                                           const double *point,
+                                           const double *centroids,
+                                           size_t stride);
+
+// Store the squared distance to every centroid, up to the stride
+typedef void (*k_means_distances_f_kernel)(size_t dimension, size_t k,
+                                           const float *point,
+                                           const float *centroids,
+                                           size_t stride, float *distances);
+
+typedef void (*k_means_distances_d_kernel)(size_t dimension, size_t k,
+                                           const double *point,
+                                           const double *centroids,
+                                           size_t stride, double *distances);
+
+// Store the index of the closest centroid of count points, rows of dimension
+// coordinates, from the squared norms of the points and of the centroids:
+// ||x||² + ||c||² - 2 x.c. Tiles of points are multiplied with panels of
+// centroids held in registers, each panel being reused by every tile of the
+// points while it sits in the cache. centroid_norms holds stride values, the
+// ones of the padding centroids HUGE_VALF. The rounding differs from the
+// nearest kernels, but not between the instruction sets.
+typedef void (*k_means_nearest_gemm_f_kernel)(
+    size_t dimension, size_t k, size_t count, const float *points,
+    const float *point_norms, const float *centroids, size_t stride,
+    const float *centroid_norms, size_t *nearest);
+
+// Convert count 16 bits floats, the conversion to single precision is exact
+// and the one from single precision rounds to the nearest, ties to even. F16C
+// converts 8 values at once with the same results.
+typedef void (*k_means_half_to_float_kernel)(size_t count,
+                                             const k_means_half *halves,
+                                             float *values);
+typedef void (*k_means_float_to_half_kernel)(size_t count, const float *values,
+                                             k_means_half *halves);
+
+struct k_means_kernels {
+  const char *name;
+  k_means_nearest_f_kernel nearest_f[K_MEANS_SPECIALIZED_DIMENSIONS + 1];
+  k_means_nearest_d_kernel nearest_d[K_MEANS_SPECIALIZED_DIMENSIONS + 1];
+  k_means_distances_f_kernel distances_f;
+  k_means_distances_d_kernel distances_d;
+  k_means_nearest_gemm_f_kernel nearest_gemm_f;
+  k_means_half_to_float_kernel half_to_float;
+  k_means_float_to_half_kernel float_to_half;
+};
+
+// The best kernels supported by the processor are selected on the first call.
+// The selection can be forced with the KMEANS_KERNEL environment variable
+// (scalar, sse4.1, avx2 or avx512f).
+const struct k_means_kernels *k_means_kernels(void);
+
+// A single half converted without the kernels, with F16C when the build
+// targets it (USE_NATIVE_ARCH=ON). Otherwise the exponent and the mantissa are
+// moved to the single precision position and rebiased, the subnormals are
+// renormalized by a subtraction.
+static inline float k_means_half_to_float(k_means_half half) {
+#ifdef __F16C__
+  return _cvtsh_ss(half.bits);
+#else
+  union {
+    uint32_t bits;
+    float value;
+  } result = {.bits = (uint32_t)(half.bits & 0x7fff) << 13},
+    subnormal = {.bits = 113u << 23};
+  uint32_t exponent = result.bits & (0x1fu << 23);
+  result.bits += (127u - 15u) << 23;
+  if (exponent == 0x1fu << 23) { // Infinity or NaN, quiet as with F16C
+    result.bits += (128u - 16u) << 23;
+    if (result.bits & 0x7fffffu)
+      result.bits |= 0x400000u;
+  } else if (exponent == 0) {
+    result.bits += 1u << 23;
+    result.value -= subnormal.value;
+  }
+  result.bits |= (uint32_t)(half.bits & 0x8000) << 16;
+  return result.value;
+#endif
+}
+
+#endif // K_MEANS_KERNELS_H_
@@ -0,0 +1,42 @@
+#ifndef K_MEANS_NPY_H_
+#define K_MEANS_NPY_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+enum npy_type {
+  npy_float32,
+  npy_float64,
+  npy_uint8,
+  npy_uint16,
+  npy_uint32,
+};
+
+// A little endian, C ordered matrix of a NumPy .npy file mapped in memory.
+// data points into the mapping, a vector is a matrix of one column.
+struct npy_matrix {
+  enum npy_type type;
+  size_t rows, columns;
+  void *data;
+  void *mapping;
+  size_t mapping_size;
+};
+
+// Maps the matrix of the file read only, advised for a sequential access
+bool map_npy(const char *filename, struct npy_matrix *matrix);
+
+void unmap_npy(struct npy_matrix *matrix);
+
+// Reads the header of the file without mapping it, for the points streamed
+// with k_means_stream. Returns a file descriptor on the file whose values
+// start at data_offset, or -1 on failure.
+int open_npy(const char *filename, struct npy_matrix *matrix,
+             off_t *data_offset);
+
+// Writes rows * columns values of the given type, a single column is written
+// as a vector
+bool write_npy(const char *filename, enum npy_type type, size_t rows,
+               size_t columns, const void *data);
+
+#endif // K_MEANS_NPY_H_
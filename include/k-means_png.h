@@ -2,12 +2,87 @@
 #define K_MEANS_PNG_H_
 
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
-bool read_png(const char *filename, uint16_t **image, uint32_t *height,
-              uint32_t *width);
+enum png_point_type {
+  png_points_float,   // Samples from 0 to 65535 whatever the bit depth
+  png_points_double,  // Same range
+  png_points_integer, // Replaced by the type matching the bit depth
+  png_points_uint8,   // Samples of the images up to 8 bits
+  png_points_uint16,  // Samples of the 16 bits images
+  // Float samples rounded to 16 bits floats by the caller, never decoded
+  png_points_half,
+  png_points_bfloat16,
+};
+
+// Where the channels of the decoded image went: channel c is the coordinate
+// source[c] of the points, or the sample constant[c] over the whole image when
+// source[c] is not below the dimension. The channels are grey, grey and alpha,
+// RGB or RGBA.
+struct png_channels {
+  unsigned channels;
+  size_t source[4];
+  uint16_t constant[4];
+};
+
+// Decode the image row by row into height * width points with coordinates of
+// the given type. The points keep the channels which vary over the image and
+// do not repeat a previous channel, an opaque RGB image has a dimension of 3
+// and a grey one of 1. channels may be NULL.
+bool read_png_points(const char *filename, enum png_point_type *type,
+                     void **points, uint32_t *height, uint32_t *width,
+                     size_t *dimension, struct png_channels *channels);
+
+// Size in bytes of a coordinate of the given type
+size_t png_point_value_size(enum png_point_type type);
+
+// Halve the image with a 2x2 box filter, the last row or column of an odd
+// size is averaged alone. Returns the (height + 1) / 2 * (width + 1) / 2
+// points, the integer samples are rounded to the nearest.
+void *downsample_png_points(enum png_point_type type, const void *points,
+                            uint32_t height, uint32_t width, size_t dimension,
+                            uint32_t *half_height, uint32_t *half_width);
 
 bool write_grey_png(const char *filename, uint32_t height, uint32_t width,
                     uint8_t image[height][width]);
 
+enum png_filter {
+  png_filter_none,
+  png_filter_sub,
+  png_filter_up,
+  png_filter_average,
+  png_filter_paeth,
+  png_filter_adaptive, // The filter minimizing the sum of every row
+  png_filter_default,  // Adaptive for grey levels and none for palettes
+};
+
+// zlib settings of the encoder. The rows are split in threads strips which are
+// filtered and compressed in parallel, each strip starting from the last 32KB
+// of the previous one as the deflate dictionary.
+struct png_encoder {
+  int level;    // 0 to 9, Z_DEFAULT_COMPRESSION (-1) for zlib's default
+  int strategy; // Z_DEFAULT_STRATEGY, Z_FILTERED, Z_HUFFMAN_ONLY, Z_RLE...
+  enum png_filter filter;
+  unsigned threads;
+};
+
+#define PNG_ENCODER_DEFAULT                                                    \
+  { .level = -1, .strategy = 0, .filter = png_filter_default, .threads = 1 }
+
+// Colours of the centroids (k rows of dimension coordinates of the points
+// read with the given type and channels) as RGBA palette entries
+void png_palette(const struct png_channels *channels, enum png_point_type type,
+                 size_t k, size_t dimension, const double *centroids,
+                 uint8_t palette[k][4]);
+
+// The labels of a k-means run (see k_means_label), as an image indexing the
+// palette of k colours on 1, 2, 4 or 8 bits with at most 256 centroids, or as
+// grey levels spread from 0 to 255 when palette is NULL. A NULL encoder uses
+// PNG_ENCODER_DEFAULT.
+bool write_labels_png(const char *filename, uint32_t height, uint32_t width,
+                      size_t k, const void *point_to_centroid_map,
+                      const uint8_t (*palette)[4],
+                      const struct png_encoder *encoder);
+
 #endif // K_MEANS_PNG_H_
@@ -0,0 +1,41 @@
+#ifndef K_MEANS_SYNTHETIC_H_
+#define K_MEANS_SYNTHETIC_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct synthetic_options {
+  size_t points, dimension;
+  // Gaussian blobs whose centres are uniform in [0, max)^dimension, 0 draws
+  // every value uniformly in [0, max)
+  size_t blobs;
+  double max;
+  // Standard deviation of the blobs, relative to max
+  double spread;
+  // Ratio of the weights of the largest and the smallest blob, 1 draws the
+  // points of every blob with the same probability
+  double imbalance;
+  unsigned long seed;
+  unsigned threads;
+};
+
+#define SYNTHETIC_DEFAULT_OPTIONS                                             \
+  ((struct synthetic_options){.blobs = 0,                                     \
+                              .max = 250.,                                    \
+                              .spread = .05,                                  \
+                              .imbalance = 1.,                                \
+                              .seed = 42,                                     \
+                              .threads = 1})
+
+// Fills the points * dimension values, and the blob of every point when labels
+// is not NULL (0 without blobs). Every value is drawn from a counter based
+// generator indexed by the seed, the point and the dimension, the threads
+// fill slices of the points and the data does not depend on their number.
+// Returns false when out of memory or when a thread could not be created.
+bool synthetic_points_f(const struct synthetic_options *options, float *data,
+                        uint32_t *labels);
+bool synthetic_points_d(const struct synthetic_options *options, double *data,
+                        uint32_t *labels);
+
+#endif // K_MEANS_SYNTHETIC_H_
@@ -37,11 +37,23 @@ set(ADDITIONAL_DEBUG_COMPILE_OPTIONS
   CACHE INTERNAL "String"
   )
 
-set(ADDITIONAL_RELEASE_COMPILE_OPTIONS
-  "-O3"
-  "-march=native"
-  CACHE INTERNAL "String"
-  )
+# The distance kernels are selected at runtime, the default build can be
+# shipped to other processors. Enable this option to tune the rest of the code
+# for the building machine.
+option(USE_NATIVE_ARCH "Tune the release build for the building machine" OFF)
+
+if (USE_NATIVE_ARCH)
+  set(ADDITIONAL_RELEASE_COMPILE_OPTIONS
+    "-O3"
+    "-march=native"
+    CACHE INTERNAL "String"
+    )
+else()
+  set(ADDITIONAL_RELEASE_COMPILE_OPTIONS
+    "-O3"
+    CACHE INTERNAL "String"
+    )
+endif()
 
 set(ADDITIONAL_RELEASE_LINK_OPTIONS
   "-Wl,-z,now")
@@ -21,175 +21,942 @@
  *
  */
 
+#ifdef __linux__
+#define _GNU_SOURCE // Thread affinity
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <float.h>
 #include <math.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <unistd.h>
 
 #include <stdio.h>
 
+#ifdef __linux__
+#include <sched.h>
+#endif
+
+#if defined(K_MEANS_STATS) && defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#endif
+
 #include "k-means.h"
+#include "k-means_kernels.h"
+#include "time_measurement.h"
+
+static const struct k_means_config k_means_default_config =
+    K_MEANS_DEFAULT_CONFIG;
+
+static unsigned k_means_clamp_threads(size_t points, unsigned num_threads) {
+  if (num_threads == 0)
+    num_threads = 1;
+  if (points != 0 && num_threads > points)
+    num_threads = (unsigned)points;
+  return num_threads;
+}
+
+// Counter based generator: the n-th number of a stream is a hash of the seed,
+// the stream and n, so that any thread can draw it without synchronization.
+#define K_MEANS_PARALLEL_ROUNDS 5
+
+enum k_means_stream {
+  k_means_stream_random,
+  k_means_stream_plusplus,
+  k_means_stream_recluster,
+  k_means_stream_parallel, // One more stream per k-means|| round
+  k_means_stream_sample = k_means_stream_parallel + 1 + K_MEANS_PARALLEL_ROUNDS,
+};
+
+// The persistent sums of k_means_config.delta_update are recomputed from every
+// point at this period to bound the rounding drift of the additions and
+// subtractions
+#define K_MEANS_DELTA_RENORMALIZATION_PERIOD 16
+
+// The streamed points are read in chunks of this size by default, and seeded
+// with k-means++ or k-means|| from a sample of this many points per centroid
+#define K_MEANS_STREAM_CHUNK_BYTES ((size_t)16 << 20)
+#define K_MEANS_STREAM_SAMPLE_PER_CENTROID 64
+
+// The GEMM assignment finds the nearest centroids of blocks of this many
+// points, every panel of centroids being reused by the whole block
+#define K_MEANS_GEMM_BLOCK 64
+
+// Restarts are not abandoned before this iteration, the first ones mostly
+// reflect the seeding
+#define K_MEANS_RESTART_GRACE_ITERATIONS 3
+
+// Yinyang groups are searched with the distances kernel, hence larger than the
+// ten centroids suggested by the paper
+#define K_MEANS_YINYANG_GROUP_SIZE 64
+#define K_MEANS_YINYANG_GROUPING_ITERATIONS 5
+
+__attribute__((const)) static inline uint64_t k_means_mix(uint64_t value) {
+  // splitmix64 finalizer
+  value += 0x9e3779b97f4a7c15u;
+  value = (value ^ (value >> 30)) * 0xbf58476d1ce4e5b9u;
+  value = (value ^ (value >> 27)) * 0x94d049bb133111ebu;
+  return value ^ (value >> 31);
+}
+
+// Uniform in [0, 1)
+__attribute__((const)) static inline double
+k_means_uniform(unsigned long seed, uint64_t stream, uint64_t counter) {
+  uint64_t bits =
+      k_means_mix(k_means_mix(k_means_mix(seed) ^ stream) ^ counter);
+  return (double)(bits >> 11) * 0x1.0p-53;
+}
+
+// Uniform in [0, bound)
+__attribute__((const)) static inline size_t
+k_means_uniform_index(unsigned long seed, uint64_t stream, uint64_t counter,
+                      size_t bound) {
+  size_t index = (size_t)(k_means_uniform(seed, stream, counter) * (double)bound);
+  return index < bound ? index : bound - 1;
+}
 
-static void initialize_centroids_float(size_t points, size_t dimension,
-                                       uint8_t k, float data[points][dimension],
-                                       float centroids[k][dimension]) {
-  for (size_t i = 0; i < k; ++i) {
-    long int randval = random();
-    double random_position = (double)randval;
-    random_position /= (double)RAND_MAX;
-    random_position *= (double)points;
-    size_t random_position_unsigned = (size_t)random_position;
-    for (size_t j = 0; j < dimension; ++j) {
-      centroids[i][j] = data[random_position_unsigned][j];
+// The labels are stored on label_size = K_MEANS_LABEL_SIZE(k) bytes
+__attribute__((always_inline)) static inline size_t
+k_means_get_label(const void *map, unsigned label_size, size_t pos) {
+  switch (label_size) {
+  case 1:
+    return ((const uint8_t *)map)[pos];
+  case 2:
+    return ((const uint16_t *)map)[pos];
+  default:
+    return ((const uint32_t *)map)[pos];
+  }
+}
+
+__attribute__((always_inline)) static inline void
+k_means_set_label(void *map, unsigned label_size, size_t pos, size_t label) {
+  switch (label_size) {
+  case 1:
+    ((uint8_t *)map)[pos] = (uint8_t)label;
+    break;
+  case 2:
+    ((uint16_t *)map)[pos] = (uint16_t)label;
+    break;
+  default:
+    ((uint32_t *)map)[pos] = (uint32_t)label;
+    break;
+  }
+}
+
+// Number of occurrences of a point, see k_means_config.weights
+__attribute__((always_inline)) static inline uint32_t
+k_means_weight(const uint32_t *weights, size_t pos) {
+  return weights != NULL ? weights[pos] : 1;
+}
+
+// Scratch memory of a context. The blocks are carved from a single buffer
+// aligned on cache lines and all released at the start of the next run. The
+// blocks which do not fit are allocated separately, the buffer then grows to
+// the peak usage on the next reset so that a run of the same size does not
+// allocate memory. A block which could not be allocated is NULL and marks the
+// arena as failed until the next reset.
+struct k_means_arena {
+  char *buffer;
+  size_t capacity, used;
+  void **overflow;
+  size_t num_overflow, overflow_capacity, overflow_size;
+  bool failed;
+};
+
+struct k_means_context {
+  struct k_means_arena arena;
+  const void *centroids; // In the arena, k * dimension values
+  size_t centroid_size;  // sizeof(float) or sizeof(double)
+  double inertia;
+};
+
+// NULL when out of memory
+static void *k_means_aligned_alloc(size_t size) {
+  void *block = aligned_alloc(K_MEANS_KERNEL_ALIGNMENT, size);
+  if (block == NULL)
+    fprintf(stderr, "Failed to allocate %zu bytes of k-means scratch memory\n",
+            size);
+  return block;
+}
+
+static void *k_means_arena_alloc(struct k_means_arena *arena, size_t size) {
+  size = size == 0 ? K_MEANS_KERNEL_ALIGNMENT
+                  : (size + K_MEANS_KERNEL_ALIGNMENT - 1) /
+                        K_MEANS_KERNEL_ALIGNMENT * K_MEANS_KERNEL_ALIGNMENT;
+  if (arena->capacity - arena->used >= size) {
+    void *block = arena->buffer + arena->used;
+    arena->used += size;
+    return block;
+  }
+  if (arena->num_overflow == arena->overflow_capacity) {
+    size_t capacity = 2 * arena->overflow_capacity + 8;
+    void **overflow =
+        realloc(arena->overflow, capacity * sizeof(*arena->overflow));
+    if (overflow == NULL) {
+      fprintf(stderr, "Failed to allocate the k-means scratch memory\n");
+      arena->failed = true;
+      return NULL;
     }
+    arena->overflow = overflow;
+    arena->overflow_capacity = capacity;
+  }
+  void *block = k_means_aligned_alloc(size);
+  if (block == NULL) {
+    arena->failed = true;
+    return NULL;
+  }
+  arena->overflow[arena->num_overflow++] = block;
+  arena->overflow_size += size;
+  return block;
+}
+
+static void *k_means_arena_calloc(struct k_means_arena *arena, size_t count,
+                                  size_t size) {
+  void *block = k_means_arena_alloc(arena, count * size);
+  if (block != NULL)
+    memset(block, 0, count * size);
+  return block;
+}
+
+static void k_means_arena_reset(struct k_means_arena *arena) {
+  if (arena->num_overflow != 0) {
+    size_t peak = arena->used + arena->overflow_size;
+    for (size_t i = 0; i < arena->num_overflow; ++i)
+      free(arena->overflow[i]);
+    arena->num_overflow = 0;
+    arena->overflow_size = 0;
+    free(arena->buffer);
+    // Without the larger buffer the blocks are allocated separately again
+    arena->buffer = k_means_aligned_alloc(peak);
+    arena->capacity = arena->buffer != NULL ? peak : 0;
   }
+  arena->used = 0;
+  arena->failed = false;
 }
 
-static void initialize_centroids_double(size_t points, size_t dimension,
-                                        uint8_t k,
-                                        double data[points][dimension],
-                                        double centroids[k][dimension]) {
-  for (size_t i = 0; i < k; ++i) {
-    long int randval = random();
-    double random_position = (double)randval;
-    random_position /= (double)RAND_MAX;
-    random_position *= (double)points;
-    size_t random_position_unsigned = (size_t)random_position;
-    for (size_t j = 0; j < dimension; ++j) {
-      centroids[i][j] = data[random_position_unsigned][j];
+static void k_means_arena_release(struct k_means_arena *arena) {
+  for (size_t i = 0; i < arena->num_overflow; ++i)
+    free(arena->overflow[i]);
+  free(arena->overflow);
+  free(arena->buffer);
+  *arena = (struct k_means_arena){0};
+}
+
+struct k_means_context *k_means_context_create(void) {
+  return calloc(1, sizeof(struct k_means_context));
+}
+
+void k_means_context_destroy(struct k_means_context *context) {
+  if (context == NULL)
+    return;
+  k_means_arena_release(&context->arena);
+  free(context);
+}
+
+double k_means_context_inertia(const struct k_means_context *context) {
+  return context->inertia;
+}
+
+static uint64_t k_means_hash_row(const unsigned char *row, size_t row_size) {
+  uint64_t hash = row_size;
+  size_t byte = 0;
+  for (; byte + sizeof(uint64_t) <= row_size; byte += sizeof(uint64_t)) {
+    uint64_t chunk;
+    memcpy(&chunk, row + byte, sizeof(chunk));
+    hash = k_means_mix(hash ^ chunk);
+  }
+  if (byte < row_size) {
+    uint64_t chunk = 0;
+    memcpy(&chunk, row + byte, row_size - byte);
+    hash = k_means_mix(hash ^ chunk);
+  }
+  return hash;
+}
+
+// Open addressing on a table of at least twice the number of points
+size_t k_means_unique_points(size_t points, size_t row_size,
+                             const void *data, void *unique, uint32_t *weights,
+                             uint32_t *point_unique) {
+  if (points >= UINT32_MAX) {
+    fprintf(stderr, "Too many points to merge: %zu\n", points);
+    return K_MEANS_ERROR;
+  }
+  size_t capacity = 16;
+  while (capacity < 2 * points)
+    capacity *= 2;
+  uint32_t *table = malloc(capacity * sizeof(*table));
+  if (table == NULL) {
+    fprintf(stderr, "Failed to allocate the table of the distinct points\n");
+    return K_MEANS_ERROR;
+  }
+  memset(table, 0xff, capacity * sizeof(*table));
+
+  const unsigned char *rows = data;
+  unsigned char *unique_rows = unique;
+  size_t num_unique = 0;
+  for (size_t point = 0; point < points; ++point) {
+    const unsigned char *row = rows + point * row_size;
+    size_t slot = (size_t)k_means_hash_row(row, row_size) & (capacity - 1);
+    while (table[slot] != UINT32_MAX &&
+           memcmp(unique_rows + table[slot] * row_size, row, row_size) != 0)
+      slot = (slot + 1) & (capacity - 1);
+    if (table[slot] == UINT32_MAX) {
+      table[slot] = (uint32_t)num_unique;
+      memcpy(unique_rows + num_unique * row_size, row, row_size);
+      weights[num_unique++] = 0;
     }
+    weights[table[slot]] += 1;
+    point_unique[point] = table[slot];
   }
+  free(table);
+  return num_unique;
 }
 
-size_t k_means_d(size_t points, size_t dimension, uint8_t k,
-                 double data[restrict points][dimension],
-                 uint8_t point_centroid_map[points]) {
+void k_means_scatter_labels(size_t points, size_t k,
+                            const uint32_t *point_unique,
+                            const void *unique_to_centroid_map,
+                            void *point_to_centroid_map) {
+  const unsigned label_size = K_MEANS_LABEL_SIZE(k);
+  for (size_t point = 0; point < points; ++point)
+    k_means_set_label(point_to_centroid_map, label_size, point,
+                      k_means_get_label(unique_to_centroid_map, label_size,
+                                        point_unique[point]));
+}
 
-  double(*centroids_temp)[dimension] = malloc(sizeof(double[k][dimension]));
-  double (*centroids)[dimension] = malloc(sizeof(double[k][dimension]));
-  size_t *centroids_point_count = malloc(k * sizeof(*centroids_point_count));
+// Concurrent restarts report their inertia after every iteration and wait for
+// each other, a restart is then compared to the lowest inertia of the same
+// iteration whatever the speed of the threads
+struct k_means_restarts {
+  pthread_mutex_t mutex;
+  pthread_cond_t gathered;
+  unsigned active, arrived;
+  uint64_t generation;
+  double lowest, gathered_lowest;
+  double abandon_margin;
+};
+
+// Called with the mutex held once every active restart arrived
+static void k_means_restarts_gather(struct k_means_restarts *restarts) {
+  restarts->gathered_lowest = restarts->lowest;
+  restarts->lowest = HUGE_VAL;
+  restarts->arrived = 0;
+  restarts->generation += 1;
+  pthread_cond_broadcast(&restarts->gathered);
+}
 
-  initialize_centroids_double(points, dimension, k, data, centroids);
+// Whether the restart is clearly losing and should be abandoned
+static bool k_means_restarts_report(struct k_means_restarts *restarts,
+                                    size_t iteration, double inertia) {
+  pthread_mutex_lock(&restarts->mutex);
+  if (inertia < restarts->lowest)
+    restarts->lowest = inertia;
+  restarts->arrived += 1;
+  if (restarts->arrived == restarts->active) {
+    k_means_restarts_gather(restarts);
+  } else {
+    uint64_t generation = restarts->generation;
+    while (generation == restarts->generation)
+      pthread_cond_wait(&restarts->gathered, &restarts->mutex);
+  }
+  double lowest = restarts->gathered_lowest;
+  pthread_mutex_unlock(&restarts->mutex);
+  return restarts->abandon_margin > 0. &&
+         iteration >= K_MEANS_RESTART_GRACE_ITERATIONS &&
+         inertia > (1. + restarts->abandon_margin) * lowest;
+}
 
-  bool has_converged;
+// A stopped restart is no longer waited for
+static void k_means_restarts_leave(struct k_means_restarts *restarts) {
+  pthread_mutex_lock(&restarts->mutex);
+  restarts->active -= 1;
+  if (restarts->active != 0 && restarts->arrived == restarts->active)
+    k_means_restarts_gather(restarts);
+  pthread_mutex_unlock(&restarts->mutex);
+}
 
-  size_t convergence_iterations = 0;
-  do {
+// A run which failed before its first iteration holds no centroids, and its
+// restart is no longer waited for
+static size_t k_means_failed_run(struct k_means_context *context,
+                                 struct k_means_restarts *restarts) {
+  context->centroids = NULL;
+  context->centroid_size = 0;
+  context->inertia = 0.;
+  if (restarts != NULL)
+    k_means_restarts_leave(restarts);
+  return K_MEANS_ERROR;
+}
 
-    memset(centroids_point_count, 0, k * sizeof(*centroids_point_count));
+static bool k_means_spawn_worker(pthread_t *thread, void *(*worker)(void *),
+                                 void *arg) {
+  int error = pthread_create(thread, NULL, worker, arg);
+  if (error != 0)
+    fprintf(stderr, "Failed to create a k-means worker thread: %s\n",
+            strerror(error));
+  return error == 0;
+}
 
-    has_converged = true; // Assume convergence until proven otherwise
-    // For every data
-    for (size_t pos = 0; pos < points; ++pos) {
+// Holds the spawned workers until every one of them was created. When one
+// could not be, they all return rather than waiting at a barrier for it.
+struct k_means_launch {
+  pthread_mutex_t mutex;
+  pthread_cond_t decided;
+  bool pending, failed;
+};
+
+static void k_means_launch_init(struct k_means_launch *launch) {
+  pthread_mutex_init(&launch->mutex, NULL);
+  pthread_cond_init(&launch->decided, NULL);
+  launch->pending = true;
+  launch->failed = false;
+}
 
-      uint8_t centroid_chosen = 0;
-      double closest_centroid = HUGE_VAL;
-      // Find the closest centroid
-      for (uint8_t centro = 0; centro < k; ++centro) {
-        double distance_square = 0.f;
-        for (size_t dim = 0; dim < dimension; ++dim) {
-          distance_square += (centroids[centro][dim] - data[pos][dim]) *
-                             (centroids[centro][dim] - data[pos][dim]);
-        }
-        if (distance_square < closest_centroid) {
-          closest_centroid = distance_square;
-          centroid_chosen = centro;
-        }
-      }
+static void k_means_launch_decide(struct k_means_launch *launch,
+                                  bool failed) {
+  pthread_mutex_lock(&launch->mutex);
+  launch->pending = false;
+  launch->failed = failed;
+  pthread_cond_broadcast(&launch->decided);
+  pthread_mutex_unlock(&launch->mutex);
+}
+
+// False when the worker has to return at once
+static bool k_means_launch_wait(struct k_means_launch *launch) {
+  pthread_mutex_lock(&launch->mutex);
+  while (launch->pending)
+    pthread_cond_wait(&launch->decided, &launch->mutex);
+  bool failed = launch->failed;
+  pthread_mutex_unlock(&launch->mutex);
+  return !failed;
+}
+
+static void k_means_launch_destroy(struct k_means_launch *launch) {
+  pthread_cond_destroy(&launch->decided);
+  pthread_mutex_destroy(&launch->mutex);
+}
+
+// Reads size bytes at offset, false on an error or at the end of the file
+static bool k_means_pread(int fd, off_t offset, void *buffer, size_t size) {
+  unsigned char *bytes = buffer;
+  while (size > 0) {
+    ssize_t read_size = pread(fd, bytes, size, offset);
+    if (read_size < 0 && errno == EINTR)
+      continue;
+    if (read_size <= 0)
+      return false;
+    bytes += read_size;
+    offset += read_size;
+    size -= (size_t)read_size;
+  }
+  return true;
+}
 
-      if (point_centroid_map[pos] != centroid_chosen)
-        has_converged = false;
-      point_centroid_map[pos] = centroid_chosen;
-      centroids_point_count[centroid_chosen] += 1;
-
-      if (centroids_point_count[centroid_chosen] == 1)
-        for (size_t dim = 0; dim < dimension; ++dim)
-          centroids_temp[centroid_chosen][dim] = data[pos][dim];
-      else
-        for (size_t dim = 0; dim < dimension; ++dim)
-          centroids_temp[centroid_chosen][dim] += data[pos][dim];
+// Reads the chunks of rows of a file in a background thread, while the
+// workers process the other buffer. The chunks are numbered from the start of
+// the first pass, chunk c being the chunk c % chunks of the file.
+struct k_means_reader {
+  pthread_t thread;
+  int fd;
+  off_t offset;
+  size_t row_size, points, chunk_points, chunks;
+  unsigned char *buffers[2];
+  // Chunk held by every buffer, or UINT64_MAX when it may be overwritten
+  uint64_t held[2];
+  uint64_t next_chunk;
+  bool stopped, failed;
+  pthread_mutex_t mutex;
+  pthread_cond_t changed;
+};
+
+static void *k_means_reader_thread(void *arg) {
+  struct k_means_reader *reader = arg;
+  pthread_mutex_lock(&reader->mutex);
+  while (!reader->stopped && !reader->failed) {
+    uint64_t chunk = reader->next_chunk;
+    unsigned buffer = chunk % 2;
+    if (reader->held[buffer] != UINT64_MAX) {
+      pthread_cond_wait(&reader->changed, &reader->mutex);
+      continue;
     }
+    pthread_mutex_unlock(&reader->mutex);
+    size_t first = (size_t)(chunk % reader->chunks) * reader->chunk_points;
+    size_t rows = reader->points - first < reader->chunk_points
+                      ? reader->points - first
+                      : reader->chunk_points;
+    bool read =
+        k_means_pread(reader->fd, reader->offset + (off_t)(first * reader->row_size),
+                      reader->buffers[buffer], rows * reader->row_size);
+    pthread_mutex_lock(&reader->mutex);
+    if (read) {
+      reader->held[buffer] = chunk;
+      reader->next_chunk += 1;
+    } else {
+      reader->failed = true;
+    }
+    pthread_cond_broadcast(&reader->changed);
+  }
+  pthread_mutex_unlock(&reader->mutex);
+  return NULL;
+}
+
+// False when the buffers or the thread could not be created
+static bool k_means_reader_start(struct k_means_reader *reader, int fd,
+                                 off_t offset, size_t row_size, size_t points,
+                                 size_t chunk_points) {
+  reader->fd = fd;
+  reader->offset = offset;
+  reader->row_size = row_size;
+  reader->points = points;
+  reader->chunk_points = chunk_points;
+  reader->chunks = (points + chunk_points - 1) / chunk_points;
+  for (unsigned buffer = 0; buffer < 2; ++buffer) {
+    reader->buffers[buffer] = k_means_aligned_alloc(
+        (chunk_points * row_size + K_MEANS_KERNEL_ALIGNMENT - 1) /
+        K_MEANS_KERNEL_ALIGNMENT * K_MEANS_KERNEL_ALIGNMENT);
+    reader->held[buffer] = UINT64_MAX;
+  }
+  if (reader->buffers[0] == NULL || reader->buffers[1] == NULL) {
+    free(reader->buffers[0]);
+    free(reader->buffers[1]);
+    return false;
+  }
+  reader->next_chunk = 0;
+  reader->stopped = false;
+  reader->failed = false;
+  pthread_mutex_init(&reader->mutex, NULL);
+  pthread_cond_init(&reader->changed, NULL);
+#ifdef POSIX_FADV_SEQUENTIAL
+  posix_fadvise(fd, offset, (off_t)(points * row_size), POSIX_FADV_SEQUENTIAL);
+#endif
+  if (!k_means_spawn_worker(&reader->thread, k_means_reader_thread, reader)) {
+    pthread_cond_destroy(&reader->changed);
+    pthread_mutex_destroy(&reader->mutex);
+    free(reader->buffers[0]);
+    free(reader->buffers[1]);
+    return false;
+  }
+  return true;
+}
+
+static int k_means_compare_index(const void *a, const void *b) {
+  size_t first = *(const size_t *)a, second = *(const size_t *)b;
+  return (first > second) - (first < second);
+}
 
-    for (uint8_t centro = 0; centro < k; ++centro) {
-      if (centroids_point_count[centro] != 0) {
-        double total_points = (double)centroids_point_count[centro];
-        for (size_t dim = 0; dim < dimension; ++dim)
-          centroids[centro][dim] = centroids_temp[centro][dim] / total_points;
+// Rows of the chunk, waits for the reader and adds the time waited. NULL when
+// the file could not be read.
+static const void *k_means_reader_acquire(struct k_means_reader *reader,
+                                          uint64_t chunk, double *wait_time) {
+  time_measure start, end;
+  get_current_time(&start);
+  unsigned buffer = chunk % 2;
+  pthread_mutex_lock(&reader->mutex);
+  while (reader->held[buffer] != chunk && !reader->failed)
+    pthread_cond_wait(&reader->changed, &reader->mutex);
+  bool failed = reader->held[buffer] != chunk;
+  pthread_mutex_unlock(&reader->mutex);
+  if (failed) {
+    fprintf(stderr, "Failed to read the streamed points\n");
+    return NULL;
+  }
+  get_current_time(&end);
+  *wait_time += measuring_difftime(start, end);
+  return reader->buffers[buffer];
+}
+
+// The buffer of the chunk may be overwritten by the next one
+static void k_means_reader_release(struct k_means_reader *reader,
+                                   uint64_t chunk) {
+  pthread_mutex_lock(&reader->mutex);
+  reader->held[chunk % 2] = UINT64_MAX;
+  pthread_cond_broadcast(&reader->changed);
+  pthread_mutex_unlock(&reader->mutex);
+}
+
+static void k_means_reader_stop(struct k_means_reader *reader) {
+  pthread_mutex_lock(&reader->mutex);
+  reader->stopped = true;
+  pthread_cond_broadcast(&reader->changed);
+  pthread_mutex_unlock(&reader->mutex);
+  pthread_join(reader->thread, NULL);
+  pthread_cond_destroy(&reader->changed);
+  pthread_mutex_destroy(&reader->mutex);
+  free(reader->buffers[0]);
+  free(reader->buffers[1]);
+}
+
+// NUMA nodes with processors, read once from /sys/devices/system/node. A
+// single node, for which the threads are never bound, when unavailable.
+#define K_MEANS_MAX_NUMA_NODES 64
+
+static struct {
+  unsigned nodes;
+#ifdef __linux__
+  cpu_set_t cpus[K_MEANS_MAX_NUMA_NODES];
+#endif
+} k_means_numa;
+static pthread_once_t k_means_numa_once = PTHREAD_ONCE_INIT;
+
+#ifdef __linux__
+// Reads a list of ids such as 0-3,8,10-11
+static bool k_means_read_id_list(const char *path, cpu_set_t *ids) {
+  FILE *file = fopen(path, "r");
+  if (file == NULL)
+    return false;
+  CPU_ZERO(ids);
+  bool valid = false;
+  unsigned first, last;
+  while (fscanf(file, "%u", &first) == 1) {
+    last = first;
+    int separator = fgetc(file);
+    if (separator == '-') {
+      if (fscanf(file, "%u", &last) != 1)
+        break;
+      separator = fgetc(file);
+    }
+    for (unsigned id = first; id <= last && id < CPU_SETSIZE; ++id)
+      CPU_SET(id, ids);
+    valid = true;
+    if (separator != ',')
+      break;
+  }
+  fclose(file);
+  return valid;
+}
+#endif
+
+static void k_means_numa_discover(void) {
+  k_means_numa.nodes = 0;
+#ifdef __linux__
+  cpu_set_t online, allowed;
+  if (k_means_read_id_list("/sys/devices/system/node/online", &online) &&
+      sched_getaffinity(0, sizeof(allowed), &allowed) == 0) {
+    for (unsigned node = 0;
+         node < CPU_SETSIZE && k_means_numa.nodes < K_MEANS_MAX_NUMA_NODES;
+         ++node) {
+      if (!CPU_ISSET(node, &online))
+        continue;
+      char path[64];
+      snprintf(path, sizeof(path), "/sys/devices/system/node/node%u/cpulist",
+               node);
+      // Only the processors the process may run on, the memory only nodes
+      // are skipped
+      cpu_set_t *cpus = &k_means_numa.cpus[k_means_numa.nodes];
+      if (k_means_read_id_list(path, cpus)) {
+        CPU_AND(cpus, cpus, &allowed);
+        if (CPU_COUNT(cpus) > 0)
+          k_means_numa.nodes += 1;
       }
     }
-    convergence_iterations += 1;
+  }
+#endif
+  if (k_means_numa.nodes == 0)
+    k_means_numa.nodes = 1;
+}
+
+// Nodes the num_threads workers are spread over
+static unsigned k_means_numa_nodes(unsigned num_threads) {
+  pthread_once(&k_means_numa_once, k_means_numa_discover);
+  return k_means_numa.nodes < num_threads ? k_means_numa.nodes : num_threads;
+}
 
-  } while (!has_converged);
+// The workers are assigned to the nodes in contiguous blocks, like the points
+// to the workers, so that a node holds the points of its workers
+static unsigned k_means_numa_node(unsigned thread, unsigned num_threads,
+                                  unsigned nodes) {
+  return (unsigned)((uint64_t)thread * nodes / num_threads);
+}
 
-  free(centroids_temp);
-  free(centroids_point_count);
-  free(centroids);
+// Restricts the calling thread to the processors of the node
+static void k_means_numa_bind(unsigned node, unsigned nodes) {
+#ifdef __linux__
+  if (nodes > 1)
+    pthread_setaffinity_np(pthread_self(), sizeof(k_means_numa.cpus[node]),
+                           &k_means_numa.cpus[node]);
+#else
+  (void)node;
+  (void)nodes;
+#endif
+}
 
-  return convergence_iterations;
+// The calling thread acts as the first worker, its affinity is restored
+// after the run
+#ifdef __linux__
+typedef cpu_set_t k_means_affinity;
+#else
+typedef int k_means_affinity;
+#endif
+
+static void k_means_affinity_save(k_means_affinity *affinity) {
+#ifdef __linux__
+  pthread_getaffinity_np(pthread_self(), sizeof(*affinity), affinity);
+#else
+  (void)affinity;
+#endif
 }
 
-size_t k_means_f(size_t points, size_t dimension, uint8_t k,
-                 float data[restrict points][dimension],
-                 uint8_t point_centroid_map[points]) {
+static void k_means_affinity_restore(const k_means_affinity *affinity) {
+#ifdef __linux__
+  pthread_setaffinity_np(pthread_self(), sizeof(*affinity), affinity);
+#else
+  (void)affinity;
+#endif
+}
 
-  float(*centroids_temp)[dimension] = malloc(sizeof(float[k][dimension]));
-  size_t *centroids_point_count = malloc(k * sizeof(*centroids_point_count));
-  float (*centroids)[dimension] = malloc(sizeof(float[k][dimension]));
+struct k_means_numa_touch {
+  pthread_t thread;
+  unsigned char *begin, *end;
+  unsigned node, nodes;
+};
+
+static void *k_means_numa_touch(void *arg) {
+  struct k_means_numa_touch *touch = arg;
+  k_means_numa_bind(touch->node, touch->nodes);
+  memset(touch->begin, 0, (size_t)(touch->end - touch->begin));
+  return NULL;
+}
 
-  initialize_centroids_float(points, dimension, k, data, centroids);
+static size_t k_means_numa_size(size_t points, size_t row_size) {
+  size_t size = points * row_size;
+  return size == 0 ? 1 : size;
+}
 
-  bool has_converged;
+void *k_means_numa_alloc(size_t points, size_t row_size,
+                         unsigned num_threads) {
+  size_t size = k_means_numa_size(points, row_size);
+  unsigned char *data = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (data == MAP_FAILED)
+    return NULL;
+  // The first write of a page places it on the node of the writing thread,
+  // every worker touches the rows it will be given
+  num_threads = k_means_clamp_threads(points, num_threads);
+  unsigned nodes = k_means_numa_nodes(num_threads);
+  if (nodes > 1) {
+    struct k_means_numa_touch *touches =
+        malloc(num_threads * sizeof(*touches));
+    if (touches == NULL) {
+      munmap(data, size);
+      return NULL;
+    }
+    for (unsigned thread = 0; thread < num_threads; ++thread) {
+      touches[thread] = (struct k_means_numa_touch){
+          .begin = data + points * thread / num_threads * row_size,
+          .end = data + points * (thread + 1) / num_threads * row_size,
+          .node = k_means_numa_node(thread, num_threads, nodes),
+          .nodes = nodes,
+      };
+    }
+    // The rows of a thread which could not be created are touched by the
+    // calling thread, on its own node
+    unsigned spawned = 0;
+    while (spawned < num_threads &&
+           k_means_spawn_worker(&touches[spawned].thread, k_means_numa_touch,
+                                &touches[spawned]))
+      spawned += 1;
+    for (unsigned thread = spawned; thread < num_threads; ++thread)
+      memset(touches[thread].begin, 0,
+             (size_t)(touches[thread].end - touches[thread].begin));
+    for (unsigned thread = 0; thread < spawned; ++thread)
+      pthread_join(touches[thread].thread, NULL);
+    free(touches);
+  }
+  return data;
+}
 
-  size_t convergence_iterations = 0;
-  do {
+void k_means_numa_free(void *data, size_t points, size_t row_size) {
+  if (data != NULL)
+    munmap(data, k_means_numa_size(points, row_size));
+}
 
-    memset(centroids_point_count, 0, k * sizeof(size_t));
+#ifdef K_MEANS_STATS
+// Hardware counters of the calling thread, in user space
+enum k_means_counter {
+  k_means_counter_cycles,
+  k_means_counter_cache_misses,
+  k_means_num_counters,
+};
+
+struct k_means_counters {
+  int fd[k_means_num_counters];
+};
+
+static void k_means_counters_open(struct k_means_counters *counters,
+                                  bool enabled) {
+  for (int counter = 0; counter < k_means_num_counters; ++counter) {
+    counters->fd[counter] = -1;
+#ifdef __linux__
+    if (!enabled)
+      continue;
+    struct perf_event_attr attr = {
+        .type = PERF_TYPE_HARDWARE,
+        .size = sizeof(attr),
+        .config = counter == k_means_counter_cycles
+                      ? PERF_COUNT_HW_CPU_CYCLES
+                      : PERF_COUNT_HW_CACHE_MISSES,
+        .exclude_kernel = 1,
+        .exclude_hv = 1,
+    };
+    counters->fd[counter] =
+        (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+#else
+    (void)enabled;
+#endif
+  }
+}
 
-    has_converged = true; // Assume convergence until proven otherwise
-    // For every data
-    for (size_t pos = 0; pos < points; ++pos) {
+// -1 for the counters which could not be opened
+static void k_means_counters_read(const struct k_means_counters *counters,
+                                  int64_t values[k_means_num_counters]) {
+  for (int counter = 0; counter < k_means_num_counters; ++counter) {
+    values[counter] = -1;
+#ifdef __linux__
+    uint64_t value;
+    if (counters->fd[counter] >= 0 &&
+        read(counters->fd[counter], &value, sizeof(value)) ==
+            (ssize_t)sizeof(value))
+      values[counter] = (int64_t)value;
+#endif
+  }
+}
 
-      uint8_t centroid_chosen = 0;
-      float closest_centroid = HUGE_VALF;
-      // Find the closest centroid
-      for (uint8_t centro = 0; centro < k; ++centro) {
-        float distance_square = 0.f;
-        for (size_t dim = 0; dim < dimension; ++dim) {
-          distance_square += (centroids[centro][dim] - data[pos][dim]) *
-                             (centroids[centro][dim] - data[pos][dim]);
-        }
-        if (distance_square < closest_centroid) {
-          closest_centroid = distance_square;
-          centroid_chosen = centro;
-        }
-      }
+// Counts since start, -1 when unavailable
+static void k_means_counters_elapsed(const struct k_means_counters *counters,
+                                     const int64_t start[k_means_num_counters],
+                                     int64_t delta[k_means_num_counters]) {
+  k_means_counters_read(counters, delta);
+  for (int counter = 0; counter < k_means_num_counters; ++counter)
+    if (delta[counter] >= 0 && start[counter] >= 0)
+      delta[counter] -= start[counter];
+}
 
-      if (point_centroid_map[pos] != centroid_chosen)
-        has_converged = false;
-      point_centroid_map[pos] = centroid_chosen;
-      centroids_point_count[centroid_chosen] += 1;
-
-      if (centroids_point_count[centroid_chosen] == 1)
-        for (size_t dim = 0; dim < dimension; ++dim)
-          centroids_temp[centroid_chosen][dim] = data[pos][dim];
-      else
-        for (size_t dim = 0; dim < dimension; ++dim)
-          centroids_temp[centroid_chosen][dim] += data[pos][dim];
-    }
+static void k_means_counters_close(struct k_means_counters *counters) {
+#ifdef __linux__
+  for (int counter = 0; counter < k_means_num_counters; ++counter)
+    if (counters->fd[counter] >= 0)
+      close(counters->fd[counter]);
+#else
+  (void)counters;
+#endif
+}
+#endif
+
+// Every single precision engine has the GEMM assignment
+#define KM_TYPE float
+#define KM_DATA float
+#define KM_SUFFIX f
+#define KM_KERNEL_SUFFIX f
+#define KM_HUGE HUGE_VALF
+#define KM_EPSILON FLT_EPSILON
+#define KM_GEMM
+#include "k-means_engine.h"
+#undef KM_DATA
+#undef KM_SUFFIX
+
+// The 8 and 16 bits samples are exact in single precision
+#define KM_INTEGER_DATA
+#define KM_DATA uint8_t
+#define KM_SUFFIX u8
+#include "k-means_engine.h"
+#undef KM_DATA
+#undef KM_SUFFIX
+
+#define KM_DATA uint16_t
+#define KM_SUFFIX u16
+#include "k-means_engine.h"
+#undef KM_DATA
+#undef KM_SUFFIX
+#undef KM_INTEGER_DATA
+
+// The 16 bits floats are exact in single precision. The rows of 8 halves and
+// more are converted by the kernels, with F16C when the processor has it. A
+// bfloat16 is the high half of a float.
+static inline float k_means_bfloat16_to_float(k_means_bfloat16 value) {
+  union {
+    uint32_t bits;
+    float value;
+  } result = {.bits = (uint32_t)value.bits << 16};
+  return result.value;
+}
 
-    for (uint8_t centro = 0; centro < k; ++centro) {
-      if (centroids_point_count[centro] != 0) {
-        float total_points = (float)centroids_point_count[centro];
-        for (size_t dim = 0; dim < dimension; ++dim)
-          centroids[centro][dim] = centroids_temp[centro][dim] / total_points;
-      }
-    }
-    convergence_iterations += 1;
+static inline void k_means_load_half(size_t dimension,
+                                     const k_means_half *restrict point,
+                                     float *restrict buffer) {
+  if (dimension >= 8) {
+    k_means_kernels()->half_to_float(dimension, point, buffer);
+    return;
+  }
+  for (size_t dim = 0; dim < dimension; ++dim)
+    buffer[dim] = k_means_half_to_float(point[dim]);
+}
 
-  } while (!has_converged);
+static inline void k_means_load_bfloat16(size_t dimension,
+                                         const k_means_bfloat16 *restrict point,
+                                         float *restrict buffer) {
+  for (size_t dim = 0; dim < dimension; ++dim)
+    buffer[dim] = k_means_bfloat16_to_float(point[dim]);
+}
 
-  free(centroids_temp);
-  free(centroids_point_count);
-  free(centroids);
+#define KM_DATA k_means_half
+#define KM_SUFFIX h
+#define KM_LOAD(value) k_means_half_to_float(value)
+#define KM_LOAD_ROW k_means_load_half
+#include "k-means_engine.h"
+#undef KM_LOAD_ROW
+#undef KM_LOAD
+#undef KM_DATA
+#undef KM_SUFFIX
+
+#define KM_DATA k_means_bfloat16
+#define KM_SUFFIX bf16
+#define KM_LOAD(value) k_means_bfloat16_to_float(value)
+#define KM_LOAD_ROW k_means_load_bfloat16
+#include "k-means_engine.h"
+#undef KM_LOAD_ROW
+#undef KM_LOAD
+#undef KM_DATA
+#undef KM_SUFFIX
+#undef KM_GEMM
+#undef KM_EPSILON
+#undef KM_HUGE
+#undef KM_KERNEL_SUFFIX
+#undef KM_TYPE
+
+#define KM_TYPE double
+#define KM_DATA double
+#define KM_SUFFIX d
+#define KM_KERNEL_SUFFIX d
+#define KM_HUGE HUGE_VAL
+#define KM_EPSILON DBL_EPSILON
+#include "k-means_engine.h"
+#undef KM_EPSILON
+#undef KM_HUGE
+#undef KM_KERNEL_SUFFIX
+#undef KM_SUFFIX
+#undef KM_DATA
+#undef KM_TYPE
+
+void k_means_float_to_half(size_t count, const float *values,
+                           k_means_half *halves) {
+  k_means_kernels()->float_to_half(count, values, halves);
+}
 
-  return convergence_iterations;
+void k_means_float_to_bfloat16(size_t count, const float *values,
+                               k_means_bfloat16 *bfloats) {
+  for (size_t i = 0; i < count; ++i) {
+    union {
+      float value;
+      uint32_t bits;
+    } single = {.value = values[i]};
+    if ((single.bits & 0x7fffffff) > 0x7f800000) // NaN, kept quiet
+      bfloats[i].bits = (uint16_t)((single.bits >> 16) | 0x40);
+    else
+      bfloats[i].bits = (uint16_t)(
+          (single.bits + 0x7fff + ((single.bits >> 16) & 1)) >> 16);
+  }
 }
@@ -0,0 +1,642 @@
+#include <dirent.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "k-means_batch.h"
+#include "time_measurement.h"
+
+struct batch_image {
+  const char *input;
+  enum png_point_type type;
+  void *points;
+  uint32_t height, width;
+  size_t dimension;
+  struct png_channels channels;
+  void *labels;
+  uint8_t (*palette)[4];
+};
+
+// Bounded queue of images between two stages. The producers block while it is
+// full, and the consumers get NULL once it is empty and every producer left.
+struct batch_queue {
+  pthread_mutex_t mutex;
+  pthread_cond_t not_empty, not_full;
+  struct batch_image **images;
+  size_t capacity, first, count;
+  unsigned producers;
+};
+
+struct batch {
+  const struct batch_options *options;
+  char **files;
+  size_t num_files;
+  pthread_mutex_t mutex; // Protects the fields below
+  size_t next_file, failures;
+  double busy_time[batch_num_stages];
+  struct batch_queue decoded, clustered;
+};
+
+struct batch_thread {
+  pthread_t thread;
+  bool spawned;
+  struct batch *batch;
+  double busy_time;
+};
+
+static const char *const stage_names[] = {
+    [batch_decode] = "decode",
+    [batch_cluster] = "cluster",
+    [batch_encode] = "encode",
+};
+
+static bool batch_queue_init(struct batch_queue *queue, size_t capacity,
+                             unsigned producers) {
+  queue->images = malloc(capacity * sizeof(*queue->images));
+  if (queue->images == NULL) {
+    fprintf(stderr, "Failed to allocate a batch queue\n");
+    return false;
+  }
+  pthread_mutex_init(&queue->mutex, NULL);
+  pthread_cond_init(&queue->not_empty, NULL);
+  pthread_cond_init(&queue->not_full, NULL);
+  queue->capacity = capacity;
+  queue->first = 0;
+  queue->count = 0;
+  queue->producers = producers;
+  return true;
+}
+
+static void batch_queue_destroy(struct batch_queue *queue) {
+  pthread_mutex_destroy(&queue->mutex);
+  pthread_cond_destroy(&queue->not_empty);
+  pthread_cond_destroy(&queue->not_full);
+  free(queue->images);
+}
+
+static void batch_queue_push(struct batch_queue *queue,
+                             struct batch_image *image) {
+  pthread_mutex_lock(&queue->mutex);
+  while (queue->count == queue->capacity)
+    pthread_cond_wait(&queue->not_full, &queue->mutex);
+  queue->images[(queue->first + queue->count) % queue->capacity] = image;
+  queue->count += 1;
+  pthread_cond_signal(&queue->not_empty);
+  pthread_mutex_unlock(&queue->mutex);
+}
+
+static struct batch_image *batch_queue_pop(struct batch_queue *queue) {
+  pthread_mutex_lock(&queue->mutex);
+  while (queue->count == 0 && queue->producers != 0)
+    pthread_cond_wait(&queue->not_empty, &queue->mutex);
+  struct batch_image *image = NULL;
+  if (queue->count != 0) {
+    image = queue->images[queue->first];
+    queue->first = (queue->first + 1) % queue->capacity;
+    queue->count -= 1;
+    pthread_cond_signal(&queue->not_full);
+  }
+  pthread_mutex_unlock(&queue->mutex);
+  return image;
+}
+
+static void batch_queue_leave(struct batch_queue *queue) {
+  pthread_mutex_lock(&queue->mutex);
+  queue->producers -= 1;
+  if (queue->producers == 0)
+    pthread_cond_broadcast(&queue->not_empty);
+  pthread_mutex_unlock(&queue->mutex);
+}
+
+static void batch_image_free(struct batch_image *image) {
+  if (image == NULL)
+    return;
+  free(image->points);
+  free(image->labels);
+  free(image->palette);
+  free(image);
+}
+
+static void batch_failed(struct batch *batch, struct batch_image *image) {
+  pthread_mutex_lock(&batch->mutex);
+  batch->failures += 1;
+  pthread_mutex_unlock(&batch->mutex);
+  batch_image_free(image);
+}
+
+static void batch_thread_done(struct batch_thread *thread,
+                              enum batch_stage stage) {
+  pthread_mutex_lock(&thread->batch->mutex);
+  thread->batch->busy_time[stage] += thread->busy_time;
+  pthread_mutex_unlock(&thread->batch->mutex);
+}
+
+// The output of an image is named after it in the output directory, NULL when
+// out of memory
+static char *output_path(const char *directory, const char *input) {
+  const char *name = strrchr(input, '/');
+  name = name != NULL ? name + 1 : input;
+  size_t length = strlen(directory) + strlen(name) + 2;
+  char *output = malloc(length);
+  if (output == NULL) {
+    fprintf(stderr, "Failed to allocate the output path of %s\n", input);
+    return NULL;
+  }
+  snprintf(output, length, "%s/%s", directory, name);
+  return output;
+}
+
+// Palette of the single precision centroids of an image, NULL when out of
+// memory
+static uint8_t (*centroid_palette(const struct batch_image *image, size_t k,
+                                  const float *centroids_f))[4] {
+  double *centroids = malloc(k * image->dimension * sizeof(*centroids));
+  uint8_t(*palette)[4] = malloc(k * sizeof(*palette));
+  if (centroids == NULL || palette == NULL) {
+    fprintf(stderr, "Failed to allocate the palette of %s\n", image->input);
+    free(palette);
+    free(centroids);
+    return NULL;
+  }
+  for (size_t i = 0; i < k * image->dimension; ++i)
+    centroids[i] = centroids_f[i];
+  png_palette(&image->channels, image->type, k, image->dimension, centroids,
+              palette);
+  free(centroids);
+  return palette;
+}
+
+static void *batch_decoder(void *arg) {
+  struct batch_thread *thread = arg;
+  struct batch *batch = thread->batch;
+  while (true) {
+    pthread_mutex_lock(&batch->mutex);
+    size_t file = batch->next_file++;
+    pthread_mutex_unlock(&batch->mutex);
+    if (file >= batch->num_files)
+      break;
+
+    time_measure start, end;
+    get_current_time(&start);
+    struct batch_image *image = calloc(1, sizeof(*image));
+    if (image == NULL) {
+      fprintf(stderr, "Failed to allocate the image %s\n",
+              batch->files[file]);
+      batch_failed(batch, NULL);
+      continue;
+    }
+    image->input = batch->files[file];
+    image->type = batch->options->type;
+    bool decoded = read_png_points(image->input, &image->type, &image->points,
+                                   &image->height, &image->width,
+                                   &image->dimension, &image->channels);
+    get_current_time(&end);
+    thread->busy_time += measuring_difftime(start, end);
+    if (decoded)
+      batch_queue_push(&batch->decoded, image);
+    else
+      batch_failed(batch, image);
+  }
+  batch_queue_leave(&batch->decoded);
+  batch_thread_done(thread, batch_decode);
+  return NULL;
+}
+
+static void *batch_clusterer(void *arg) {
+  struct batch_thread *thread = arg;
+  struct batch *batch = thread->batch;
+  const struct batch_options *options = batch->options;
+  struct k_means_context *context = k_means_context_create();
+  struct batch_image *image;
+  while ((image = batch_queue_pop(&batch->decoded)) != NULL) {
+    time_measure start, end;
+    get_current_time(&start);
+    size_t points = (size_t)image->height * image->width;
+    image->labels = malloc(points * K_MEANS_LABEL_SIZE(options->k));
+    if (context == NULL || image->labels == NULL) {
+      fprintf(stderr, "Failed to allocate the labels of %s\n", image->input);
+      batch_failed(batch, image);
+      continue;
+    }
+    size_t iterations;
+    switch (image->type) {
+    case png_points_uint8:
+      iterations = k_means_with_context_u8(
+          context, points, image->dimension, options->k, image->points,
+          image->labels, &options->config, NULL);
+      break;
+    case png_points_uint16:
+      iterations = k_means_with_context_u16(
+          context, points, image->dimension, options->k, image->points,
+          image->labels, &options->config, NULL);
+      break;
+    default:
+      iterations = k_means_with_context_f(
+          context, points, image->dimension, options->k, image->points,
+          image->labels, &options->config, NULL);
+      break;
+    }
+    if (iterations == K_MEANS_ERROR) {
+      batch_failed(batch, image);
+      continue;
+    }
+    if (options->palette) {
+      image->palette = centroid_palette(image, options->k,
+                                        k_means_context_centroids_f(context));
+      if (image->palette == NULL) {
+        batch_failed(batch, image);
+        continue;
+      }
+    }
+    // The encoder only needs the labels and the palette
+    free(image->points);
+    image->points = NULL;
+    get_current_time(&end);
+    thread->busy_time += measuring_difftime(start, end);
+    batch_queue_push(&batch->clustered, image);
+  }
+  k_means_context_destroy(context);
+  batch_queue_leave(&batch->clustered);
+  batch_thread_done(thread, batch_cluster);
+  return NULL;
+}
+
+static void *batch_encoder(void *arg) {
+  struct batch_thread *thread = arg;
+  struct batch *batch = thread->batch;
+  const char *directory = batch->options->output_directory;
+  struct batch_image *image;
+  while ((image = batch_queue_pop(&batch->clustered)) != NULL) {
+    if (directory == NULL) {
+      batch_image_free(image);
+      continue;
+    }
+    time_measure start, end;
+    get_current_time(&start);
+    char *output = output_path(directory, image->input);
+    bool written =
+        output != NULL &&
+        write_labels_png(output, image->height, image->width,
+                         batch->options->k, image->labels,
+                         (const uint8_t(*)[4])image->palette,
+                         &batch->options->encoder);
+    free(output);
+    get_current_time(&end);
+    thread->busy_time += measuring_difftime(start, end);
+    if (written)
+      batch_image_free(image);
+    else
+      batch_failed(batch, image);
+  }
+  batch_thread_done(thread, batch_encode);
+  return NULL;
+}
+
+static int compare_string(const void *lhs, const void *rhs) {
+  return strcmp(*(char *const *)lhs, *(char *const *)rhs);
+}
+
+static bool add_file(char ***files, size_t *count, size_t *capacity,
+                     char *file) {
+  if (file == NULL) {
+    fprintf(stderr, "Failed to allocate the list of images\n");
+    return false;
+  }
+  if (*count == *capacity) {
+    size_t grown = *capacity != 0 ? 2 * *capacity : 64;
+    char **larger = realloc(*files, grown * sizeof(**files));
+    if (larger == NULL) {
+      fprintf(stderr, "Failed to allocate the list of images\n");
+      free(file);
+      return false;
+    }
+    *files = larger;
+    *capacity = grown;
+  }
+  (*files)[(*count)++] = file;
+  return true;
+}
+
+static void free_files(char **files, size_t count) {
+  for (size_t file = 0; file < count; ++file)
+    free(files[file]);
+  free(files);
+}
+
+// The png files of a directory in name order, or the lines of a file
+static bool list_files(const char *input, char ***files, size_t *count) {
+  size_t capacity = 0;
+  *files = NULL;
+  *count = 0;
+  struct stat input_stat;
+  if (stat(input, &input_stat) != 0) {
+    perror(input);
+    return false;
+  }
+  if (S_ISDIR(input_stat.st_mode)) {
+    DIR *directory = opendir(input);
+    if (directory == NULL) {
+      perror(input);
+      return false;
+    }
+    struct dirent *entry;
+    bool listed = true;
+    while (listed && (entry = readdir(directory)) != NULL) {
+      size_t length = strlen(entry->d_name);
+      if (length < 4 || strcmp(entry->d_name + length - 4, ".png") != 0)
+        continue;
+      char *path = malloc(strlen(input) + length + 2);
+      if (path != NULL)
+        sprintf(path, "%s/%s", input, entry->d_name);
+      listed = add_file(files, count, &capacity, path);
+    }
+    closedir(directory);
+    if (!listed) {
+      free_files(*files, *count);
+      return false;
+    }
+    qsort(*files, *count, sizeof(**files), compare_string);
+    return true;
+  }
+
+  FILE *list = fopen(input, "r");
+  if (list == NULL) {
+    perror(input);
+    return false;
+  }
+  char *line = NULL;
+  size_t line_capacity = 0;
+  ssize_t length;
+  bool listed = true;
+  while (listed && (length = getline(&line, &line_capacity, list)) != -1) {
+    while (length > 0 && (line[length - 1] == '\n' || line[length - 1] == '\r'))
+      line[--length] = '\0';
+    if (length != 0)
+      listed = add_file(files, count, &capacity, strdup(line));
+  }
+  free(line);
+  fclose(list);
+  if (!listed)
+    free_files(*files, *count);
+  return listed;
+}
+
+static bool batch_spawn(struct batch_thread *thread, void *(*stage)(void *)) {
+  int error = pthread_create(&thread->thread, NULL, stage, thread);
+  if (error != 0) {
+    fprintf(stderr, "Failed to create a batch thread: %s\n", strerror(error));
+    return false;
+  }
+  thread->spawned = true;
+  return true;
+}
+
+// A thread of the stage which was not created leaves the queue it would have
+// filled
+static void batch_abandon(struct batch *batch, enum batch_stage stage) {
+  if (stage == batch_decode)
+    batch_queue_leave(&batch->decoded);
+  else if (stage == batch_cluster)
+    batch_queue_leave(&batch->clustered);
+}
+
+bool run_batch(const struct batch_options *options) {
+  struct batch batch = {.options = options};
+  if (!list_files(options->input, &batch.files, &batch.num_files))
+    return false;
+  if (options->output_directory != NULL &&
+      mkdir(options->output_directory, 0777) != 0 && errno != EEXIST) {
+    perror(options->output_directory);
+    free_files(batch.files, batch.num_files);
+    return false;
+  }
+
+  void *(*const stages[])(void *) = {
+      [batch_decode] = batch_decoder,
+      [batch_cluster] = batch_clusterer,
+      [batch_encode] = batch_encoder,
+  };
+  unsigned first_thread[batch_num_stages], num_threads = 0;
+  for (int stage = 0; stage < batch_num_stages; ++stage) {
+    first_thread[stage] = num_threads;
+    num_threads += options->threads[stage];
+  }
+  struct batch_thread *threads = calloc(num_threads, sizeof(*threads));
+  bool queued = threads != NULL;
+  if (!queued)
+    fprintf(stderr, "Failed to allocate the batch threads\n");
+  else if (!batch_queue_init(&batch.decoded, options->queue_capacity,
+                             options->threads[batch_decode]))
+    queued = false;
+  else if (!batch_queue_init(&batch.clustered, options->queue_capacity,
+                             options->threads[batch_cluster])) {
+    batch_queue_destroy(&batch.decoded);
+    queued = false;
+  }
+  if (!queued) {
+    free(threads);
+    free_files(batch.files, batch.num_files);
+    return false;
+  }
+  pthread_mutex_init(&batch.mutex, NULL);
+
+  // The stages are created from the last one: a stage left without any thread
+  // could not take the images of the previous ones, which are not created
+  time_measure start, end;
+  get_current_time(&start);
+  bool complete = true, feeding = true;
+  for (int stage = batch_num_stages - 1; stage >= 0; --stage) {
+    bool failed = !feeding;
+    unsigned created = 0;
+    for (unsigned i = 0; i < options->threads[stage]; ++i) {
+      struct batch_thread *thread = &threads[first_thread[stage] + i];
+      thread->batch = &batch;
+      if (!failed && batch_spawn(thread, stages[stage])) {
+        created += 1;
+      } else {
+        failed = true;
+        batch_abandon(&batch, (enum batch_stage)stage);
+      }
+    }
+    complete = complete && !failed;
+    feeding = !failed || created != 0;
+  }
+  for (unsigned thread = 0; thread < num_threads; ++thread)
+    if (threads[thread].spawned)
+      pthread_join(threads[thread].thread, NULL);
+  get_current_time(&end);
+  // The images which were never decoded failed as well
+  if (batch.next_file < batch.num_files)
+    batch.failures += batch.num_files - batch.next_file;
+
+  double elapsed = measuring_difftime(start, end);
+  size_t processed = batch.num_files - batch.failures;
+  fprintf(stdout, "%zu images (%zu failed) in %.4fs, %.2f images/s\n",
+          processed, batch.failures, elapsed, (double)processed / elapsed);
+  for (int stage = 0; stage < batch_num_stages; ++stage)
+    fprintf(stdout, "%-7s %2u thread%s %5.1f%% busy\n", stage_names[stage],
+            options->threads[stage], options->threads[stage] > 1 ? "s" : " ",
+            100. * batch.busy_time[stage] /
+                (elapsed * options->threads[stage]));
+
+  free(threads);
+  batch_queue_destroy(&batch.decoded);
+  batch_queue_destroy(&batch.clustered);
+  pthread_mutex_destroy(&batch.mutex);
+  free_files(batch.files, batch.num_files);
+  return complete && batch.failures == 0;
+}
+
+bool run_sequence(const struct batch_options *options) {
+  char **files;
+  size_t num_files;
+  if (!list_files(options->input, &files, &num_files))
+    return false;
+  if (options->output_directory != NULL &&
+      mkdir(options->output_directory, 0777) != 0 && errno != EEXIST) {
+    perror(options->output_directory);
+    free_files(files, num_files);
+    return false;
+  }
+
+  struct k_means_context *context = k_means_context_create();
+  if (context == NULL) {
+    fprintf(stderr, "Failed to allocate the k-means context\n");
+    free_files(files, num_files);
+    return false;
+  }
+  float *centroids = NULL;
+  size_t centroids_dimension = 0;
+  size_t cold_iterations = 0, warm_iterations = 0, warm_frames = 0;
+  size_t failures = 0;
+  time_measure start, end;
+  get_current_time(&start);
+  for (size_t file = 0; file < num_files; ++file) {
+    struct batch_image image = {.input = files[file], .type = options->type};
+    if (!read_png_points(image.input, &image.type, &image.points,
+                         &image.height, &image.width, &image.dimension,
+                         &image.channels)) {
+      failures += 1;
+      continue;
+    }
+    size_t points = (size_t)image.height * image.width;
+    image.labels = malloc(points * K_MEANS_LABEL_SIZE(options->k));
+    if (image.labels == NULL) {
+      fprintf(stderr, "Failed to allocate the labels of %s\n", image.input);
+      failures += 1;
+      free(image.points);
+      continue;
+    }
+    // A frame of another number of channels starts over
+    bool warm = centroids != NULL && centroids_dimension == image.dimension;
+    struct k_means_stats stats;
+    size_t iterations;
+    if (warm) {
+      switch (image.type) {
+      case png_points_uint8:
+        iterations = k_means_warm_start_u8(
+            points, image.dimension, options->k, image.points, image.labels,
+            &options->config, (float(*)[image.dimension])centroids, &stats);
+        break;
+      case png_points_uint16:
+        iterations = k_means_warm_start_u16(
+            points, image.dimension, options->k, image.points, image.labels,
+            &options->config, (float(*)[image.dimension])centroids, &stats);
+        break;
+      default:
+        iterations = k_means_warm_start_f(
+            points, image.dimension, options->k, image.points, image.labels,
+            &options->config, (float(*)[image.dimension])centroids, &stats);
+        break;
+      }
+    } else {
+      switch (image.type) {
+      case png_points_uint8:
+        iterations = k_means_with_context_u8(
+            context, points, image.dimension, options->k, image.points,
+            image.labels, &options->config, &stats);
+        break;
+      case png_points_uint16:
+        iterations = k_means_with_context_u16(
+            context, points, image.dimension, options->k, image.points,
+            image.labels, &options->config, &stats);
+        break;
+      default:
+        iterations = k_means_with_context_f(
+            context, points, image.dimension, options->k, image.points,
+            image.labels, &options->config, &stats);
+        break;
+      }
+    }
+    if (iterations == K_MEANS_ERROR) {
+      failures += 1;
+      free(image.points);
+      free(image.labels);
+      continue;
+    }
+    if (warm) {
+      warm_iterations += stats.iterations;
+      warm_frames += 1;
+    } else {
+      free(centroids);
+      centroids = malloc(options->k * image.dimension * sizeof(*centroids));
+      if (centroids == NULL) {
+        fprintf(stderr, "Failed to allocate the centroids of %s\n",
+                image.input);
+        failures += 1;
+        free(image.points);
+        free(image.labels);
+        continue;
+      }
+      memcpy(centroids, k_means_context_centroids_f(context),
+             options->k * image.dimension * sizeof(*centroids));
+      centroids_dimension = image.dimension;
+      cold_iterations = stats.iterations;
+    }
+    // The seeded frame is another image, the difference is only indicative of
+    // what the warm start saves
+    if (warm)
+      fprintf(stdout,
+              "%s: %zu steps warm started, %+lld against the seeded frame, "
+              "inertia %.6g\n",
+              image.input, stats.iterations,
+              (long long)stats.iterations - (long long)cold_iterations,
+              stats.inertia);
+    else
+      fprintf(stdout, "%s: %zu steps seeded, inertia %.6g\n", image.input,
+              stats.iterations, stats.inertia);
+
+    if (options->output_directory != NULL) {
+      if (options->palette)
+        image.palette = centroid_palette(&image, options->k, centroids);
+      char *output = output_path(options->output_directory, image.input);
+      if ((options->palette && image.palette == NULL) || output == NULL ||
+          !write_labels_png(output, image.height, image.width, options->k,
+                            image.labels, (const uint8_t(*)[4])image.palette,
+                            &options->encoder))
+        failures += 1;
+      free(output);
+    }
+    free(image.points);
+    free(image.labels);
+    free(image.palette);
+  }
+  get_current_time(&end);
+
+  double elapsed = measuring_difftime(start, end);
+  fprintf(stdout, "%zu frames (%zu failed) in %.4fs, %.2f frames/s\n",
+          num_files - failures, failures, elapsed,
+          (double)(num_files - failures) / elapsed);
+  if (warm_frames > 0)
+    fprintf(stdout, "%.2f steps per warm started frame, %zu for the last "
+                    "seeded one\n",
+            (double)warm_iterations / (double)warm_frames, cold_iterations);
+
+  free(centroids);
+  k_means_context_destroy(context);
+  free_files(files, num_files);
+  return failures == 0;
+}
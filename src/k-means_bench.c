@@ -0,0 +1,683 @@
+/*
+ * Copyright 2017 Maxime Schmitt <max.schmitt@math.unistra.fr>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#include <dirent.h>
+#include <getopt.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "k-means.h"
+#include "k-means_kernels.h"
+#include "k-means_png.h"
+#include "k-means_synthetic.h"
+#include "time_measurement.h"
+
+#ifndef KMEANS_BENCH_IMAGES
+#define KMEANS_BENCH_IMAGES "images"
+#endif
+
+#define BENCH_MAX_VALUES 32
+
+struct bench_list {
+  size_t count;
+  size_t values[BENCH_MAX_VALUES];
+};
+
+// A data set converted once to every precision, and its integer samples
+struct bench_dataset {
+  char *name;
+  size_t points, dimension;
+  float *data_f;
+  double *data_d;
+  k_means_half *data_h;
+  double half_scale; // data_h holds the points times half_scale
+  k_means_bfloat16 *data_bf16;
+  void *data_integer;
+  enum png_point_type integer_type; // png_points_uint8 or png_points_uint16
+  double integer_scale; // data_integer holds the points times integer_scale
+};
+
+enum bench_type {
+  bench_float,
+  bench_double,
+  bench_integer,
+  bench_half,
+  bench_bfloat16,
+};
+
+enum bench_engine {
+  bench_engine_auto, // From K_MEANS_GEMM_DIMENSION
+  bench_engine_loop,
+  bench_engine_gemm,
+};
+
+struct bench_result {
+  double median_time, p95_time;
+  double median_seeding_time, median_iteration_time;
+  size_t iterations;
+  bool gemm; // The distances came from the dot products
+  double inertia;
+  // Relative difference with the inertia of the float run
+  double inertia_delta;
+};
+
+static const char *const algorithm_names[] = {
+    [k_means_lloyd] = "lloyd",
+    [k_means_hamerly] = "hamerly",
+    [k_means_elkan] = "elkan",
+    [k_means_yinyang] = "yinyang",
+};
+
+static const char *const engine_names[] = {
+    [bench_engine_auto] = "auto",
+    [bench_engine_loop] = "loop",
+    [bench_engine_gemm] = "gemm",
+};
+
+static const char *const type_names[] = {
+    [bench_float] = "float",
+    [bench_double] = "double",
+    [bench_integer] = "integer",
+    [bench_half] = "half",
+    [bench_bfloat16] = "bfloat16",
+};
+
+// Comma separated positive integers
+static bool parse_size_list(const char *string, struct bench_list *list) {
+  list->count = 0;
+  while (*string != '\0') {
+    char *end;
+    unsigned long long value = strtoull(string, &end, 10);
+    if (end == string || value == 0 || list->count == BENCH_MAX_VALUES ||
+        (*end != ',' && *end != '\0'))
+      return false;
+    list->values[list->count++] = (size_t)value;
+    string = *end == ',' ? end + 1 : end;
+  }
+  return list->count != 0;
+}
+
+// Comma separated names, stored as their index in names
+static bool parse_name_list(const char *string, const char *const *names,
+                            size_t num_names, struct bench_list *list) {
+  list->count = 0;
+  while (*string != '\0') {
+    size_t length = strcspn(string, ",");
+    size_t name = 0;
+    while (name < num_names && (strlen(names[name]) != length ||
+                                strncmp(names[name], string, length) != 0))
+      ++name;
+    if (name == num_names || list->count == BENCH_MAX_VALUES)
+      return false;
+    list->values[list->count++] = name;
+    string += length;
+    if (*string == ',')
+      ++string;
+  }
+  return list->count != 0;
+}
+
+// The halves are scaled as in kmeans -H fp16: the 16 bits samples of the png
+// files into the 8 bits range, the other points by the power of two bringing
+// them below the largest half, 65504
+static void dataset_convert(struct bench_dataset *dataset, bool png_samples) {
+  size_t values = dataset->points * dataset->dimension;
+  dataset->data_d = malloc(values * sizeof(double));
+  float largest = 0.f;
+  for (size_t i = 0; i < values; ++i) {
+    dataset->data_d[i] = dataset->data_f[i];
+    if (isfinite(dataset->data_f[i]) && fabsf(dataset->data_f[i]) > largest)
+      largest = fabsf(dataset->data_f[i]);
+  }
+  dataset->half_scale = 1.;
+  if (png_samples) {
+    dataset->half_scale = 1. / 257.;
+  } else if (largest > 65504.f) {
+    int exponent;
+    frexp((double)largest / 65504., &exponent);
+    dataset->half_scale = ldexp(1., -exponent);
+  }
+  float *scaled = malloc(values * sizeof(float));
+  for (size_t i = 0; i < values; ++i)
+    scaled[i] = (float)((double)dataset->data_f[i] * dataset->half_scale);
+  dataset->data_h = malloc(values * sizeof(k_means_half));
+  k_means_float_to_half(values, scaled, dataset->data_h);
+  free(scaled);
+  dataset->data_bf16 = malloc(values * sizeof(k_means_bfloat16));
+  k_means_float_to_bfloat16(values, dataset->data_f, dataset->data_bf16);
+}
+
+static bool dataset_from_png(const char *filename,
+                             struct bench_dataset *dataset) {
+  void *points;
+  uint32_t height, width;
+  enum png_point_type type = png_points_float;
+  if (!read_png_points(filename, &type, &points, &height, &width,
+                       &dataset->dimension, NULL))
+    return false;
+  dataset->name = strdup(filename);
+  dataset->points = (size_t)height * width;
+  dataset->data_f = points;
+  dataset_convert(dataset, true);
+  // Decoded again to keep the samples of the 8 bits images on 8 bits
+  dataset->integer_type = png_points_integer;
+  if (!read_png_points(filename, &dataset->integer_type,
+                       &dataset->data_integer, &height, &width,
+                       &dataset->dimension, NULL))
+    exit(EXIT_FAILURE);
+  dataset->integer_scale =
+      dataset->integer_type == png_points_uint8 ? 1. / 257. : 1.;
+  return true;
+}
+
+static void dataset_synthetic(size_t points, size_t dimension, size_t blobs,
+                              unsigned seed, struct bench_dataset *dataset) {
+  char name[32];
+  if (blobs > 0)
+    snprintf(name, sizeof(name), "blobs%zu", blobs);
+  dataset->name = strdup(blobs > 0 ? name : "synthetic");
+  dataset->points = points;
+  dataset->dimension = dimension;
+  size_t values = points * dimension;
+  dataset->data_f = malloc(values * sizeof(float));
+  struct synthetic_options synthetic = SYNTHETIC_DEFAULT_OPTIONS;
+  synthetic.points = points;
+  synthetic.dimension = dimension;
+  synthetic.blobs = blobs;
+  synthetic.seed = seed;
+  long online_processors = sysconf(_SC_NPROCESSORS_ONLN);
+  synthetic.threads = online_processors > 0 ? (unsigned)online_processors : 1;
+  if (!synthetic_points_f(&synthetic, dataset->data_f, NULL))
+    exit(EXIT_FAILURE);
+  dataset_convert(dataset, false);
+  // Rounded samples
+  uint8_t *samples = malloc(values);
+  for (size_t i = 0; i < values; ++i)
+    samples[i] = (uint8_t)(dataset->data_f[i] + .5f);
+  dataset->data_integer = samples;
+  dataset->integer_type = png_points_uint8;
+  dataset->integer_scale = 1.;
+}
+
+static void dataset_free(struct bench_dataset *dataset) {
+  free(dataset->name);
+  free(dataset->data_f);
+  free(dataset->data_d);
+  free(dataset->data_h);
+  free(dataset->data_bf16);
+  free(dataset->data_integer);
+}
+
+static int compare_double(const void *lhs, const void *rhs) {
+  double a = *(const double *)lhs, b = *(const double *)rhs;
+  return (a > b) - (a < b);
+}
+
+// Nearest rank percentile of sorted values
+static double percentile(const double *sorted, size_t count, double fraction) {
+  double rank = ceil(fraction * (double)count);
+  return sorted[rank < 1. ? 0 : (size_t)rank - 1];
+}
+
+static void bench_run(struct k_means_context *context,
+                      const struct bench_dataset *dataset, size_t k,
+                      enum bench_type type, const struct k_means_config *config,
+                      size_t warmup, size_t trials, void *map,
+                      struct bench_result *result) {
+  double *times = malloc(3 * trials * sizeof(double));
+  double *seeding_times = times + trials, *iteration_times = times + 2 * trials;
+  struct k_means_stats stats = {0};
+  for (size_t trial = 0; trial < warmup + trials; ++trial) {
+    time_measure start, end;
+    get_current_time(&start);
+    size_t iterations;
+    switch (type) {
+    case bench_double:
+      iterations = k_means_with_context_d(
+          context, dataset->points, dataset->dimension, k,
+          (double(*)[dataset->dimension])dataset->data_d, map, config, &stats);
+      break;
+    case bench_integer:
+      if (dataset->integer_type == png_points_uint8)
+        iterations = k_means_with_context_u8(
+            context, dataset->points, dataset->dimension, k,
+            (uint8_t(*)[dataset->dimension])dataset->data_integer, map, config,
+            &stats);
+      else
+        iterations = k_means_with_context_u16(
+            context, dataset->points, dataset->dimension, k,
+            (uint16_t(*)[dataset->dimension])dataset->data_integer, map,
+            config, &stats);
+      break;
+    case bench_half:
+      iterations = k_means_with_context_h(
+          context, dataset->points, dataset->dimension, k,
+          (k_means_half(*)[dataset->dimension])dataset->data_h, map, config,
+          &stats);
+      break;
+    case bench_bfloat16:
+      iterations = k_means_with_context_bf16(
+          context, dataset->points, dataset->dimension, k,
+          (k_means_bfloat16(*)[dataset->dimension])dataset->data_bf16, map,
+          config, &stats);
+      break;
+    default:
+      iterations = k_means_with_context_f(
+          context, dataset->points, dataset->dimension, k,
+          (float(*)[dataset->dimension])dataset->data_f, map, config, &stats);
+      break;
+    }
+    if (iterations == K_MEANS_ERROR) {
+      fprintf(stderr, "The k-means run failed\n");
+      exit(EXIT_FAILURE);
+    }
+    get_current_time(&end);
+    if (trial >= warmup) {
+      times[trial - warmup] = measuring_difftime(start, end);
+      seeding_times[trial - warmup] = stats.seeding_time;
+      iteration_times[trial - warmup] =
+          stats.iteration_time /
+          (double)(stats.iterations != 0 ? stats.iterations : 1);
+    }
+  }
+  qsort(times, trials, sizeof(double), compare_double);
+  qsort(seeding_times, trials, sizeof(double), compare_double);
+  qsort(iteration_times, trials, sizeof(double), compare_double);
+  result->median_time = percentile(times, trials, 0.5);
+  result->p95_time = percentile(times, trials, 0.95);
+  result->median_seeding_time = percentile(seeding_times, trials, 0.5);
+  result->median_iteration_time = percentile(iteration_times, trials, 0.5);
+  // The runs only depend on the seed and on the number of threads
+  result->iterations = stats.iterations;
+  result->gemm = stats.gemm;
+  result->inertia = stats.inertia;
+  // Compared with the float inertia in the scale of data_f
+  double scale = type == bench_half      ? dataset->half_scale
+                 : type == bench_integer ? dataset->integer_scale
+                                         : 1.;
+  result->inertia /= scale * scale;
+  free(times);
+}
+
+static void print_json_string(FILE *output, const char *string) {
+  fputc('"', output);
+  for (; *string != '\0'; ++string) {
+    if (*string == '"' || *string == '\\')
+      fputc('\\', output);
+    fputc(*string, output);
+  }
+  fputc('"', output);
+}
+
+static void print_result(FILE *output, bool csv, bool first,
+                         const struct bench_dataset *dataset, size_t k,
+                         enum bench_type type,
+                         const struct k_means_config *config, size_t trials, const struct bench_result *result) {
+  // Point to centroid distance terms per second of iteration
+  double throughput = (double)dataset->points * (double)k *
+                      (double)dataset->dimension /
+                      result->median_iteration_time;
+  // Two operations per term of the point-centroid dot products
+  double gflops = 2. * throughput / 1e9;
+  const char *engine = result->gemm ? "gemm" : "loop";
+  if (csv) {
+    fprintf(output,
+            "%s,%zu,%zu,%zu,%s,%u,%s,%s,%zu,%zu,%.6e,%.6e,%.6e,%.6e,%.6e,"
+            "%.10g,%.6e,%s,%.4f\n",
+            dataset->name, dataset->points, dataset->dimension, k,
+            type_names[type], config->num_threads,
+            algorithm_names[config->algorithm], k_means_kernels()->name,
+            trials, result->iterations, result->median_time, result->p95_time,
+            result->median_seeding_time, result->median_iteration_time,
+            throughput, result->inertia, result->inertia_delta, engine,
+            gflops);
+    return;
+  }
+  fprintf(output, "%s\n    {\"dataset\": ", first ? "" : ",");
+  print_json_string(output, dataset->name);
+  fprintf(output,
+          ", \"points\": %zu, \"dimension\": %zu, \"k\": %zu,"
+          " \"type\": \"%s\", \"threads\": %u, \"algorithm\": \"%s\",\n"
+          "     \"trials\": %zu, \"iterations\": %zu,"
+          " \"median_time\": %.6e, \"p95_time\": %.6e,\n"
+          "     \"median_seeding_time\": %.6e,"
+          " \"median_iteration_time\": %.6e,\n"
+          "     \"point_centroid_dims_per_second\": %.6e,"
+          " \"inertia\": %.10g, \"inertia_delta\": %.6e,\n"
+          "     \"engine\": \"%s\", \"gflops\": %.4f}",
+          dataset->points, dataset->dimension, k, type_names[type],
+          config->num_threads, algorithm_names[config->algorithm], trials,
+          result->iterations, result->median_time, result->p95_time,
+          result->median_seeding_time, result->median_iteration_time,
+          throughput, result->inertia, result->inertia_delta, engine, gflops);
+}
+
+static int compare_string(const void *lhs, const void *rhs) {
+  return strcmp(*(char *const *)lhs, *(char *const *)rhs);
+}
+
+// A directory holding png files, or a comma separated list of files
+static size_t list_images(const char *images, char ***files) {
+  size_t count = 0, capacity = 0;
+  *files = NULL;
+  DIR *directory = opendir(images);
+  if (directory != NULL) {
+    struct dirent *entry;
+    while ((entry = readdir(directory)) != NULL) {
+      size_t length = strlen(entry->d_name);
+      if (length < 4 || strcmp(entry->d_name + length - 4, ".png") != 0)
+        continue;
+      if (count == capacity) {
+        capacity = 2 * capacity + 8;
+        *files = realloc(*files, capacity * sizeof(**files));
+      }
+      size_t path_length = strlen(images) + length + 2;
+      (*files)[count] = malloc(path_length);
+      snprintf((*files)[count++], path_length, "%s/%s", images,
+               entry->d_name);
+    }
+    closedir(directory);
+    qsort(*files, count, sizeof(**files), compare_string);
+    return count;
+  }
+  while (*images != '\0') {
+    size_t length = strcspn(images, ",");
+    if (count == capacity) {
+      capacity = 2 * capacity + 8;
+      *files = realloc(*files, capacity * sizeof(**files));
+    }
+    (*files)[count++] = strndup(images, length);
+    images += length;
+    if (*images == ',')
+      ++images;
+  }
+  return count;
+}
+
+static struct option opt_options[] = {
+    {"images", required_argument, 0, 'i'},
+    {"points", required_argument, 0, 'p'},
+    {"dims", required_argument, 0, 'd'},
+    {"num-centroids", required_argument, 0, 'c'},
+    {"types", required_argument, 0, 'y'},
+    {"threads", required_argument, 0, 't'},
+    {"algorithms", required_argument, 0, 'a'},
+    {"engines", required_argument, 0, 'e'},
+    {"warmup", required_argument, 0, 'w'},
+    {"trials", required_argument, 0, 'n'},
+    {"max-iterations", required_argument, 0, 'x'},
+    {"random-seed", required_argument, 0, 's'},
+    {"blobs", required_argument, 0, 'b'},
+    {"format", required_argument, 0, 'f'},
+    {"output", required_argument, 0, 'o'},
+    {"help", no_argument, 0, 'h'},
+    {0, 0, 0, 0}};
+
+static const char options[] = ":i:p:d:c:y:t:a:e:w:n:x:s:b:f:o:h";
+
+static const char help_string[] =
+    "Options (lists are comma separated, every combination is measured):"
+    "\n  -i --images         : Directory of png files or list of png files,"
+    "\n                     none to skip the images (default " KMEANS_BENCH_IMAGES
+    ")"
+    "\n  -p --points         : Numbers of synthetic points, none to skip the"
+    "\n                     synthetic data (default 100000)"
+    "\n  -d --dims           : Dimensions of the synthetic data (default 2,4,16)"
+    "\n  -c --num-centroids  : Numbers of partitions (default 4,16,64)"
+    "\n  -y --types          : float, double, integer (8 or 16 bits"
+    "\n                     samples), half and/or bfloat16 (the float data"
+    "\n                     rounded to 16 bits), each compared with the"
+    "\n                     inertia of float (default float,double)"
+    "\n  -t --threads        : Numbers of threads, 0 uses every online"
+    "\n                     processor (default 1)"
+    "\n  -a --algorithms     : lloyd, hamerly, elkan and/or yinyang (default"
+    "\n                     lloyd)"
+    "\n  -e --engines        : Distances of the Lloyd assignments: auto (the"
+    "\n                     dot products from the dimension 32), loop and/or"
+    "\n                     gemm (default auto)"
+    "\n  -w --warmup         : Untimed runs before the trials (default 1)"
+    "\n  -n --trials         : Timed runs per combination (default 5)"
+    "\n  -x --max-iterations : Iteration cap of every run, 0 runs until"
+    "\n                     convergence (default 20)"
+    "\n  -s --random-seed    : Seed of the synthetic data and of the seeding"
+    "\n  -b --blobs          : The synthetic data is a mixture of this number"
+    "\n                     of gaussian blobs (default 0, uniform values)"
+    "\n  -f --format         : json (default) or csv"
+    "\n  -o --output         : Output file (default standard output)"
+    "\n  -h --help           : Print this help";
+
+int main(int argc, char **argv) {
+  const char *images = KMEANS_BENCH_IMAGES;
+  struct bench_list points = {1, {100000}};
+  struct bench_list dims = {3, {2, 4, 16}};
+  struct bench_list centroids = {3, {4, 16, 64}};
+  struct bench_list types = {2, {0, 1}};
+  struct bench_list threads = {1, {1}};
+  struct bench_list algorithms = {1, {k_means_lloyd}};
+  struct bench_list engines = {1, {bench_engine_auto}};
+  size_t warmup = 1, trials = 5, max_iterations = 20;
+  unsigned random_seed = 42;
+  size_t blobs = 0;
+  bool csv = false;
+  const char *output_file = NULL;
+
+  while (true) {
+    int optchar = getopt_long(argc, argv, options, opt_options, NULL);
+    if (optchar == -1)
+      break;
+    bool valid = true;
+    switch (optchar) {
+    case 'i':
+      images = optarg;
+      break;
+    case 'p':
+      if (strcmp(optarg, "none") == 0)
+        points.count = 0;
+      else
+        valid = parse_size_list(optarg, &points);
+      break;
+    case 'd':
+      valid = parse_size_list(optarg, &dims);
+      break;
+    case 'c':
+      valid = parse_size_list(optarg, &centroids);
+      for (size_t i = 0; valid && i < centroids.count; ++i)
+        valid = centroids.values[i] <= K_MEANS_MAX_K;
+      break;
+    case 'y':
+      valid = parse_name_list(optarg, type_names, 5, &types);
+      break;
+    case 't':
+      // 0 is allowed here
+      threads.count = 0;
+      for (const char *string = optarg; valid && *string != '\0';) {
+        char *end;
+        unsigned long value = strtoul(string, &end, 10);
+        valid = end != string && value <= UINT32_MAX &&
+                threads.count < BENCH_MAX_VALUES &&
+                (*end == ',' || *end == '\0');
+        if (valid)
+          threads.values[threads.count++] = value;
+        string = *end == ',' ? end + 1 : end;
+      }
+      valid = valid && threads.count != 0;
+      break;
+    case 'a':
+      valid = parse_name_list(optarg, algorithm_names, 4, &algorithms);
+      break;
+    case 'e':
+      valid = parse_name_list(optarg, engine_names, 3, &engines);
+      break;
+    case 'w':
+    case 'n':
+    case 'x': {
+      size_t *value = optchar == 'w'   ? &warmup
+                      : optchar == 'n' ? &trials
+                                       : &max_iterations;
+      int sscanf_return = sscanf(optarg, "%zu", value);
+      valid = sscanf_return != EOF && sscanf_return != 0 &&
+              (optchar != 'n' || *value != 0);
+    } break;
+    case 's': {
+      int sscanf_return = sscanf(optarg, "%u", &random_seed);
+      valid = sscanf_return != EOF && sscanf_return != 0;
+    } break;
+    case 'b': {
+      int sscanf_return = sscanf(optarg, "%zu", &blobs);
+      valid = sscanf_return != EOF && sscanf_return != 0;
+    } break;
+    case 'f':
+      valid = strcmp(optarg, "json") == 0 || strcmp(optarg, "csv") == 0;
+      csv = strcmp(optarg, "csv") == 0;
+      break;
+    case 'o':
+      output_file = optarg;
+      break;
+    case 'h':
+      printf("Usage: %s <options>\n%s\n", argv[0], help_string);
+      return EXIT_SUCCESS;
+    case ':':
+      fprintf(stderr, "Option %c requires an argument\n", optopt);
+      exit(EXIT_FAILURE);
+    default:
+      fprintf(stderr, "Unrecognized option %c\n", optopt);
+      exit(EXIT_FAILURE);
+    }
+    if (!valid) {
+      fprintf(stderr, "Invalid value \"-%c %s\", see %s --help\n", optchar,
+              optarg, argv[0]);
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  long online_processors = sysconf(_SC_NPROCESSORS_ONLN);
+  for (size_t i = 0; i < threads.count; ++i)
+    if (threads.values[i] == 0)
+      threads.values[i] = online_processors > 0 ? (size_t)online_processors : 1;
+
+  char **image_files = NULL;
+  size_t num_images =
+      strcmp(images, "none") == 0 ? 0 : list_images(images, &image_files);
+  size_t num_datasets = num_images + points.count * dims.count;
+  struct bench_dataset *datasets = calloc(num_datasets, sizeof(*datasets));
+  size_t num_loaded = 0;
+  for (size_t i = 0; i < num_images; ++i) {
+    if (dataset_from_png(image_files[i], &datasets[num_loaded]))
+      ++num_loaded;
+    free(image_files[i]);
+  }
+  free(image_files);
+  for (size_t i = 0; i < points.count; ++i)
+    for (size_t j = 0; j < dims.count; ++j)
+      dataset_synthetic(points.values[i], dims.values[j], blobs, random_seed,
+                        &datasets[num_loaded++]);
+  if (num_loaded == 0) {
+    fprintf(stderr, "No data set to benchmark\n");
+    return EXIT_FAILURE;
+  }
+
+  FILE *output = stdout;
+  if (output_file != NULL && (output = fopen(output_file, "w")) == NULL) {
+    perror(output_file);
+    return EXIT_FAILURE;
+  }
+  if (csv)
+    fprintf(output, "dataset,points,dimension,k,type,threads,algorithm,kernel,"
+                    "trials,iterations,median_time,p95_time,"
+                    "median_seeding_time,median_iteration_time,"
+                    "point_centroid_dims_per_second,inertia,"
+                    "inertia_delta,engine,gflops\n");
+  else
+    fprintf(output,
+            "{\n  \"kernel\": \"%s\", \"warmup\": %zu, \"trials\": %zu,"
+            " \"max_iterations\": %zu, \"seed\": %u,\n  \"results\": [",
+            k_means_kernels()->name, warmup, trials, max_iterations,
+            random_seed);
+
+  struct k_means_context *context = k_means_context_create();
+  bool first = true;
+  for (size_t d = 0; d < num_loaded; ++d) {
+    const struct bench_dataset *dataset = &datasets[d];
+    for (size_t c = 0; c < centroids.count; ++c) {
+      size_t k = centroids.values[c];
+      if (k > dataset->points)
+        continue;
+      void *map = malloc(dataset->points * K_MEANS_LABEL_SIZE(k));
+      for (size_t y = 0; y < types.count; ++y) {
+        for (size_t t = 0; t < threads.count; ++t) {
+          for (size_t a = 0; a < algorithms.count; ++a) {
+            for (size_t e = 0; e < engines.count; ++e) {
+              struct k_means_config config = K_MEANS_DEFAULT_CONFIG;
+              config.num_threads = (unsigned)threads.values[t];
+              config.algorithm = (enum k_means_algorithm)algorithms.values[a];
+              config.seed = random_seed;
+              config.termination.max_iterations = max_iterations;
+              enum bench_engine engine = (enum bench_engine)engines.values[e];
+              config.gemm_dimension = engine == bench_engine_loop   ? SIZE_MAX
+                                      : engine == bench_engine_gemm ? 1
+                                                                    : 0;
+              enum bench_type type = (enum bench_type)types.values[y];
+              fprintf(stderr, "%s %zux%zu k=%zu %s %u thread%s %s %s\n",
+                      dataset->name, dataset->points, dataset->dimension, k,
+                      type_names[type], config.num_threads,
+                      config.num_threads > 1 ? "s" : "",
+                      algorithm_names[config.algorithm], engine_names[engine]);
+              struct bench_result result, reference = {0};
+              // One untimed float run gives the quality loss of the other
+              // types
+              if (type != bench_float)
+                bench_run(context, dataset, k, bench_float, &config, 0, 1,
+                          map, &reference);
+              bench_run(context, dataset, k, type, &config, warmup, trials,
+                        map, &result);
+              result.inertia_delta =
+                  type == bench_float || !(reference.inertia > 0.)
+                      ? 0.
+                      : (result.inertia - reference.inertia) /
+                            reference.inertia;
+              print_result(output, csv, first, dataset, k, type, &config,
+                           trials, &result);
+              first = false;
+              fflush(output);
+            }
+          }
+        }
+      }
+      free(map);
+    }
+  }
+  if (!csv)
+    fprintf(output, "\n  ]\n}\n");
+  k_means_context_destroy(context);
+
+  if (output != stdout)
+    fclose(output);
+  for (size_t d = 0; d < num_loaded; ++d)
+    dataset_free(&datasets[d]);
+  free(datasets);
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,2367 @@
+// K-means engine, included by k-means.c once per floating point type.
+//
+// The including file defines:
+//   KM_TYPE          the element type of the centroids and of the distances
+//   KM_DATA          the element type of the data, KM_TYPE, an integer or a
+//                    16 bits float
+//   KM_INTEGER_DATA  when KM_DATA is an integer type, the points are then
+//                    converted to KM_TYPE for the kernels and summed exactly
+//   KM_LOAD          optionally, KM_LOAD(value) converts a KM_DATA value and
+//                    KM_LOAD_ROW(dimension, point, buffer) a whole point to
+//                    KM_TYPE, when KM_DATA is not an arithmetic type
+//   KM_SUFFIX        the suffix of the public entry point (k_means_<suffix>)
+//   KM_KERNEL_SUFFIX the suffix of the KM_TYPE kernels (f or d)
+//   KM_HUGE          the HUGE_VAL constant of KM_TYPE
+//   KM_EPSILON       the machine epsilon of KM_TYPE
+//   KM_GEMM          when KM_TYPE is float, the Lloyd assignment may use the
+//                    GEMM kernel
+//
+// Every function is instantiated once for a runtime dimension and once for
+// each dimension up to K_MEANS_SPECIALIZED_DIMENSIONS, where the compiler
+// can unroll the loops over the coordinates.
+
+#define KM_CONCAT_(a, b) a##_##b
+#define KM_CONCAT(a, b) KM_CONCAT_(a, b)
+#define KM_NAME(name) KM_CONCAT(name, KM_SUFFIX)
+#define KM_NEAREST_KERNEL                                                      \
+  KM_CONCAT(KM_CONCAT(k_means_nearest, KM_KERNEL_SUFFIX), kernel)
+#define KM_DISTANCES_KERNEL                                                    \
+  KM_CONCAT(KM_CONCAT(k_means_distances, KM_KERNEL_SUFFIX), kernel)
+#define KM_WORKER(dim) KM_CONCAT(KM_NAME(k_means_worker), dim)
+
+// The points are converted before the kernels
+#if defined(KM_INTEGER_DATA) || defined(KM_LOAD)
+#define KM_CONVERTED_DATA
+#endif
+#ifndef KM_LOAD
+#define KM_LOAD(value) ((KM_TYPE)(value))
+#define KM_DEFAULT_LOAD
+#endif
+
+// Type of the per-thread sums of the points of a centroid
+#ifdef KM_INTEGER_DATA
+#define KM_SUM uint64_t
+#else
+#define KM_SUM KM_TYPE
+#endif
+
+struct KM_NAME(k_means_state);
+
+// Per-thread partial results, merged in thread order after every assignment
+struct KM_NAME(k_means_worker) {
+  pthread_t thread;
+  struct KM_NAME(k_means_state) *state;
+  size_t first_point, last_point;
+  // NUMA node of the worker, the first worker of a node merges the partial
+  // results of the node and keeps its replica of the transposed centroids
+  unsigned node;
+  bool node_leader;
+  const KM_TYPE *centroids_soa;
+  KM_SUM *centroids_temp;
+  // Points which entered minus points which left every cluster during the
+  // iteration, with delta_update
+  double *delta_sums;
+  int64_t *delta_counts;
+  size_t *centroids_point_count;
+  KM_TYPE *distances; // Hamerly and Elkan full searches
+#ifdef KM_GEMM
+  // Nearest centroids of the current block of points, and the block
+  // converted to KM_TYPE
+  size_t *gemm_nearest;
+  KM_TYPE *gemm_points;
+#endif
+  size_t distance_computations;
+  size_t reassigned;
+  double inertia;
+#ifdef K_MEANS_STATS
+  double assign_time;
+  struct k_means_counters counters;
+  int64_t counters_start[k_means_num_counters];
+  int64_t counters_delta[k_means_num_counters];
+#endif
+
+  // Seeding
+  double seeding_sum;
+  size_t num_sampled, sampled_offset;
+  size_t *candidate_weights;
+};
+
+struct KM_NAME(k_means_state) {
+  size_t points, dimension;
+  size_t k;
+  unsigned label_size;
+  enum k_means_algorithm algorithm;
+  enum k_means_init init;
+  unsigned long seed;
+  const KM_TYPE *initial_centroids;
+  KM_DATA *data;
+  // Weighted points, cumulated_weights[i] is the sum of the weights up to the
+  // point i. total_weight is the number of points when unweighted.
+  const uint32_t *weights;
+  uint64_t *cumulated_weights;
+  uint64_t total_weight;
+  void *point_centroid_map;
+  // Touched by the first worker only, the other workers read whether it failed
+  // after a barrier
+  struct k_means_arena *arena;
+  KM_TYPE *centroids;
+  KM_TYPE *centroids_soa;
+  size_t stride;
+  KM_NEAREST_KERNEL nearest;
+  KM_DISTANCES_KERNEL distances;
+#ifdef KM_GEMM
+  // Lloyd assignment from the dot products, with the squared norms of the
+  // points computed once and the ones of the centroids after every update
+  bool gemm;
+  k_means_nearest_gemm_f_kernel nearest_gemm;
+  KM_TYPE *point_norms, *centroid_norms;
+#endif
+  unsigned num_threads;
+  struct KM_NAME(k_means_worker) *workers;
+  // The workers of node n are node_first[n] to node_first[n + 1] - 1, every
+  // node but the first reads its own copy of centroids_soa in replicas[n]
+  unsigned nodes;
+  unsigned *node_first;
+  KM_TYPE **replicas;
+  pthread_barrier_t barrier;
+  struct k_means_launch launch;
+  struct k_means_termination termination;
+  time_measure start;
+  bool has_stopped;
+  enum k_means_stop_reason stop_reason;
+  double previous_inertia;
+  size_t convergence_iterations;
+  size_t distance_computations;
+  struct k_means_restarts *restarts; // NULL outside of k_means_restarts
+  // Sums and counts of the clusters kept across the iterations, updated with
+  // the moved points only. Rebuilt from every point on the first iteration
+  // and then periodically.
+  bool delta_update, delta_rebuild;
+  double *sums;
+  int64_t *counts;
+  // Streamed points, the chunk being processed is shared by the workers
+  struct k_means_reader *reader;
+  const void *chunk; // NULL when it could not be read
+  double io_wait_time, iteration_io_wait_time;
+#ifdef K_MEANS_STATS
+  k_means_iteration_callback iteration_callback;
+  void *callback_data;
+  bool hardware_counters;
+#endif
+
+  // Hamerly, Elkan and Yinyang bounds on the distance between the points and
+  // their centroid (upper) and the other centroids (lower, one per point for
+  // Hamerly, k per point for Elkan and one per group for Yinyang)
+  KM_TYPE *upper_bounds, *lower_bounds;
+  KM_TYPE *previous_centroids;
+  double *centroid_movement;
+  double largest_movement, second_largest_movement;
+  size_t fastest_centroid;
+  double *half_closest_centroid;
+  double *half_centroid_distances; // k * k, Elkan only
+
+  // Yinyang groups of centroids, the members of group g are
+  // group_members[group_first[g]] to group_members[group_first[g + 1] - 1]
+  size_t groups;
+  size_t *group_first, *group_members, *centroid_group;
+  double *group_drift; // Largest movement in the group
+  // Centroids transposed group by group, group g starts at the centroid
+  // group_offset[g] which is a multiple of the kernel alignment
+  size_t *group_offset;
+  KM_TYPE *group_centroids_soa;
+
+  // Seeding: squared distance of every point to the closest center chosen so
+  // far, and the k-means|| candidates with their weights
+  double *min_distance;
+  size_t *candidates, num_candidates, candidates_capacity;
+  KM_TYPE *candidates_soa;
+  size_t candidates_stride;
+  double *candidate_weights;
+  time_measure seeding_end;
+};
+
+static void KM_NAME(transpose_centroids)(
+    size_t dimension, size_t k, size_t stride,
+    KM_TYPE centroids[k][dimension], KM_TYPE centroids_soa[dimension][stride]) {
+  for (size_t dim = 0; dim < dimension; ++dim)
+    for (size_t centro = 0; centro < k; ++centro)
+      centroids_soa[dim][centro] = centroids[centro][dim];
+}
+
+static void
+KM_NAME(transpose_groups)(struct KM_NAME(k_means_state) *state) {
+  const size_t dimension = state->dimension;
+  KM_TYPE(*centroids)[dimension] = (KM_TYPE(*)[dimension])state->centroids;
+  for (size_t group = 0; group < state->groups; ++group) {
+    const size_t first = state->group_first[group];
+    const size_t count = state->group_first[group + 1] - first;
+    const size_t stride = K_MEANS_KERNEL_STRIDE(count, KM_TYPE);
+    KM_TYPE(*group_soa)[stride] =
+        (KM_TYPE(*)[stride])&state
+            ->group_centroids_soa[dimension * state->group_offset[group]];
+    for (size_t dim = 0; dim < dimension; ++dim)
+      for (size_t i = 0; i < count; ++i)
+        group_soa[dim][i] = centroids[state->group_members[first + i]][dim];
+  }
+}
+
+// Same operations as the kernels (k-means.c is built without floating point
+// contraction), hence the same rounding
+__attribute__((always_inline)) static inline KM_TYPE
+KM_NAME(distance_square)(const size_t dimension, const KM_TYPE *restrict a,
+                         const KM_TYPE *restrict b) {
+  KM_TYPE distance_square = 0;
+  for (size_t dim = 0; dim < dimension; ++dim) {
+    KM_TYPE diff = b[dim] - a[dim];
+    distance_square += diff * diff;
+  }
+  return distance_square;
+}
+
+#ifdef KM_GEMM
+__attribute__((always_inline)) static inline KM_TYPE
+KM_NAME(norm_square)(const size_t dimension, const KM_TYPE *restrict point) {
+  KM_TYPE norm_square = 0;
+  for (size_t dim = 0; dim < dimension; ++dim)
+    norm_square += point[dim] * point[dim];
+  return norm_square;
+}
+
+// Executed by the first worker after every transposition of the centroids
+static void KM_NAME(centroid_norms)(struct KM_NAME(k_means_state) *state,
+                                    const size_t dimension) {
+  KM_TYPE(*centroids)[dimension] = (KM_TYPE(*)[dimension])state->centroids;
+  for (size_t centro = 0; centro < state->k; ++centro)
+    state->centroid_norms[centro] =
+        KM_NAME(norm_square)(dimension, centroids[centro]);
+  for (size_t centro = state->k; centro < state->stride; ++centro)
+    state->centroid_norms[centro] = KM_HUGE;
+}
+#endif
+
+// Distance between a point of the data and a centroid, rounded like the
+// distance between the converted point and the centroid
+__attribute__((always_inline)) static inline KM_TYPE
+KM_NAME(point_distance_square)(const size_t dimension,
+                               const KM_DATA *restrict point,
+                               const KM_TYPE *restrict centroid) {
+  KM_TYPE distance_square = 0;
+  for (size_t dim = 0; dim < dimension; ++dim) {
+    KM_TYPE diff = centroid[dim] - KM_LOAD(point[dim]);
+    distance_square += diff * diff;
+  }
+  return distance_square;
+}
+
+// The kernels take KM_TYPE coordinates, the integer and 16 bits float points
+// are converted in buffer. The conversion is exact, the distances are the
+// same as with the converted data.
+__attribute__((always_inline)) static inline const KM_TYPE *
+KM_NAME(load_point)(const size_t dimension, const KM_DATA *restrict point,
+                    KM_TYPE *restrict buffer) {
+#if defined(KM_LOAD_ROW)
+  KM_LOAD_ROW(dimension, point, buffer);
+  return buffer;
+#elif defined(KM_INTEGER_DATA)
+  for (size_t dim = 0; dim < dimension; ++dim)
+    buffer[dim] = (KM_TYPE)point[dim];
+  return buffer;
+#else
+  (void)dimension;
+  (void)buffer;
+  return point;
+#endif
+}
+
+// Mean of the points of a centroid
+__attribute__((always_inline)) static inline KM_TYPE
+KM_NAME(mean)(KM_SUM sum, size_t count) {
+#ifdef KM_INTEGER_DATA
+  return (KM_TYPE)((double)sum / (double)count);
+#else
+  return sum / (KM_TYPE)count;
+#endif
+}
+
+// Seeding, run by every worker before the first iteration. The random draws
+// come from k_means_uniform, indexed by point or by step, so they do not
+// depend on the thread which needs them.
+
+__attribute__((always_inline)) static inline void
+KM_NAME(copy_point)(const size_t dimension, KM_TYPE *restrict centroid,
+                    const KM_DATA *restrict point) {
+  for (size_t dim = 0; dim < dimension; ++dim)
+    centroid[dim] = KM_LOAD(point[dim]);
+}
+
+// Point drawn uniformly, or with a probability proportional to its weight
+static size_t KM_NAME(draw_point)(const struct KM_NAME(k_means_state) *state,
+                                  uint64_t stream, uint64_t counter) {
+  if (state->weights == NULL)
+    return k_means_uniform_index(state->seed, stream, counter, state->points);
+  uint64_t target = (uint64_t)k_means_uniform_index(
+      state->seed, stream, counter, (size_t)state->total_weight);
+  // First point whose cumulated weight exceeds the target
+  size_t low = 0, high = state->points - 1;
+  while (low < high) {
+    size_t middle = low + (high - low) / 2;
+    if (state->cumulated_weights[middle] > target)
+      high = middle;
+    else
+      low = middle + 1;
+  }
+  return low;
+}
+
+// k distinct points drawn uniformly
+static void KM_NAME(choose_random)(const struct KM_NAME(k_means_state) *state,
+                                   size_t chosen[]) {
+  uint64_t draw = 0;
+  for (size_t centro = 0; centro < state->k; ++centro) {
+    bool already_chosen;
+    do {
+      chosen[centro] =
+          KM_NAME(draw_point)(state, k_means_stream_random, draw++);
+      already_chosen = false;
+      for (size_t previous = 0; previous < centro; ++previous)
+        already_chosen = already_chosen || chosen[previous] == chosen[centro];
+    } while (already_chosen && state->points >= state->k);
+  }
+}
+
+// Executed by the first worker only
+static void KM_NAME(seed_random)(struct KM_NAME(k_means_state) *state) {
+  const size_t dimension = state->dimension;
+  const size_t k = state->k;
+  KM_DATA(*data)[dimension] = (KM_DATA(*)[dimension])state->data;
+  KM_TYPE(*centroids)[dimension] = (KM_TYPE(*)[dimension])state->centroids;
+  size_t *chosen = k_means_arena_alloc(state->arena, k * sizeof(*chosen));
+  if (chosen == NULL)
+    return;
+  KM_NAME(choose_random)(state, chosen);
+  for (size_t centro = 0; centro < k; ++centro)
+    KM_NAME(copy_point)(dimension, centroids[centro], data[chosen[centro]]);
+}
+
+// Point drawn with a probability proportional to its squared distance to the
+// current centers, executed by the first worker only
+static size_t KM_NAME(pick_distant_point)(struct KM_NAME(k_means_state) *state,
+                                          double target) {
+  unsigned thread, last_positive = 0;
+  for (thread = 0; thread < state->num_threads; ++thread) {
+    double sum = state->workers[thread].seeding_sum;
+    if (!(sum > 0.))
+      continue;
+    last_positive = thread;
+    if (target < sum)
+      break;
+    target -= sum;
+  }
+  if (thread == state->num_threads) { // Rounding, take the last candidate
+    thread = last_positive;
+    target = HUGE_VAL;
+  }
+  struct KM_NAME(k_means_worker) *worker = &state->workers[thread];
+  size_t last_candidate = worker->first_point;
+  double cumulated = 0.;
+  for (size_t pos = worker->first_point; pos < worker->last_point; ++pos) {
+    if (state->min_distance[pos] > 0.) {
+      cumulated += k_means_weight(state->weights, pos) *
+                   state->min_distance[pos];
+      last_candidate = pos;
+      if (target < cumulated)
+        return pos;
+    }
+  }
+  return last_candidate;
+}
+
+__attribute__((always_inline)) static inline void
+KM_NAME(update_min_distance)(struct KM_NAME(k_means_worker) *worker,
+                             const size_t dimension, const KM_TYPE *center,
+                             bool first_update) {
+  struct KM_NAME(k_means_state) *state = worker->state;
+  KM_DATA(*data)[dimension] = (KM_DATA(*)[dimension])state->data;
+  double sum = 0.;
+  for (size_t pos = worker->first_point; pos < worker->last_point; ++pos) {
+    double min_distance =
+        (double)KM_NAME(point_distance_square)(dimension, data[pos], center);
+    if (!first_update && state->min_distance[pos] < min_distance)
+      min_distance = state->min_distance[pos];
+    state->min_distance[pos] = min_distance;
+    sum += k_means_weight(state->weights, pos) * min_distance;
+  }
+  worker->seeding_sum = sum;
+}
+
+// k-means++: every new center is a point drawn with a probability proportional
+// to its squared distance to the closest center already chosen
+__attribute__((always_inline)) static inline void
+KM_NAME(seed_plusplus)(struct KM_NAME(k_means_worker) *worker,
+                       const size_t dimension) {
+  struct KM_NAME(k_means_state) *state = worker->state;
+  const bool first_worker = worker == &state->workers[0];
+  KM_DATA(*data)[dimension] = (KM_DATA(*)[dimension])state->data;
+  KM_TYPE(*centroids)[dimension] = (KM_TYPE(*)[dimension])state->centroids;
+
+  if (first_worker) {
+    size_t first = KM_NAME(draw_point)(state, k_means_stream_plusplus, 0);
+    KM_NAME(copy_point)(dimension, centroids[0], data[first]);
+  }
+  pthread_barrier_wait(&state->barrier);
+  for (size_t centro = 1; centro < state->k; ++centro) {
+    KM_NAME(update_min_distance)(worker, dimension, centroids[centro - 1],
+                                 centro == 1);
+    pthread_barrier_wait(&state->barrier);
+    if (first_worker) {
+      double potential = 0.;
+      for (unsigned thread = 0; thread < state->num_threads; ++thread)
+        potential += state->workers[thread].seeding_sum;
+      size_t chosen;
+      if (potential > 0.)
+        chosen = KM_NAME(pick_distant_point)(
+            state, potential * k_means_uniform(state->seed,
+                                               k_means_stream_plusplus,
+                                               centro));
+      else // Less distinct points than centroids
+        chosen = KM_NAME(draw_point)(state, k_means_stream_plusplus, centro);
+      KM_NAME(copy_point)(dimension, centroids[centro], data[chosen]);
+    }
+    pthread_barrier_wait(&state->barrier);
+  }
+}
+
+// Weighted k-means++ on the k-means|| candidates, executed by the first worker
+static void KM_NAME(recluster_candidates)(struct KM_NAME(k_means_state) *state,
+                                          const size_t dimension) {
+  const size_t k = state->k;
+  const size_t num_candidates = state->num_candidates;
+  KM_DATA(*data)[dimension] = (KM_DATA(*)[dimension])state->data;
+  KM_TYPE(*centroids)[dimension] = (KM_TYPE(*)[dimension])state->centroids;
+  double *weight = state->candidate_weights;
+  double *score =
+      k_means_arena_alloc(state->arena, num_candidates * sizeof(*score));
+  double *min_distance = k_means_arena_alloc(
+      state->arena, num_candidates * sizeof(*min_distance));
+  if (score == NULL || min_distance == NULL)
+    return;
+
+  for (size_t i = 0; i < num_candidates; ++i) {
+    min_distance[i] = HUGE_VAL;
+    score[i] = weight[i];
+  }
+  for (size_t centro = 0; centro < k; ++centro) {
+    double total = 0.;
+    for (size_t i = 0; i < num_candidates; ++i)
+      total += score[i];
+    size_t chosen = num_candidates;
+    if (total > 0.) {
+      double target =
+          total * k_means_uniform(state->seed, k_means_stream_recluster, centro);
+      for (size_t i = 0; i < num_candidates; ++i) {
+        if (score[i] > 0.) {
+          chosen = i;
+          if (target < score[i])
+            break;
+          target -= score[i];
+        }
+      }
+    }
+    if (chosen == num_candidates) { // Less candidates than centroids
+      KM_NAME(copy_point)(
+          dimension, centroids[centro],
+          data[KM_NAME(draw_point)(state, k_means_stream_recluster, centro)]);
+      continue;
+    }
+    KM_NAME(copy_point)(dimension, centroids[centro],
+                        data[state->candidates[chosen]]);
+    for (size_t i = 0; i < num_candidates; ++i) {
+      double distance = (double)KM_NAME(point_distance_square)(
+          dimension, data[state->candidates[i]], centroids[centro]);
+      if (distance < min_distance[i])
+        min_distance[i] = distance;
+      score[i] = weight[i] * min_distance[i];
+    }
+  }
+}
+
+// Transpose the candidates from first on for the nearest kernel, executed by
+// the first worker only
+static void KM_NAME(transpose_candidates)(struct KM_NAME(k_means_state) *state,
+                                          const size_t dimension,
+                                          size_t first) {
+  const size_t count = state->num_candidates - first;
+  const size_t stride = K_MEANS_KERNEL_STRIDE(count, KM_TYPE);
+  KM_DATA(*data)[dimension] = (KM_DATA(*)[dimension])state->data;
+  state->candidates_stride = stride;
+  state->candidates_soa =
+      k_means_arena_alloc(state->arena, sizeof(KM_TYPE[dimension][stride]));
+  if (state->candidates_soa == NULL)
+    return;
+  KM_TYPE(*candidates_soa)[stride] = (KM_TYPE(*)[stride])state->candidates_soa;
+  for (size_t dim = 0; dim < dimension; ++dim) {
+    for (size_t i = 0; i < count; ++i)
+      candidates_soa[dim][i] =
+          KM_LOAD(data[state->candidates[first + i]][dim]);
+    for (size_t i = count; i < stride; ++i)
+      candidates_soa[dim][i] = KM_HUGE;
+  }
+}
+
+// k-means|| (Bahmani et al.): a few rounds sample about 2k points each, with a
+// probability proportional to their squared distance to the candidates. The
+// candidates are then weighted by the number of points closest to them and
+// reduced to k centroids with a weighted k-means++. Every worker returns when
+// an allocation failed, reading the failure where the first worker cannot
+// allocate until the next barrier.
+__attribute__((always_inline)) static inline void
+KM_NAME(seed_parallel)(struct KM_NAME(k_means_worker) *worker,
+                       const size_t dimension) {
+  struct KM_NAME(k_means_state) *state = worker->state;
+  const bool first_worker = worker == &state->workers[0];
+  const double oversampling = 2. * (double)state->k;
+  KM_DATA(*data)[dimension] = (KM_DATA(*)[dimension])state->data;
+  KM_TYPE point_buffer[dimension], candidate_buffer[dimension];
+
+  if (first_worker) {
+    state->num_candidates = 1;
+    state->candidates[0] =
+        KM_NAME(draw_point)(state, k_means_stream_parallel, 0);
+    KM_NAME(transpose_candidates)(state, dimension, 0);
+  }
+  pthread_barrier_wait(&state->barrier);
+
+  size_t round_first_candidate = 0;
+  for (unsigned round = 0; round < K_MEANS_PARALLEL_ROUNDS; ++round) {
+    if (state->arena->failed)
+      return;
+    // Distance to the candidates added by the previous round
+    const size_t round_candidates = state->num_candidates - round_first_candidate;
+    double sum = 0.;
+    for (size_t pos = worker->first_point; pos < worker->last_point; ++pos) {
+      size_t nearest = state->nearest(
+          dimension, round_candidates,
+          KM_NAME(load_point)(dimension, data[pos], point_buffer),
+          state->candidates_soa, state->candidates_stride);
+      double min_distance = (double)KM_NAME(point_distance_square)(
+          dimension, data[pos],
+          KM_NAME(load_point)(
+              dimension,
+              data[state->candidates[round_first_candidate + nearest]],
+              candidate_buffer));
+      if (round != 0 && state->min_distance[pos] < min_distance)
+        min_distance = state->min_distance[pos];
+      state->min_distance[pos] = min_distance;
+      sum += k_means_weight(state->weights, pos) * min_distance;
+    }
+    worker->seeding_sum = sum;
+    pthread_barrier_wait(&state->barrier);
+
+    double potential = 0.;
+    for (unsigned thread = 0; thread < state->num_threads; ++thread)
+      potential += state->workers[thread].seeding_sum;
+    if (!(potential > 0.))
+      break; // Every point is a candidate, same decision on every thread
+
+    // The sampled points are counted first, the first worker then makes room
+    // for them after the candidates in thread order. A weighted point is
+    // sampled as likely as any of its occurrences.
+    const uint64_t stream = k_means_stream_parallel + 1 + round;
+    worker->num_sampled = 0;
+    for (size_t pos = worker->first_point; pos < worker->last_point; ++pos)
+      if (k_means_uniform(state->seed, stream, pos) <
+          oversampling * k_means_weight(state->weights, pos) *
+              state->min_distance[pos] / potential)
+        worker->num_sampled += 1;
+    round_first_candidate = state->num_candidates;
+    pthread_barrier_wait(&state->barrier);
+    if (first_worker) {
+      size_t total = state->num_candidates;
+      for (unsigned thread = 0; thread < state->num_threads; ++thread) {
+        state->workers[thread].sampled_offset = total;
+        total += state->workers[thread].num_sampled;
+      }
+      if (total > state->candidates_capacity) {
+        size_t *candidates = k_means_arena_alloc(
+            state->arena, 2 * total * sizeof(*candidates));
+        if (candidates != NULL) {
+          memcpy(candidates, state->candidates,
+                 state->num_candidates * sizeof(*candidates));
+          state->candidates = candidates;
+          state->candidates_capacity = 2 * total;
+        }
+      }
+    }
+    pthread_barrier_wait(&state->barrier);
+    if (state->arena->failed)
+      return;
+    size_t sampled = worker->sampled_offset;
+    for (size_t pos = worker->first_point; pos < worker->last_point; ++pos)
+      if (k_means_uniform(state->seed, stream, pos) <
+          oversampling * k_means_weight(state->weights, pos) *
+              state->min_distance[pos] / potential)
+        state->candidates[sampled++] = pos;
+    pthread_barrier_wait(&state->barrier);
+    if (first_worker) {
+      struct KM_NAME(k_means_worker) *last =
+          &state->workers[state->num_threads - 1];
+      state->num_candidates = last->sampled_offset + last->num_sampled;
+      KM_NAME(transpose_candidates)(state, dimension, round_first_candidate);
+    }
+    pthread_barrier_wait(&state->barrier);
+    if (round_first_candidate == state->num_candidates)
+      break; // Nothing sampled
+  }
+
+  if (first_worker) {
+    KM_NAME(transpose_candidates)(state, dimension, 0);
+    for (unsigned thread = 0; thread < state->num_threads; ++thread)
+      state->workers[thread].candidate_weights = k_means_arena_calloc(
+          state->arena, state->num_candidates,
+          sizeof(*state->workers[thread].candidate_weights));
+  }
+  pthread_barrier_wait(&state->barrier);
+  if (state->arena->failed)
+    return;
+
+  // Weight of the candidates
+  for (size_t pos = worker->first_point; pos < worker->last_point; ++pos)
+    worker->candidate_weights[state->nearest(
+        dimension, state->num_candidates,
+        KM_NAME(load_point)(dimension, data[pos], point_buffer),
+        state->candidates_soa, state->candidates_stride)] +=
+        k_means_weight(state->weights, pos);
+  pthread_barrier_wait(&state->barrier);
+  if (first_worker) {
+    state->candidate_weights =
+        k_means_arena_calloc(state->arena, state->num_candidates,
+                             sizeof(*state->candidate_weights));
+    if (state->candidate_weights == NULL)
+      return;
+    for (unsigned thread = 0; thread < state->num_threads; ++thread)
+      for (size_t i = 0; i < state->num_candidates; ++i)
+        state->candidate_weights[i] +=
+            (double)state->workers[thread].candidate_weights[i];
+    KM_NAME(recluster_candidates)(state, dimension);
+  }
+}
+
+// Partition the initial centroids in groups with a few Lloyd iterations on the
+// centroids themselves, executed by the first worker only
+static void KM_NAME(yinyang_group_centroids)(
+    struct KM_NAME(k_means_state) *state, const size_t dimension) {
+  const size_t k = state->k;
+  const size_t groups = state->groups;
+  KM_TYPE(*centroids)[dimension] = (KM_TYPE(*)[dimension])state->centroids;
+  KM_TYPE(*group_centers)[dimension] =
+      k_means_arena_alloc(state->arena, sizeof(KM_TYPE[groups][dimension]));
+  size_t *group_size =
+      k_means_arena_calloc(state->arena, groups + 1, sizeof(*group_size));
+  if (group_centers == NULL || group_size == NULL)
+    return;
+
+  for (size_t group = 0; group < groups; ++group)
+    memcpy(group_centers[group], centroids[group * k / groups],
+           sizeof(KM_TYPE[dimension]));
+  for (unsigned iteration = 0; iteration < K_MEANS_YINYANG_GROUPING_ITERATIONS;
+       ++iteration) {
+    for (size_t centro = 0; centro < k; ++centro) {
+      KM_TYPE closest = KM_HUGE;
+      state->centroid_group[centro] = 0;
+      for (size_t group = 0; group < groups; ++group) {
+        KM_TYPE distance = KM_NAME(distance_square)(
+            dimension, centroids[centro], group_centers[group]);
+        if (distance < closest) {
+          closest = distance;
+          state->centroid_group[centro] = group;
+        }
+      }
+    }
+    memset(group_size, 0, groups * sizeof(*group_size));
+    for (size_t group = 0; group < groups; ++group)
+      for (size_t dim = 0; dim < dimension; ++dim)
+        group_centers[group][dim] = 0;
+    for (size_t centro = 0; centro < k; ++centro) {
+      size_t group = state->centroid_group[centro];
+      group_size[group] += 1;
+      for (size_t dim = 0; dim < dimension; ++dim)
+        group_centers[group][dim] += centroids[centro][dim];
+    }
+    for (size_t group = 0; group < groups; ++group)
+      for (size_t dim = 0; dim < dimension; ++dim)
+        group_centers[group][dim] = group_size[group] != 0
+                                        ? group_centers[group][dim] /
+                                              (KM_TYPE)group_size[group]
+                                        : KM_HUGE;
+  }
+
+  // Members sorted by group, in ascending order inside a group
+  state->group_first[0] = 0;
+  for (size_t group = 0; group < groups; ++group)
+    state->group_first[group + 1] = state->group_first[group] + group_size[group];
+  memcpy(group_size, state->group_first, groups * sizeof(*group_size));
+  for (size_t centro = 0; centro < k; ++centro)
+    state->group_members[group_size[state->centroid_group[centro]]++] = centro;
+
+  state->group_offset[0] = 0;
+  for (size_t group = 0; group < groups; ++group)
+    state->group_offset[group + 1] =
+        state->group_offset[group] +
+        K_MEANS_KERNEL_STRIDE(
+            state->group_first[group + 1] - state->group_first[group],
+            KM_TYPE);
+  size_t total = dimension * state->group_offset[groups];
+  state->group_centroids_soa =
+      k_means_arena_alloc(state->arena, total * sizeof(KM_TYPE));
+  if (state->group_centroids_soa == NULL)
+    return;
+  for (size_t i = 0; i < total; ++i)
+    state->group_centroids_soa[i] = KM_HUGE;
+  KM_NAME(transpose_groups)(state);
+}
+
+__attribute__((always_inline)) static inline void
+KM_NAME(k_means_seed)(struct KM_NAME(k_means_worker) *worker,
+                      const size_t dimension) {
+  struct KM_NAME(k_means_state) *state = worker->state;
+  switch (state->init) {
+  case k_means_init_plusplus:
+    KM_NAME(seed_plusplus)(worker, dimension);
+    break;
+  case k_means_init_parallel:
+    KM_NAME(seed_parallel)(worker, dimension);
+    break;
+  case k_means_init_given:
+    if (worker == &state->workers[0])
+      memcpy(state->centroids, state->initial_centroids,
+             sizeof(KM_TYPE[state->k][dimension]));
+    break;
+  case k_means_init_random:
+  default:
+    if (worker == &state->workers[0])
+      KM_NAME(seed_random)(state);
+    break;
+  }
+  pthread_barrier_wait(&state->barrier);
+  if (worker == &state->workers[0] && !state->arena->failed) {
+    KM_NAME(transpose_centroids)(
+        dimension, state->k, state->stride,
+        (KM_TYPE(*)[dimension])state->centroids,
+        (KM_TYPE(*)[state->stride])state->centroids_soa);
+#ifdef KM_GEMM
+    if (state->gemm)
+      KM_NAME(centroid_norms)(state, dimension);
+#endif
+    if (state->algorithm == k_means_yinyang)
+      KM_NAME(yinyang_group_centroids)(state, dimension);
+    get_current_time(&state->seeding_end);
+  }
+  pthread_barrier_wait(&state->barrier);
+}
+
+// The bounds are widened by a relative margin larger than the rounding error
+// of the computed distances. A centroid is only pruned when it is farther than
+// the assigned one by more than this margin, so that the labels never differ
+// from the ones of the Lloyd algorithm.
+__attribute__((const)) static inline double
+KM_NAME(bound_margin)(size_t dimension) {
+  return 4. * ((double)dimension + 4.) * (double)KM_EPSILON;
+}
+
+__attribute__((always_inline)) static inline KM_TYPE
+KM_NAME(bound_above)(double value, double margin) {
+  return (KM_TYPE)(value * (1. + margin));
+}
+
+__attribute__((always_inline)) static inline KM_TYPE
+KM_NAME(bound_below)(double value, double margin) {
+  return value > 0. ? (KM_TYPE)(value * (1. - margin)) : 0;
+}
+
+// Movement of the centroids and distances between them (drift of the groups for
+// Yinyang), used to update the bounds of the next iteration
+static void KM_NAME(k_means_update_bounds_data)(
+    struct KM_NAME(k_means_state) *state) {
+  const size_t dimension = state->dimension;
+  const size_t k = state->k;
+  const double margin = KM_NAME(bound_margin)(dimension);
+  KM_TYPE(*centroids)[dimension] = (KM_TYPE(*)[dimension])state->centroids;
+  KM_TYPE(*previous)[dimension] =
+      (KM_TYPE(*)[dimension])state->previous_centroids;
+
+  state->largest_movement = 0.;
+  state->second_largest_movement = 0.;
+  state->fastest_centroid = 0;
+  for (size_t centro = 0; centro < k; ++centro) {
+    double movement = sqrt((double)KM_NAME(distance_square)(
+        dimension, previous[centro], centroids[centro]));
+    movement = KM_NAME(bound_above)(movement, margin);
+    state->centroid_movement[centro] = movement;
+    if (movement > state->largest_movement) {
+      state->second_largest_movement = state->largest_movement;
+      state->largest_movement = movement;
+      state->fastest_centroid = centro;
+    } else if (movement > state->second_largest_movement) {
+      state->second_largest_movement = movement;
+    }
+  }
+
+  if (state->algorithm == k_means_yinyang) {
+    for (size_t group = 0; group < state->groups; ++group) {
+      state->group_drift[group] = 0.;
+      for (size_t i = state->group_first[group];
+           i < state->group_first[group + 1]; ++i)
+        if (state->centroid_movement[state->group_members[i]] >
+            state->group_drift[group])
+          state->group_drift[group] =
+              state->centroid_movement[state->group_members[i]];
+    }
+    KM_NAME(transpose_groups)(state);
+    return;
+  }
+
+  for (size_t centro = 0; centro < k; ++centro)
+    state->half_closest_centroid[centro] = HUGE_VAL;
+  for (size_t centro = 0; centro < k; ++centro) {
+    for (size_t other = centro + 1; other < k; ++other) {
+      double half_distance = 0.5 * sqrt((double)KM_NAME(distance_square)(
+                                       dimension, centroids[centro],
+                                       centroids[other]));
+      half_distance = KM_NAME(bound_below)(half_distance, margin);
+      if (state->half_centroid_distances != NULL) {
+        state->half_centroid_distances[centro * k + other] = half_distance;
+        state->half_centroid_distances[other * k + centro] = half_distance;
+      }
+      if (half_distance < state->half_closest_centroid[centro])
+        state->half_closest_centroid[centro] = half_distance;
+      if (half_distance < state->half_closest_centroid[other])
+        state->half_closest_centroid[other] = half_distance;
+    }
+  }
+}
+
+// Check the termination criteria after an iteration
+static bool KM_NAME(k_means_should_stop)(struct KM_NAME(k_means_state) *state,
+                                         size_t reassigned, double shift,
+                                         double norm, double inertia) {
+  const struct k_means_termination *termination = &state->termination;
+  bool inertia_known = state->convergence_iterations > 1;
+  double inertia_decrease = state->previous_inertia - inertia;
+  state->previous_inertia = inertia;
+
+  if (reassigned == 0) {
+    state->stop_reason = k_means_stop_converged;
+  } else if (termination->max_iterations != 0 &&
+             state->convergence_iterations >= termination->max_iterations) {
+    state->stop_reason = k_means_stop_max_iterations;
+  } else if (termination->shift_tolerance > 0. &&
+             shift <= termination->shift_tolerance *
+                          termination->shift_tolerance * norm) {
+    state->stop_reason = k_means_stop_shift_tolerance;
+  } else if (termination->inertia_tolerance > 0. && inertia_known &&
+             inertia_decrease <= termination->inertia_tolerance *
+                                     state->previous_inertia) {
+    state->stop_reason = k_means_stop_inertia_tolerance;
+  } else if (termination->reassigned_fraction > 0. &&
+             (double)reassigned <= termination->reassigned_fraction *
+                                       (double)state->total_weight) {
+    state->stop_reason = k_means_stop_reassigned_fraction;
+  } else if (termination->time_budget > 0.) {
+    time_measure now;
+    get_current_time(&now);
+    if (measuring_difftime(state->start, now) < termination->time_budget)
+      return false;
+    state->stop_reason = k_means_stop_time_budget;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+#ifdef K_MEANS_STATS
+static void KM_NAME(k_means_report_iteration)(
+    struct KM_NAME(k_means_state) *state, time_measure update_start,
+    size_t reassigned, double inertia, double shift) {
+  struct KM_NAME(k_means_worker) *first = &state->workers[0];
+  time_measure update_end;
+  get_current_time(&update_end);
+  // The first worker also counts the update
+  k_means_counters_elapsed(&first->counters, first->counters_start,
+                           first->counters_delta);
+
+  struct k_means_iteration_stats stats = {
+      .iteration = state->convergence_iterations,
+      .assign_time = 0.,
+      .update_time = measuring_difftime(update_start, update_end),
+      .reassigned = reassigned,
+      .inertia = inertia,
+      .empty_clusters = 0,
+      .shift = sqrt(shift),
+      .cycles = 0,
+      .cache_misses = 0,
+      .io_wait_time = state->iteration_io_wait_time,
+  };
+  for (unsigned thread = 0; thread < state->num_threads; ++thread) {
+    const struct KM_NAME(k_means_worker) *worker = &state->workers[thread];
+    if (worker->assign_time > stats.assign_time)
+      stats.assign_time = worker->assign_time;
+    const int64_t *delta = worker->counters_delta;
+    stats.cycles = stats.cycles < 0 || delta[k_means_counter_cycles] < 0
+                       ? -1
+                       : stats.cycles + delta[k_means_counter_cycles];
+    stats.cache_misses =
+        stats.cache_misses < 0 || delta[k_means_counter_cache_misses] < 0
+            ? -1
+            : stats.cache_misses + delta[k_means_counter_cache_misses];
+  }
+  for (size_t centro = 0; centro < state->k; ++centro)
+    if (first->centroids_point_count[centro] == 0)
+      stats.empty_clusters += 1;
+  stats.bandwidth = (double)state->points * (double)state->dimension *
+                    sizeof(KM_DATA) / stats.assign_time;
+  state->iteration_callback(&stats, state->callback_data);
+}
+#endif
+
+// Adds the partial results of the worker from to the worker into
+__attribute__((always_inline)) static inline void
+KM_NAME(k_means_merge_worker)(const size_t dimension, size_t k,
+                              struct KM_NAME(k_means_worker) *into,
+                              const struct KM_NAME(k_means_worker) *from) {
+  KM_SUM(*into_temp)[dimension] = (KM_SUM(*)[dimension])into->centroids_temp;
+  KM_SUM(*from_temp)[dimension] = (KM_SUM(*)[dimension])from->centroids_temp;
+  into->reassigned += from->reassigned;
+  into->inertia += from->inertia;
+  into->distance_computations += from->distance_computations;
+  for (size_t centro = 0; centro < k; ++centro) {
+    if (from->centroids_point_count[centro] == 0)
+      continue;
+    if (into->centroids_point_count[centro] == 0)
+      for (size_t dim = 0; dim < dimension; ++dim)
+        into_temp[centro][dim] = from_temp[centro][dim];
+    else
+      for (size_t dim = 0; dim < dimension; ++dim)
+        into_temp[centro][dim] += from_temp[centro][dim];
+    into->centroids_point_count[centro] += from->centroids_point_count[centro];
+  }
+}
+
+// Merges the workers of the node in thread order into its first worker, the
+// nodes are merged in parallel before the reduction
+__attribute__((always_inline)) static inline void
+KM_NAME(k_means_merge_node)(struct KM_NAME(k_means_state) *state,
+                            const size_t dimension, unsigned node) {
+  struct KM_NAME(k_means_worker) *leader =
+      &state->workers[state->node_first[node]];
+  for (unsigned thread = state->node_first[node] + 1;
+       thread < state->node_first[node + 1]; ++thread)
+    KM_NAME(k_means_merge_worker)(dimension, state->k, leader,
+                                  &state->workers[thread]);
+}
+
+__attribute__((always_inline)) static inline void
+KM_NAME(delta_add)(const size_t dimension, double (*restrict sums)[dimension],
+                   int64_t *restrict counts, size_t centroid,
+                   const KM_DATA *restrict point, int64_t weight) {
+  counts[centroid] += weight;
+  for (size_t dim = 0; dim < dimension; ++dim)
+    sums[centroid][dim] += (double)weight * (double)KM_LOAD(point[dim]);
+}
+
+// Adds the moved points of every worker to the persistent sums, in thread
+// order
+static void KM_NAME(k_means_merge_deltas)(struct KM_NAME(k_means_state) *state,
+                                          const size_t dimension) {
+  const size_t k = state->k;
+  double(*sums)[dimension] = (double(*)[dimension])state->sums;
+  if (state->delta_rebuild) {
+    memset(sums, 0, sizeof(double[k][dimension]));
+    memset(state->counts, 0, k * sizeof(*state->counts));
+  }
+  for (unsigned thread = 0; thread < state->num_threads; ++thread) {
+    const struct KM_NAME(k_means_worker) *worker = &state->workers[thread];
+    double(*delta_sums)[dimension] = (double(*)[dimension])worker->delta_sums;
+    for (size_t centro = 0; centro < k; ++centro) {
+      state->counts[centro] += worker->delta_counts[centro];
+      for (size_t dim = 0; dim < dimension; ++dim)
+        sums[centro][dim] += delta_sums[centro][dim];
+    }
+  }
+  for (size_t centro = 0; centro < k; ++centro)
+    state->workers[0].centroids_point_count[centro] =
+        (size_t)state->counts[centro];
+}
+
+// Executed by the first worker only, between the two barriers
+__attribute__((always_inline)) static inline void
+KM_NAME(k_means_reduce)(struct KM_NAME(k_means_state) *state,
+                        const size_t dimension) {
+#ifdef K_MEANS_STATS
+  time_measure update_start;
+  get_current_time(&update_start);
+#endif
+  const size_t k = state->k;
+  struct KM_NAME(k_means_worker) *first = &state->workers[0];
+  KM_TYPE(*centroids)[dimension] = (KM_TYPE(*)[dimension])state->centroids;
+  KM_SUM(*centroids_temp)[dimension] =
+      (KM_SUM(*)[dimension])first->centroids_temp;
+  size_t *centroids_point_count = first->centroids_point_count;
+
+  // The nodes were merged by their first worker
+  if (state->nodes == 1)
+    KM_NAME(k_means_merge_node)(state, dimension, 0);
+  for (unsigned node = 1; node < state->nodes; ++node)
+    KM_NAME(k_means_merge_worker)(dimension, k, first,
+                                  &state->workers[state->node_first[node]]);
+  size_t reassigned = first->reassigned;
+  double inertia = first->inertia;
+  state->distance_computations += first->distance_computations;
+  if (state->delta_update)
+    KM_NAME(k_means_merge_deltas)(state, dimension);
+  double(*sums)[dimension] = (double(*)[dimension])state->sums;
+
+  if (state->algorithm != k_means_lloyd)
+    memcpy(state->previous_centroids, centroids,
+           sizeof(KM_TYPE[k][dimension]));
+  double shift = 0., norm = 0.;
+  for (size_t centro = 0; centro < k; ++centro) {
+    if (centroids_point_count[centro] != 0) {
+      for (size_t dim = 0; dim < dimension; ++dim) {
+        KM_TYPE centroid =
+            state->delta_update
+                ? (KM_TYPE)(sums[centro][dim] /
+                            (double)centroids_point_count[centro])
+                : KM_NAME(mean)(centroids_temp[centro][dim],
+                                centroids_point_count[centro]);
+        double diff = (double)centroid - (double)centroids[centro][dim];
+        shift += diff * diff;
+        centroids[centro][dim] = centroid;
+      }
+    }
+    for (size_t dim = 0; dim < dimension; ++dim)
+      norm += (double)centroids[centro][dim] * (double)centroids[centro][dim];
+  }
+  KM_NAME(transpose_centroids)(dimension, k, state->stride, centroids,
+                               (KM_TYPE(*)[state->stride])state->centroids_soa);
+#ifdef KM_GEMM
+  if (state->gemm)
+    KM_NAME(centroid_norms)(state, dimension);
+#endif
+  state->convergence_iterations += 1;
+  state->delta_rebuild =
+      state->convergence_iterations % K_MEANS_DELTA_RENORMALIZATION_PERIOD ==
+      0;
+  bool abandoned = state->restarts != NULL &&
+                   k_means_restarts_report(state->restarts,
+                                           state->convergence_iterations,
+                                           inertia);
+  state->has_stopped =
+      KM_NAME(k_means_should_stop)(state, reassigned, shift, norm, inertia);
+  if (abandoned && !state->has_stopped) {
+    state->has_stopped = true;
+    state->stop_reason = k_means_stop_abandoned;
+  }
+  if (state->restarts != NULL && state->has_stopped)
+    k_means_restarts_leave(state->restarts);
+  if (state->algorithm != k_means_lloyd && !state->has_stopped)
+    KM_NAME(k_means_update_bounds_data)(state);
+#ifdef K_MEANS_STATS
+  if (state->iteration_callback != NULL)
+    KM_NAME(k_means_report_iteration)(state, update_start, reassigned, inertia,
+                                      shift);
+#endif
+  state->io_wait_time += state->iteration_io_wait_time;
+  state->iteration_io_wait_time = 0.;
+}
+
+// Compute every distance, keep the first closest centroid like the kernels
+__attribute__((always_inline)) static inline size_t
+KM_NAME(full_search)(struct KM_NAME(k_means_worker) *worker,
+                     const size_t dimension, const KM_TYPE *point,
+                     KM_TYPE *closest, KM_TYPE *second_closest) {
+  struct KM_NAME(k_means_state) *state = worker->state;
+  const size_t k = state->k;
+  KM_TYPE *distances = worker->distances;
+  state->distances(dimension, k, point, worker->centroids_soa, state->stride,
+                   distances);
+  worker->distance_computations += k;
+  size_t centroid_chosen = 0;
+  *closest = KM_HUGE;
+  *second_closest = KM_HUGE;
+  for (size_t centro = 0; centro < k; ++centro) {
+    if (distances[centro] < *closest) {
+      *second_closest = *closest;
+      *closest = distances[centro];
+      centroid_chosen = centro;
+    } else if (distances[centro] < *second_closest) {
+      *second_closest = distances[centro];
+    }
+  }
+  return centroid_chosen;
+}
+
+__attribute__((always_inline)) static inline size_t
+KM_NAME(hamerly_assign)(struct KM_NAME(k_means_worker) *worker,
+                        const size_t dimension, const size_t pos,
+                        const KM_TYPE *point, const double margin) {
+  struct KM_NAME(k_means_state) *state = worker->state;
+  KM_TYPE *upper = &state->upper_bounds[pos];
+  KM_TYPE *lower = &state->lower_bounds[pos];
+  KM_TYPE closest, second_closest;
+
+  if (state->convergence_iterations != 0) {
+    size_t centroid =
+      k_means_get_label(state->point_centroid_map, state->label_size, pos);
+    double lower_drift = centroid == state->fastest_centroid
+                             ? state->second_largest_movement
+                             : state->largest_movement;
+    *upper = KM_NAME(bound_above)(
+        (double)*upper + state->centroid_movement[centroid], margin);
+    *lower = KM_NAME(bound_below)((double)*lower - lower_drift, margin);
+    double limit = state->half_closest_centroid[centroid];
+    if ((double)*lower > limit)
+      limit = (double)*lower;
+    if ((double)*upper < limit)
+      return centroid;
+    // Tighten the upper bound before searching
+    KM_TYPE(*centroids)[dimension] = (KM_TYPE(*)[dimension])state->centroids;
+    worker->distance_computations += 1;
+    *upper = KM_NAME(bound_above)(
+        sqrt((double)KM_NAME(distance_square)(dimension, point,
+                                              centroids[centroid])),
+        margin);
+    if ((double)*upper < limit)
+      return centroid;
+  }
+
+  size_t centroid_chosen = KM_NAME(full_search)(worker, dimension, point,
+                                                 &closest, &second_closest);
+  *upper = KM_NAME(bound_above)(sqrt((double)closest), margin);
+  *lower = KM_NAME(bound_below)(sqrt((double)second_closest), margin);
+  return centroid_chosen;
+}
+
+__attribute__((always_inline)) static inline size_t
+KM_NAME(elkan_assign)(struct KM_NAME(k_means_worker) *worker,
+                      const size_t dimension, const size_t pos,
+                      const KM_TYPE *point, const double margin) {
+  struct KM_NAME(k_means_state) *state = worker->state;
+  const size_t k = state->k;
+  KM_TYPE *upper = &state->upper_bounds[pos];
+  KM_TYPE *lower = &state->lower_bounds[pos * k];
+
+  if (state->convergence_iterations == 0) {
+    KM_TYPE closest, second_closest;
+    size_t centroid_chosen = KM_NAME(full_search)(worker, dimension, point,
+                                                   &closest, &second_closest);
+    for (size_t centro = 0; centro < k; ++centro)
+      lower[centro] =
+          KM_NAME(bound_below)(sqrt((double)worker->distances[centro]), margin);
+    *upper = KM_NAME(bound_above)(sqrt((double)closest), margin);
+    return centroid_chosen;
+  }
+
+  size_t centroid =
+      k_means_get_label(state->point_centroid_map, state->label_size, pos);
+  for (size_t centro = 0; centro < k; ++centro)
+    lower[centro] = KM_NAME(bound_below)(
+        (double)lower[centro] - state->centroid_movement[centro], margin);
+  *upper = KM_NAME(bound_above)(
+      (double)*upper + state->centroid_movement[centroid], margin);
+  if ((double)*upper < state->half_closest_centroid[centroid])
+    return centroid;
+
+  KM_TYPE(*centroids)[dimension] = (KM_TYPE(*)[dimension])state->centroids;
+  bool upper_is_tight = false;
+  KM_TYPE closest = KM_HUGE;
+  for (size_t centro = 0; centro < k; ++centro) {
+    if (centro == centroid)
+      continue;
+    double limit = state->half_centroid_distances[centroid * k + centro];
+    if ((double)lower[centro] > limit)
+      limit = (double)lower[centro];
+    if ((double)*upper < limit)
+      continue;
+    if (!upper_is_tight) {
+      closest =
+          KM_NAME(distance_square)(dimension, point, centroids[centroid]);
+      worker->distance_computations += 1;
+      *upper = KM_NAME(bound_above)(sqrt((double)closest), margin);
+      lower[centroid] = KM_NAME(bound_below)(sqrt((double)closest), margin);
+      upper_is_tight = true;
+      if ((double)*upper < limit)
+        continue;
+    }
+    KM_TYPE distance_square =
+        KM_NAME(distance_square)(dimension, point, centroids[centro]);
+    worker->distance_computations += 1;
+    lower[centro] =
+        KM_NAME(bound_below)(sqrt((double)distance_square), margin);
+    // On ties the lowest index wins, as in the Lloyd search
+    if (distance_square < closest ||
+        (!(distance_square > closest) && centro < centroid)) {
+      closest = distance_square;
+      centroid = centro;
+      *upper = KM_NAME(bound_above)(sqrt((double)closest), margin);
+    }
+  }
+  return centroid;
+}
+
+// Yinyang (Ding et al.): the lower bounds of a point are kept per group of
+// centroids and a group is only searched when its bound does not rule it out.
+// The centroids of a searched group are compared at once with the distances
+// kernel, on a copy of the centroids transposed group by group.
+__attribute__((always_inline)) static inline size_t
+KM_NAME(yinyang_assign)(struct KM_NAME(k_means_worker) *worker,
+                        const size_t dimension, const size_t pos,
+                        const KM_TYPE *point, const double margin) {
+  struct KM_NAME(k_means_state) *state = worker->state;
+  const size_t k = state->k;
+  const size_t groups = state->groups;
+  const size_t *group_first = state->group_first;
+  const size_t *group_members = state->group_members;
+  KM_TYPE *distances = worker->distances;
+  KM_TYPE *upper = &state->upper_bounds[pos];
+  KM_TYPE *lower = &state->lower_bounds[pos * groups];
+
+  if (state->convergence_iterations == 0) {
+    KM_TYPE closest, second_closest;
+    size_t centroid_chosen = KM_NAME(full_search)(worker, dimension, point,
+                                                  &closest, &second_closest);
+    for (size_t group = 0; group < groups; ++group) {
+      KM_TYPE lowest = KM_HUGE;
+      for (size_t i = group_first[group]; i < group_first[group + 1]; ++i) {
+        size_t centro = group_members[i];
+        if (centro != centroid_chosen && distances[centro] < lowest)
+          lowest = distances[centro];
+      }
+      lower[group] = KM_NAME(bound_below)(sqrt((double)lowest), margin);
+    }
+    *upper = KM_NAME(bound_above)(sqrt((double)closest), margin);
+    return centroid_chosen;
+  }
+
+  const size_t centroid =
+      k_means_get_label(state->point_centroid_map, state->label_size, pos);
+  double global_lower = HUGE_VAL;
+  for (size_t group = 0; group < groups; ++group) {
+    lower[group] = KM_NAME(bound_below)(
+        (double)lower[group] - state->group_drift[group], margin);
+    if ((double)lower[group] < global_lower)
+      global_lower = (double)lower[group];
+  }
+  *upper = KM_NAME(bound_above)(
+      (double)*upper + state->centroid_movement[centroid], margin);
+  if ((double)*upper < global_lower)
+    return centroid;
+
+  KM_TYPE(*centroids)[dimension] = (KM_TYPE(*)[dimension])state->centroids;
+  KM_TYPE assigned_distance =
+      KM_NAME(distance_square)(dimension, point, centroids[centroid]);
+  worker->distance_computations += 1;
+  *upper = KM_NAME(bound_above)(sqrt((double)assigned_distance), margin);
+  if ((double)*upper < global_lower)
+    return centroid;
+
+  // The bound of a searched group is its closest centroid, except for the
+  // group of the centroid chosen where it is the second closest one
+  size_t centroid_chosen = centroid;
+  KM_TYPE closest = assigned_distance;
+  size_t chosen_group = groups;
+  KM_TYPE chosen_group_second = KM_HUGE;
+  for (size_t group = 0; group < groups; ++group) {
+    const size_t first = group_first[group];
+    const size_t count = group_first[group + 1] - first;
+    if (count == 0 || (double)*upper < (double)lower[group])
+      continue;
+    state->distances(dimension, count, point,
+                     &state->group_centroids_soa[dimension *
+                                                 state->group_offset[group]],
+                     K_MEANS_KERNEL_STRIDE(count, KM_TYPE), distances);
+    worker->distance_computations += count;
+    KM_TYPE lowest = KM_HUGE, second_lowest = KM_HUGE;
+    size_t lowest_centroid = k;
+    for (size_t i = 0; i < count; ++i) {
+      if (distances[i] < lowest) {
+        second_lowest = lowest;
+        lowest = distances[i];
+        lowest_centroid = group_members[first + i];
+      } else if (distances[i] < second_lowest) {
+        second_lowest = distances[i];
+      }
+    }
+    // On ties the lowest index wins, as in the Lloyd search
+    if (lowest < closest ||
+        (!(lowest > closest) && lowest_centroid < centroid_chosen)) {
+      closest = lowest;
+      centroid_chosen = lowest_centroid;
+      *upper = KM_NAME(bound_above)(sqrt((double)closest), margin);
+    }
+    if (lowest_centroid == centroid_chosen) {
+      chosen_group = group;
+      chosen_group_second = second_lowest;
+    }
+    lower[group] = KM_NAME(bound_below)(sqrt((double)lowest), margin);
+  }
+
+  if (chosen_group != groups)
+    lower[chosen_group] =
+        KM_NAME(bound_below)(sqrt((double)chosen_group_second), margin);
+  // The group of the previous centroid has to include it when not searched
+  size_t previous_group = state->centroid_group[centroid];
+  if (centroid_chosen != centroid && chosen_group != previous_group) {
+    KM_TYPE bound =
+        KM_NAME(bound_below)(sqrt((double)assigned_distance), margin);
+    if (bound < lower[previous_group])
+      lower[previous_group] = bound;
+  }
+  return centroid_chosen;
+}
+
+#ifdef KM_GEMM
+// Nearest centroids of the points first to end - 1 in worker->gemm_nearest
+static void KM_NAME(gemm_block)(struct KM_NAME(k_means_worker) *worker,
+                                const size_t dimension, size_t first,
+                                size_t end, const KM_TYPE *centroids_soa) {
+  struct KM_NAME(k_means_state) *state = worker->state;
+  KM_DATA(*data)[dimension] = (KM_DATA(*)[dimension])state->data;
+#ifdef KM_CONVERTED_DATA
+  KM_TYPE(*points)[dimension] = (KM_TYPE(*)[dimension])worker->gemm_points;
+#ifdef KM_LOAD_ROW
+  // The rows are contiguous, the block is converted at once
+  KM_LOAD_ROW((end - first) * dimension, data[first], points[0]);
+#else
+  for (size_t pos = first; pos < end; ++pos)
+    KM_NAME(load_point)(dimension, data[pos], points[pos - first]);
+#endif
+#else
+  KM_TYPE(*points)[dimension] = &data[first];
+#endif
+  state->nearest_gemm(dimension, state->k, end - first, &points[0][0],
+                      &state->point_norms[first], centroids_soa,
+                      state->stride, state->centroid_norms,
+                      worker->gemm_nearest);
+}
+#endif
+
+__attribute__((always_inline)) static inline void *
+KM_NAME(k_means_worker)(struct KM_NAME(k_means_worker) *worker,
+                        const size_t dimension) {
+  struct KM_NAME(k_means_state) *state = worker->state;
+  const size_t k = state->k;
+  const enum k_means_algorithm algorithm = state->algorithm;
+  const double margin = KM_NAME(bound_margin)(dimension);
+  KM_DATA(*restrict data)[dimension] = (KM_DATA(*)[dimension])state->data;
+  KM_SUM(*restrict centroids_temp)[dimension] =
+      (KM_SUM(*)[dimension])worker->centroids_temp;
+  KM_TYPE point_buffer[dimension];
+  size_t *restrict centroids_point_count = worker->centroids_point_count;
+  const uint32_t *weights = state->weights;
+  void *point_centroid_map = state->point_centroid_map;
+  const unsigned label_size = state->label_size;
+  const size_t stride = state->stride;
+  const KM_NEAREST_KERNEL nearest = state->nearest;
+  const bool delta_update = state->delta_update;
+  double(*restrict delta_sums)[dimension] =
+      (double(*)[dimension])worker->delta_sums;
+#ifdef K_MEANS_STATS
+  const bool track_inertia = state->termination.inertia_tolerance > 0. ||
+                             state->restarts != NULL ||
+                             state->iteration_callback != NULL;
+#else
+  const bool track_inertia =
+      state->termination.inertia_tolerance > 0. || state->restarts != NULL;
+#endif
+  KM_TYPE(*centroids)[dimension] = (KM_TYPE(*)[dimension])state->centroids;
+  if (!k_means_launch_wait(&state->launch))
+    return NULL;
+
+  // Bound before touching any memory, the replica is then allocated on the
+  // node of the worker. Without memory the node reads the centroids of the
+  // first node.
+  k_means_numa_bind(worker->node, state->nodes);
+  bool has_replica = worker->node_leader && worker->node != 0;
+  if (has_replica) {
+    state->replicas[worker->node] =
+        k_means_aligned_alloc(sizeof(KM_TYPE[dimension][stride]));
+    if (state->replicas[worker->node] == NULL) {
+      state->replicas[worker->node] = state->centroids_soa;
+      has_replica = false;
+    }
+  }
+
+  KM_NAME(k_means_seed)(worker, dimension);
+  if (state->arena->failed) {
+    if (has_replica)
+      free(state->replicas[worker->node]);
+    return NULL;
+  }
+#ifdef K_MEANS_STATS
+  k_means_counters_open(&worker->counters, state->hardware_counters);
+#endif
+#ifdef KM_GEMM
+  // The points do not move, their norms are computed once
+  if (state->gemm)
+    for (size_t pos = worker->first_point; pos < worker->last_point; ++pos)
+      state->point_norms[pos] = KM_NAME(norm_square)(
+          dimension, KM_NAME(load_point)(dimension, data[pos], point_buffer));
+#endif
+
+  do {
+    // Copy of the centroids of the seeding or of the last update
+    if (state->nodes > 1) {
+      if (has_replica)
+        memcpy(state->replicas[worker->node], state->centroids_soa,
+               sizeof(KM_TYPE[dimension][stride]));
+      pthread_barrier_wait(&state->barrier);
+      worker->centroids_soa = state->replicas[worker->node];
+    }
+    const KM_TYPE *centroids_soa = worker->centroids_soa;
+#ifdef K_MEANS_STATS
+    time_measure assign_start, assign_end;
+    get_current_time(&assign_start);
+    k_means_counters_read(&worker->counters, worker->counters_start);
+#endif
+
+    memset(centroids_point_count, 0, k * sizeof(*centroids_point_count));
+    const bool delta_rebuild = state->delta_rebuild;
+    // The labels given by the caller are not those of these centroids, every
+    // point of the first iteration is counted as reassigned
+    const bool first_assignment = state->convergence_iterations == 0;
+    if (delta_update) {
+      memset(delta_sums, 0, sizeof(double[k][dimension]));
+      memset(worker->delta_counts, 0, k * sizeof(*worker->delta_counts));
+    }
+    worker->distance_computations = 0;
+
+    worker->reassigned = 0;
+    worker->inertia = 0.;
+#ifdef KM_GEMM
+    size_t block_first = worker->first_point, block_end = block_first;
+#endif
+    // For every data of this thread
+    for (size_t pos = worker->first_point; pos < worker->last_point; ++pos) {
+
+      const KM_TYPE *point =
+          KM_NAME(load_point)(dimension, data[pos], point_buffer);
+      size_t centroid_chosen;
+      switch (algorithm) {
+      case k_means_hamerly:
+        centroid_chosen =
+            KM_NAME(hamerly_assign)(worker, dimension, pos, point, margin);
+        break;
+      case k_means_elkan:
+        centroid_chosen =
+            KM_NAME(elkan_assign)(worker, dimension, pos, point, margin);
+        break;
+      case k_means_yinyang:
+        centroid_chosen =
+            KM_NAME(yinyang_assign)(worker, dimension, pos, point, margin);
+        break;
+      case k_means_lloyd:
+      default:
+#ifdef KM_GEMM
+        if (state->gemm) {
+          if (pos == block_end) {
+            block_first = pos;
+            block_end = worker->last_point - pos > K_MEANS_GEMM_BLOCK
+                            ? pos + K_MEANS_GEMM_BLOCK
+                            : worker->last_point;
+            KM_NAME(gemm_block)(worker, dimension, block_first, block_end,
+                                centroids_soa);
+          }
+          centroid_chosen = worker->gemm_nearest[pos - block_first];
+        } else
+#endif
+          centroid_chosen =
+              nearest(dimension, k, point, centroids_soa, stride);
+        worker->distance_computations += k;
+        break;
+      }
+
+      // Multiplying by a weight of one is exact, the unweighted sums are
+      // unchanged
+      const uint32_t weight = k_means_weight(weights, pos);
+      const size_t previous =
+          k_means_get_label(point_centroid_map, label_size, pos);
+      if (first_assignment || previous != centroid_chosen)
+        worker->reassigned += weight;
+      if (track_inertia)
+        worker->inertia += (double)weight * (double)KM_NAME(distance_square)(
+                                                dimension, point,
+                                                centroids[centroid_chosen]);
+      k_means_set_label(point_centroid_map, label_size, pos, centroid_chosen);
+
+      if (delta_update) {
+        // The labels of the first iteration are not initialized
+        if (delta_rebuild) {
+          KM_NAME(delta_add)(dimension, delta_sums, worker->delta_counts,
+                             centroid_chosen, data[pos], weight);
+        } else if (previous != centroid_chosen) {
+          KM_NAME(delta_add)(dimension, delta_sums, worker->delta_counts,
+                             previous, data[pos], -(int64_t)weight);
+          KM_NAME(delta_add)(dimension, delta_sums, worker->delta_counts,
+                             centroid_chosen, data[pos], weight);
+        }
+        continue;
+      }
+      const bool first_point = centroids_point_count[centroid_chosen] == 0;
+      centroids_point_count[centroid_chosen] += weight;
+
+      if (first_point)
+        for (size_t dim = 0; dim < dimension; ++dim)
+          centroids_temp[centroid_chosen][dim] =
+              (KM_SUM)weight * (KM_SUM)KM_LOAD(data[pos][dim]);
+      else
+        for (size_t dim = 0; dim < dimension; ++dim)
+          centroids_temp[centroid_chosen][dim] +=
+              (KM_SUM)weight * (KM_SUM)KM_LOAD(data[pos][dim]);
+    }
+#ifdef K_MEANS_STATS
+    get_current_time(&assign_end);
+    worker->assign_time = measuring_difftime(assign_start, assign_end);
+    k_means_counters_elapsed(&worker->counters, worker->counters_start,
+                             worker->counters_delta);
+#endif
+
+    pthread_barrier_wait(&state->barrier);
+    if (state->nodes > 1) {
+      if (worker->node_leader)
+        KM_NAME(k_means_merge_node)(state, dimension, worker->node);
+      pthread_barrier_wait(&state->barrier);
+    }
+    if (worker == &state->workers[0])
+      KM_NAME(k_means_reduce)(state, dimension);
+    pthread_barrier_wait(&state->barrier);
+
+  } while (!state->has_stopped);
+#ifdef K_MEANS_STATS
+  k_means_counters_close(&worker->counters);
+#endif
+  if (has_replica)
+    free(state->replicas[worker->node]);
+
+  // Inertia of the final centroids
+  double inertia = 0.;
+  for (size_t pos = worker->first_point; pos < worker->last_point; ++pos)
+    inertia += k_means_weight(weights, pos) *
+               (double)KM_NAME(point_distance_square)(
+                   dimension, data[pos],
+                   centroids[k_means_get_label(point_centroid_map, label_size,
+                                               pos)]);
+  worker->inertia = inertia;
+
+  return NULL;
+}
+
+static void *KM_NAME(k_means_worker_generic)(void *arg) {
+  struct KM_NAME(k_means_worker) *worker = arg;
+  return KM_NAME(k_means_worker)(worker, worker->state->dimension);
+}
+
+#define KM_WORKER_DIMENSION(dim)                                               \
+  static void *KM_WORKER(dim)(void *arg) {                                     \
+    return KM_NAME(k_means_worker)(arg, dim);                                  \
+  }
+KM_WORKER_DIMENSION(1)
+KM_WORKER_DIMENSION(2)
+KM_WORKER_DIMENSION(3)
+KM_WORKER_DIMENSION(4)
+KM_WORKER_DIMENSION(5)
+KM_WORKER_DIMENSION(6)
+KM_WORKER_DIMENSION(7)
+KM_WORKER_DIMENSION(8)
+#undef KM_WORKER_DIMENSION
+
+// Indexed by K_MEANS_SPECIALIZATION(dimension)
+static void *(*const KM_NAME(k_means_workers)[])(void *) = {
+    KM_NAME(k_means_worker_generic),
+    KM_WORKER(1),
+    KM_WORKER(2),
+    KM_WORKER(3),
+    KM_WORKER(4),
+    KM_WORKER(5),
+    KM_WORKER(6),
+    KM_WORKER(7),
+    KM_WORKER(8),
+};
+
+static size_t KM_NAME(k_means_run)(struct k_means_context *context,
+                                   size_t points, size_t dimension, size_t k,
+                                   KM_DATA data[restrict points][dimension],
+                                   void *point_centroid_map,
+                                   const struct k_means_config *config,
+                                   struct k_means_stats *stats,
+                                   struct k_means_restarts *restarts) {
+
+  if (config == NULL)
+    config = &k_means_default_config;
+  if (config->init == k_means_init_given && config->initial_centroids == NULL) {
+    fprintf(stderr, "The given seeding requires initial centroids\n");
+    return k_means_failed_run(context, restarts);
+  }
+  unsigned num_threads = k_means_clamp_threads(points, config->num_threads);
+  unsigned nodes = config->numa ? k_means_numa_nodes(num_threads) : 1;
+  const size_t specialization = K_MEANS_SPECIALIZATION(dimension);
+  const struct k_means_kernels *kernels = k_means_kernels();
+  struct k_means_arena *arena = &context->arena;
+  k_means_arena_reset(arena);
+
+  struct KM_NAME(k_means_state) state = {
+      .points = points,
+      .dimension = dimension,
+      .k = k,
+      .label_size = K_MEANS_LABEL_SIZE(k),
+      .algorithm = config->algorithm,
+      .init = config->init,
+      .seed = config->seed,
+      .initial_centroids = config->initial_centroids,
+      .data = &data[0][0],
+      .weights = config->weights,
+      .total_weight = points,
+      .point_centroid_map = point_centroid_map,
+      .arena = arena,
+      .centroids = k_means_arena_alloc(arena, sizeof(KM_TYPE[k][dimension])),
+      .stride = K_MEANS_KERNEL_STRIDE(k, KM_TYPE),
+      .nearest = kernels->KM_CONCAT(nearest, KM_KERNEL_SUFFIX)[specialization],
+      .distances = kernels->KM_CONCAT(distances, KM_KERNEL_SUFFIX),
+      .num_threads = num_threads,
+      .workers = k_means_arena_alloc(arena, num_threads * sizeof(*state.workers)),
+      .nodes = nodes,
+      .node_first =
+          k_means_arena_alloc(arena, (nodes + 1) * sizeof(*state.node_first)),
+      .replicas = k_means_arena_alloc(arena, nodes * sizeof(*state.replicas)),
+      .termination = config->termination,
+      .has_stopped = false,
+      .convergence_iterations = 0,
+      .distance_computations = 0,
+      .restarts = restarts,
+      .delta_update = config->delta_update,
+      .delta_rebuild = true,
+#ifdef K_MEANS_STATS
+      .iteration_callback = config->iteration_callback,
+      .callback_data = config->callback_data,
+      .hardware_counters =
+          config->hardware_counters && config->iteration_callback != NULL,
+#endif
+  };
+  if (arena->failed)
+    return k_means_failed_run(context, restarts);
+
+  // Filled once every block is allocated
+  if (state.weights != NULL)
+    state.cumulated_weights =
+        k_means_arena_alloc(arena, points * sizeof(*state.cumulated_weights));
+  state.centroids_soa =
+      k_means_arena_alloc(arena, sizeof(KM_TYPE[dimension][state.stride]));
+  if (state.init == k_means_init_plusplus ||
+      state.init == k_means_init_parallel)
+    state.min_distance =
+        k_means_arena_alloc(arena, points * sizeof(*state.min_distance));
+  if (state.init == k_means_init_parallel) {
+    state.candidates_capacity = 1;
+    state.candidates = k_means_arena_alloc(arena, sizeof(*state.candidates));
+  }
+
+  if (state.delta_update) {
+    state.sums = k_means_arena_alloc(arena, sizeof(double[k][dimension]));
+    state.counts = k_means_arena_alloc(arena, k * sizeof(*state.counts));
+  }
+#ifdef KM_GEMM
+  const size_t gemm_dimension = config->gemm_dimension != 0
+                                    ? config->gemm_dimension
+                                    : K_MEANS_GEMM_DIMENSION;
+  state.gemm = state.algorithm == k_means_lloyd && dimension >= gemm_dimension;
+  if (state.gemm) {
+    state.nearest_gemm = kernels->nearest_gemm_f;
+    state.point_norms =
+        k_means_arena_alloc(arena, points * sizeof(*state.point_norms));
+    state.centroid_norms = k_means_arena_alloc(
+        arena, state.stride * sizeof(*state.centroid_norms));
+  }
+#endif
+  if (state.algorithm == k_means_yinyang) {
+    state.groups = (k + K_MEANS_YINYANG_GROUP_SIZE - 1) /
+                   K_MEANS_YINYANG_GROUP_SIZE;
+    state.group_first = k_means_arena_alloc(
+        arena, (state.groups + 1) * sizeof(*state.group_first));
+    state.group_members =
+        k_means_arena_alloc(arena, k * sizeof(*state.group_members));
+    state.centroid_group =
+        k_means_arena_alloc(arena, k * sizeof(*state.centroid_group));
+    state.group_drift =
+        k_means_arena_alloc(arena, state.groups * sizeof(*state.group_drift));
+    state.group_offset = k_means_arena_alloc(
+        arena, (state.groups + 1) * sizeof(*state.group_offset));
+  }
+  if (state.algorithm != k_means_lloyd) {
+    size_t lower_bounds_per_point = state.algorithm == k_means_elkan ? k
+                                    : state.algorithm == k_means_yinyang
+                                        ? state.groups
+                                        : 1;
+    state.upper_bounds =
+        k_means_arena_alloc(arena, points * sizeof(*state.upper_bounds));
+    state.lower_bounds = k_means_arena_alloc(
+        arena, points * lower_bounds_per_point * sizeof(*state.lower_bounds));
+    state.previous_centroids =
+        k_means_arena_alloc(arena, sizeof(KM_TYPE[k][dimension]));
+    state.centroid_movement =
+        k_means_arena_alloc(arena, k * sizeof(*state.centroid_movement));
+    state.half_closest_centroid =
+        k_means_arena_alloc(arena, k * sizeof(*state.half_closest_centroid));
+    if (state.algorithm == k_means_elkan)
+      state.half_centroid_distances =
+          k_means_arena_alloc(arena, sizeof(double[k][k]));
+  }
+
+  for (unsigned thread = 0; thread < num_threads; ++thread) {
+    struct KM_NAME(k_means_worker) *worker = &state.workers[thread];
+    worker->state = &state;
+    worker->first_point = points * thread / num_threads;
+    worker->last_point = points * (thread + 1) / num_threads;
+    worker->node = k_means_numa_node(thread, num_threads, nodes);
+    worker->node_leader =
+        thread == 0 || worker->node != state.workers[thread - 1].node;
+    if (worker->node_leader)
+      state.node_first[worker->node] = thread;
+    worker->centroids_soa = state.centroids_soa;
+    worker->centroids_temp =
+        k_means_arena_alloc(arena, sizeof(KM_SUM[k][dimension]));
+    worker->centroids_point_count =
+        k_means_arena_alloc(arena, k * sizeof(*worker->centroids_point_count));
+    if (state.delta_update) {
+      worker->delta_sums =
+          k_means_arena_alloc(arena, sizeof(double[k][dimension]));
+      worker->delta_counts =
+          k_means_arena_alloc(arena, k * sizeof(*worker->delta_counts));
+    }
+    worker->distances =
+        state.algorithm == k_means_lloyd
+            ? NULL
+            : k_means_arena_alloc(arena,
+                                  state.stride * sizeof(*worker->distances));
+#ifdef KM_GEMM
+    if (state.gemm) {
+      worker->gemm_nearest = k_means_arena_alloc(
+          arena, K_MEANS_GEMM_BLOCK * sizeof(*worker->gemm_nearest));
+#ifdef KM_CONVERTED_DATA
+      worker->gemm_points = k_means_arena_alloc(
+          arena, sizeof(KM_TYPE[K_MEANS_GEMM_BLOCK][dimension]));
+#endif
+    }
+#endif
+    worker->num_sampled = 0;
+    worker->candidate_weights = NULL;
+  }
+  state.node_first[nodes] = num_threads;
+  if (arena->failed)
+    return k_means_failed_run(context, restarts);
+
+  if (state.weights != NULL) {
+    state.total_weight = 0;
+    for (size_t pos = 0; pos < points; ++pos) {
+      state.total_weight += state.weights[pos];
+      state.cumulated_weights[pos] = state.total_weight;
+    }
+  }
+  // The centroids are chosen and transposed by the workers
+  for (size_t i = 0; i < dimension * state.stride; ++i)
+    state.centroids_soa[i] = KM_HUGE;
+  state.replicas[0] = state.centroids_soa;
+
+  // The calling thread acts as the first worker
+  void *(*worker_function)(void *) = KM_NAME(k_means_workers)[specialization];
+  pthread_barrier_init(&state.barrier, NULL, num_threads);
+  k_means_launch_init(&state.launch);
+  k_means_affinity caller_affinity;
+  if (nodes > 1)
+    k_means_affinity_save(&caller_affinity);
+  time_measure end;
+  get_current_time(&state.start);
+  unsigned spawned = 1;
+  while (spawned < num_threads &&
+         k_means_spawn_worker(&state.workers[spawned].thread, worker_function,
+                              &state.workers[spawned]))
+    spawned += 1;
+  k_means_launch_decide(&state.launch, spawned != num_threads);
+  worker_function(&state.workers[0]);
+  for (unsigned thread = 1; thread < spawned; ++thread)
+    pthread_join(state.workers[thread].thread, NULL);
+  get_current_time(&end);
+  if (nodes > 1)
+    k_means_affinity_restore(&caller_affinity);
+  k_means_launch_destroy(&state.launch);
+  pthread_barrier_destroy(&state.barrier);
+  if (spawned != num_threads || arena->failed)
+    return k_means_failed_run(context, restarts);
+
+  double inertia = 0.;
+  for (unsigned thread = 0; thread < num_threads; ++thread)
+    inertia += state.workers[thread].inertia;
+  context->centroids = state.centroids;
+  context->centroid_size = sizeof(KM_TYPE);
+  context->inertia = inertia;
+
+  if (stats != NULL) {
+    stats->iterations = state.convergence_iterations;
+    stats->distance_computations = state.distance_computations;
+    size_t lloyd_computations = state.convergence_iterations * points * k;
+    stats->distance_computations_avoided =
+        lloyd_computations > state.distance_computations
+            ? lloyd_computations - state.distance_computations
+            : 0;
+    stats->seeding_time = measuring_difftime(state.start, state.seeding_end);
+    stats->iteration_time = measuring_difftime(state.seeding_end, end);
+    stats->stop_reason = state.stop_reason;
+    stats->inertia = inertia;
+    stats->io_wait_time = 0.;
+#ifdef KM_GEMM
+    stats->gemm = state.gemm;
+#else
+    stats->gemm = false;
+#endif
+  }
+
+  return state.convergence_iterations;
+}
+
+size_t KM_NAME(k_means_with_context)(struct k_means_context *context,
+                                     size_t points, size_t dimension, size_t k,
+                                     KM_DATA data[restrict points][dimension],
+                                     void *point_centroid_map,
+                                     const struct k_means_config *config,
+                                     struct k_means_stats *stats) {
+  return KM_NAME(k_means_run)(context, points, dimension, k, data,
+                              point_centroid_map, config, stats, NULL);
+}
+
+struct KM_NAME(k_means_restart_run) {
+  pthread_t thread;
+  struct k_means_context *context;
+  size_t points, dimension, k;
+  KM_DATA *data;
+  void *point_centroid_map;
+  struct k_means_config config;
+  struct k_means_stats stats;
+  size_t iterations;
+  struct k_means_restarts *restarts;
+};
+
+static void *KM_NAME(k_means_restart)(void *arg) {
+  struct KM_NAME(k_means_restart_run) *run = arg;
+  run->iterations = KM_NAME(k_means_run)(
+      run->context, run->points, run->dimension, run->k,
+      (KM_DATA(*)[run->dimension])run->data, run->point_centroid_map,
+      &run->config, &run->stats, run->restarts);
+  return NULL;
+}
+
+static void KM_NAME(k_means_restarts_free)(
+    size_t restarts, struct KM_NAME(k_means_restart_run) *runs) {
+  for (size_t restart = 0; restart < restarts; ++restart) {
+    k_means_context_destroy(runs[restart].context);
+    if (restart != 0)
+      free(runs[restart].point_centroid_map);
+  }
+  free(runs);
+}
+
+size_t KM_NAME(k_means_restarts)(struct k_means_context *context,
+                                 size_t points, size_t dimension, size_t k,
+                                 KM_DATA data[restrict points][dimension],
+                                 void *point_centroid_map,
+                                 const struct k_means_config *config,
+                                 size_t restarts, double abandon_margin,
+                                 struct k_means_stats *stats,
+                                 struct k_means_restart *restart_results) {
+  if (config == NULL)
+    config = &k_means_default_config;
+  if (restarts == 0)
+    restarts = 1;
+
+  // The first restart runs on the calling thread and labels the points of the
+  // caller's map
+  struct KM_NAME(k_means_restart_run) *runs = calloc(restarts, sizeof(*runs));
+  if (runs == NULL) {
+    fprintf(stderr, "Failed to allocate the k-means restarts\n");
+    return K_MEANS_ERROR;
+  }
+  struct k_means_restarts shared = {
+      .active = (unsigned)restarts,
+      .arrived = 0,
+      .generation = 0,
+      .lowest = HUGE_VAL,
+      .abandon_margin = abandon_margin,
+  };
+  bool allocated = true;
+  for (size_t restart = 0; restart < restarts; ++restart) {
+    struct KM_NAME(k_means_restart_run) *run = &runs[restart];
+    run->context = k_means_context_create();
+    run->points = points;
+    run->dimension = dimension;
+    run->k = k;
+    run->data = &data[0][0];
+    run->point_centroid_map =
+        restart == 0 ? point_centroid_map
+                     : calloc(points, K_MEANS_LABEL_SIZE(k));
+    run->config = *config;
+    run->config.seed = config->seed + restart;
+    run->restarts = &shared;
+    allocated = allocated && run->context != NULL &&
+                run->point_centroid_map != NULL;
+  }
+  if (!allocated) {
+    fprintf(stderr, "Failed to allocate the k-means restarts\n");
+    KM_NAME(k_means_restarts_free)(restarts, runs);
+    return K_MEANS_ERROR;
+  }
+
+  pthread_mutex_init(&shared.mutex, NULL);
+  pthread_cond_init(&shared.gathered, NULL);
+  size_t spawned = 1;
+  while (spawned < restarts &&
+         k_means_spawn_worker(&runs[spawned].thread, KM_NAME(k_means_restart),
+                              &runs[spawned]))
+    spawned += 1;
+  // The restarts which could not be created are not waited for
+  for (size_t restart = spawned; restart < restarts; ++restart)
+    k_means_restarts_leave(&shared);
+  KM_NAME(k_means_restart)(&runs[0]);
+  for (size_t restart = 1; restart < spawned; ++restart)
+    pthread_join(runs[restart].thread, NULL);
+  pthread_cond_destroy(&shared.gathered);
+  pthread_mutex_destroy(&shared.mutex);
+  bool failed = spawned != restarts;
+  for (size_t restart = 0; restart < spawned; ++restart)
+    failed = failed || runs[restart].iterations == K_MEANS_ERROR;
+  if (failed) {
+    KM_NAME(k_means_restarts_free)(restarts, runs);
+    return K_MEANS_ERROR;
+  }
+
+  // The lowest final inertia among the restarts which were not abandoned
+  size_t best = 0;
+  for (size_t restart = 0; restart < restarts; ++restart) {
+    const struct k_means_stats *run_stats = &runs[restart].stats;
+    if (restart_results != NULL)
+      restart_results[restart] = (struct k_means_restart){
+          .seed = runs[restart].config.seed,
+          .iterations = run_stats->iterations,
+          .inertia = run_stats->inertia,
+          .stop_reason = run_stats->stop_reason,
+      };
+    if (run_stats->stop_reason != k_means_stop_abandoned &&
+        (runs[best].stats.stop_reason == k_means_stop_abandoned ||
+         run_stats->inertia < runs[best].stats.inertia))
+      best = restart;
+  }
+  if (best != 0)
+    memcpy(point_centroid_map, runs[best].point_centroid_map,
+           points * K_MEANS_LABEL_SIZE(k));
+  if (stats != NULL)
+    *stats = runs[best].stats;
+  if (context != NULL) {
+    struct k_means_context previous = *context;
+    *context = *runs[best].context;
+    *runs[best].context = previous;
+  }
+  KM_NAME(k_means_restarts_free)(restarts, runs);
+  return best;
+}
+
+#ifndef KM_CONVERTED_DATA
+// Lloyd iterations over the chunks of the reader. The first worker waits for
+// every chunk, which the workers then split like the points in memory. A last
+// pass computes the inertia of the final centroids.
+static void *KM_NAME(k_means_stream_worker)(void *arg) {
+  struct KM_NAME(k_means_worker) *worker = arg;
+  struct KM_NAME(k_means_state) *state = worker->state;
+  const size_t dimension = state->dimension;
+  const size_t k = state->k;
+  const unsigned thread = (unsigned)(worker - state->workers);
+  const bool first_worker = thread == 0;
+  struct k_means_reader *reader = state->reader;
+  const size_t chunk_points = reader->chunk_points;
+  KM_SUM(*restrict centroids_temp)[dimension] =
+      (KM_SUM(*)[dimension])worker->centroids_temp;
+  size_t *restrict centroids_point_count = worker->centroids_point_count;
+  KM_TYPE(*centroids)[dimension] = (KM_TYPE(*)[dimension])state->centroids;
+  const KM_TYPE *centroids_soa = state->centroids_soa;
+  void *point_centroid_map = state->point_centroid_map;
+  const unsigned label_size = state->label_size;
+#ifdef K_MEANS_STATS
+  const bool track_inertia = state->termination.inertia_tolerance > 0. ||
+                             state->iteration_callback != NULL;
+  k_means_counters_open(&worker->counters, state->hardware_counters);
+#else
+  const bool track_inertia = state->termination.inertia_tolerance > 0.;
+#endif
+  if (!k_means_launch_wait(&state->launch))
+    return NULL;
+
+  uint64_t chunk = 0;
+  bool final_pass;
+  do {
+    final_pass = state->has_stopped;
+#ifdef K_MEANS_STATS
+    k_means_counters_read(&worker->counters, worker->counters_start);
+    worker->assign_time = 0.;
+#endif
+    memset(centroids_point_count, 0, k * sizeof(*centroids_point_count));
+    worker->distance_computations = 0;
+    worker->reassigned = 0;
+    worker->inertia = 0.;
+    const bool first_assignment = state->convergence_iterations == 0;
+    for (size_t part = 0; part < reader->chunks; ++part, ++chunk) {
+      if (first_worker)
+        state->chunk = k_means_reader_acquire(reader, chunk,
+                                              &state->iteration_io_wait_time);
+      pthread_barrier_wait(&state->barrier);
+      if (state->chunk == NULL) // Every worker gives up on the same chunk
+        return NULL;
+#ifdef K_MEANS_STATS
+      time_measure assign_start, assign_end;
+      get_current_time(&assign_start);
+#endif
+      const size_t first = part * chunk_points;
+      const size_t rows = state->points - first < chunk_points
+                              ? state->points - first
+                              : chunk_points;
+      const KM_DATA *restrict data = state->chunk;
+      const size_t begin = first + rows * thread / state->num_threads;
+      const size_t end = first + rows * (thread + 1) / state->num_threads;
+      for (size_t pos = begin; pos < end; ++pos) {
+        const KM_DATA *point = data + (pos - first) * dimension;
+        if (final_pass) {
+          worker->inertia += (double)KM_NAME(point_distance_square)(
+              dimension, point,
+              centroids[k_means_get_label(point_centroid_map, label_size,
+                                          pos)]);
+          continue;
+        }
+        size_t centroid_chosen =
+            state->nearest(dimension, k, point, centroids_soa, state->stride);
+        worker->distance_computations += k;
+        if (first_assignment ||
+            k_means_get_label(point_centroid_map, label_size, pos) !=
+                centroid_chosen)
+          worker->reassigned += 1;
+        if (track_inertia)
+          worker->inertia += (double)KM_NAME(distance_square)(
+              dimension, point, centroids[centroid_chosen]);
+        k_means_set_label(point_centroid_map, label_size, pos,
+                          centroid_chosen);
+        if (centroids_point_count[centroid_chosen]++ == 0)
+          for (size_t dim = 0; dim < dimension; ++dim)
+            centroids_temp[centroid_chosen][dim] = point[dim];
+        else
+          for (size_t dim = 0; dim < dimension; ++dim)
+            centroids_temp[centroid_chosen][dim] += point[dim];
+      }
+#ifdef K_MEANS_STATS
+      get_current_time(&assign_end);
+      worker->assign_time += measuring_difftime(assign_start, assign_end);
+#endif
+      pthread_barrier_wait(&state->barrier);
+      if (first_worker)
+        k_means_reader_release(reader, chunk);
+    }
+#ifdef K_MEANS_STATS
+    k_means_counters_elapsed(&worker->counters, worker->counters_start,
+                             worker->counters_delta);
+#endif
+    if (!final_pass) {
+      if (first_worker)
+        KM_NAME(k_means_reduce)(state, dimension);
+      pthread_barrier_wait(&state->barrier);
+    }
+  } while (!final_pass);
+#ifdef K_MEANS_STATS
+  k_means_counters_close(&worker->counters);
+#endif
+  return NULL;
+}
+
+// Reads the row of the streamed points at pos
+static bool KM_NAME(k_means_stream_row)(int fd, off_t offset,
+                                        size_t dimension, size_t pos,
+                                        KM_DATA row[dimension]) {
+  if (!k_means_pread(fd, offset + (off_t)(pos * sizeof(KM_DATA[dimension])),
+                     row, sizeof(KM_DATA[dimension]))) {
+    fprintf(stderr, "Failed to read the streamed points\n");
+    return false;
+  }
+  return true;
+}
+
+// k-means++ and k-means|| need every point at every draw, they seed and
+// cluster a uniform sample of the points instead, read in file order. False
+// when the sample could not be allocated, read or clustered.
+static bool KM_NAME(k_means_stream_sample)(
+    struct KM_NAME(k_means_state) *state, const struct k_means_config *config,
+    int fd, off_t offset) {
+  const size_t dimension = state->dimension;
+  const size_t k = state->k;
+  size_t samples = K_MEANS_STREAM_SAMPLE_PER_CENTROID * k;
+  if (samples > state->points)
+    samples = state->points;
+  size_t *sampled = malloc(samples * sizeof(*sampled));
+  KM_DATA(*sample)[dimension] = malloc(sizeof(KM_DATA[samples][dimension]));
+  void *sample_map = malloc(samples * state->label_size);
+  struct k_means_context *sample_context = k_means_context_create();
+  bool success = sampled != NULL && sample != NULL && sample_map != NULL &&
+                 sample_context != NULL;
+  if (!success)
+    fprintf(stderr, "Failed to allocate the sample of the streamed points\n");
+  for (size_t draw = 0; success && draw < samples; ++draw)
+    sampled[draw] =
+        samples == state->points
+            ? draw
+            : k_means_uniform_index(state->seed, k_means_stream_sample, draw,
+                                    state->points);
+  if (success)
+    qsort(sampled, samples, sizeof(*sampled), k_means_compare_index);
+  for (size_t draw = 0; success && draw < samples; ++draw)
+    success = KM_NAME(k_means_stream_row)(fd, offset, dimension,
+                                          sampled[draw], sample[draw]);
+
+  if (success) {
+    struct k_means_config sample_config = *config;
+    sample_config.iteration_callback = NULL;
+    sample_config.numa = false;
+    success = KM_NAME(k_means_run)(sample_context, samples, dimension, k,
+                                   sample, sample_map, &sample_config, NULL,
+                                   NULL) != K_MEANS_ERROR;
+  }
+  if (success)
+    memcpy(state->centroids, sample_context->centroids,
+           sizeof(KM_TYPE[k][dimension]));
+  k_means_context_destroy(sample_context);
+  free(sample_map);
+  free(sample);
+  free(sampled);
+  return success;
+}
+
+size_t KM_NAME(k_means_stream)(struct k_means_context *context, int fd,
+                               off_t offset, size_t points, size_t dimension,
+                               size_t k, size_t chunk_points,
+                               void *point_centroid_map,
+                               const struct k_means_config *config,
+                               struct k_means_stats *stats) {
+  if (config == NULL)
+    config = &k_means_default_config;
+  if (config->weights != NULL) {
+    fprintf(stderr, "The streamed points cannot be weighted\n");
+    return k_means_failed_run(context, NULL);
+  }
+  if (config->init == k_means_init_given && config->initial_centroids == NULL) {
+    fprintf(stderr, "The given seeding requires initial centroids\n");
+    return k_means_failed_run(context, NULL);
+  }
+  if (chunk_points == 0)
+    chunk_points = K_MEANS_STREAM_CHUNK_BYTES / sizeof(KM_DATA[dimension]);
+  if (chunk_points == 0)
+    chunk_points = 1;
+  if (chunk_points > points)
+    chunk_points = points;
+  // Every worker processes a part of every chunk
+  unsigned num_threads =
+      k_means_clamp_threads(chunk_points, config->num_threads);
+  const size_t specialization = K_MEANS_SPECIALIZATION(dimension);
+  const struct k_means_kernels *kernels = k_means_kernels();
+  struct k_means_arena *arena = &context->arena;
+  k_means_arena_reset(arena);
+
+  struct KM_NAME(k_means_state) state = {
+      .points = points,
+      .dimension = dimension,
+      .k = k,
+      .label_size = K_MEANS_LABEL_SIZE(k),
+      .algorithm = k_means_lloyd,
+      .init = config->init,
+      .seed = config->seed,
+      .initial_centroids = config->initial_centroids,
+      .data = NULL,
+      .weights = NULL,
+      .total_weight = points,
+      .point_centroid_map = point_centroid_map,
+      .arena = arena,
+      .centroids = k_means_arena_alloc(arena, sizeof(KM_TYPE[k][dimension])),
+      .stride = K_MEANS_KERNEL_STRIDE(k, KM_TYPE),
+      .nearest = kernels->KM_CONCAT(nearest, KM_KERNEL_SUFFIX)[specialization],
+      .distances = kernels->KM_CONCAT(distances, KM_KERNEL_SUFFIX),
+      .num_threads = num_threads,
+      .workers = k_means_arena_alloc(arena, num_threads * sizeof(*state.workers)),
+      .nodes = 1,
+      .node_first = k_means_arena_alloc(arena, 2 * sizeof(*state.node_first)),
+      .replicas = k_means_arena_alloc(arena, sizeof(*state.replicas)),
+      .termination = config->termination,
+      .has_stopped = false,
+      .convergence_iterations = 0,
+      .distance_computations = 0,
+      .restarts = NULL,
+      .reader = &(struct k_means_reader){.fd = -1},
+      .io_wait_time = 0.,
+      .iteration_io_wait_time = 0.,
+#ifdef K_MEANS_STATS
+      .iteration_callback = config->iteration_callback,
+      .callback_data = config->callback_data,
+      .hardware_counters =
+          config->hardware_counters && config->iteration_callback != NULL,
+#endif
+  };
+  if (arena->failed)
+    return k_means_failed_run(context, NULL);
+  state.centroids_soa =
+      k_means_arena_alloc(arena, sizeof(KM_TYPE[dimension][state.stride]));
+  state.replicas[0] = state.centroids_soa;
+  state.node_first[0] = 0;
+  state.node_first[1] = num_threads;
+  for (unsigned thread = 0; thread < num_threads; ++thread) {
+    struct KM_NAME(k_means_worker) *worker = &state.workers[thread];
+    worker->state = &state;
+    worker->node = 0;
+    worker->node_leader = thread == 0;
+    worker->centroids_soa = state.centroids_soa;
+    worker->centroids_temp =
+        k_means_arena_alloc(arena, sizeof(KM_SUM[k][dimension]));
+    worker->centroids_point_count =
+        k_means_arena_alloc(arena, k * sizeof(*worker->centroids_point_count));
+  }
+  if (arena->failed)
+    return k_means_failed_run(context, NULL);
+  for (size_t i = 0; i < dimension * state.stride; ++i)
+    state.centroids_soa[i] = KM_HUGE;
+
+  // Seeded by the calling thread before the first pass
+  get_current_time(&state.start);
+  KM_TYPE(*centroids)[dimension] = (KM_TYPE(*)[dimension])state.centroids;
+  bool seeded = true;
+  switch (state.init) {
+  case k_means_init_given:
+    memcpy(centroids, state.initial_centroids, sizeof(KM_TYPE[k][dimension]));
+    break;
+  case k_means_init_plusplus:
+  case k_means_init_parallel:
+    seeded = KM_NAME(k_means_stream_sample)(&state, config, fd, offset);
+    break;
+  case k_means_init_random:
+  default: {
+    size_t *chosen = k_means_arena_alloc(arena, k * sizeof(*chosen));
+    KM_DATA row[dimension];
+    seeded = chosen != NULL;
+    if (seeded)
+      KM_NAME(choose_random)(&state, chosen);
+    for (size_t centro = 0; seeded && centro < k; ++centro) {
+      seeded = KM_NAME(k_means_stream_row)(fd, offset, dimension,
+                                           chosen[centro], row);
+      if (seeded)
+        KM_NAME(copy_point)(dimension, centroids[centro], row);
+    }
+  } break;
+  }
+  if (!seeded)
+    return k_means_failed_run(context, NULL);
+  KM_NAME(transpose_centroids)(dimension, k, state.stride, centroids,
+                               (KM_TYPE(*)[state.stride])state.centroids_soa);
+  get_current_time(&state.seeding_end);
+
+  if (!k_means_reader_start(state.reader, fd, offset,
+                            sizeof(KM_DATA[dimension]), points, chunk_points))
+    return k_means_failed_run(context, NULL);
+  pthread_barrier_init(&state.barrier, NULL, num_threads);
+  k_means_launch_init(&state.launch);
+  unsigned spawned = 1;
+  while (spawned < num_threads &&
+         k_means_spawn_worker(&state.workers[spawned].thread,
+                              KM_NAME(k_means_stream_worker),
+                              &state.workers[spawned]))
+    spawned += 1;
+  k_means_launch_decide(&state.launch, spawned != num_threads);
+  KM_NAME(k_means_stream_worker)(&state.workers[0]);
+  for (unsigned thread = 1; thread < spawned; ++thread)
+    pthread_join(state.workers[thread].thread, NULL);
+  k_means_reader_stop(state.reader);
+  time_measure end;
+  get_current_time(&end);
+  k_means_launch_destroy(&state.launch);
+  pthread_barrier_destroy(&state.barrier);
+  if (spawned != num_threads || state.chunk == NULL)
+    return k_means_failed_run(context, NULL);
+  state.io_wait_time += state.iteration_io_wait_time;
+
+  double inertia = 0.;
+  for (unsigned thread = 0; thread < num_threads; ++thread)
+    inertia += state.workers[thread].inertia;
+  context->centroids = state.centroids;
+  context->centroid_size = sizeof(KM_TYPE);
+  context->inertia = inertia;
+
+  if (stats != NULL) {
+    stats->iterations = state.convergence_iterations;
+    stats->distance_computations = state.distance_computations;
+    stats->distance_computations_avoided = 0;
+    stats->seeding_time = measuring_difftime(state.start, state.seeding_end);
+    stats->iteration_time = measuring_difftime(state.seeding_end, end);
+    stats->stop_reason = state.stop_reason;
+    stats->inertia = inertia;
+    stats->io_wait_time = state.io_wait_time;
+    stats->gemm = false;
+  }
+  return state.convergence_iterations;
+}
+#endif
+
+size_t KM_NAME(k_means_warm_start)(size_t points, size_t dimension, size_t k,
+                                   KM_DATA data[restrict points][dimension],
+                                   void *point_centroid_map,
+                                   const struct k_means_config *config,
+                                   KM_TYPE centroids[k][dimension],
+                                   struct k_means_stats *stats) {
+  struct k_means_config warm_config =
+      config != NULL ? *config : k_means_default_config;
+  warm_config.init = k_means_init_given;
+  warm_config.initial_centroids = centroids;
+  struct k_means_context context = {0};
+  size_t iterations =
+      KM_NAME(k_means_with_context)(&context, points, dimension, k, data,
+                                    point_centroid_map, &warm_config, stats);
+  if (iterations != K_MEANS_ERROR)
+    memcpy(centroids, context.centroids, sizeof(KM_TYPE[k][dimension]));
+  k_means_arena_release(&context.arena);
+  return iterations;
+}
+
+size_t KM_NAME(k_means)(size_t points, size_t dimension, size_t k,
+                        KM_DATA data[restrict points][dimension],
+                        void *point_centroid_map,
+                        const struct k_means_config *config,
+                        struct k_means_stats *stats) {
+  struct k_means_context context = {0};
+  size_t iterations = KM_NAME(k_means_with_context)(
+      &context, points, dimension, k, data, point_centroid_map, config, stats);
+  k_means_arena_release(&context.arena);
+  return iterations;
+}
+
+#ifndef KM_CONVERTED_DATA
+const KM_TYPE *
+KM_NAME(k_means_context_centroids)(const struct k_means_context *context) {
+  return context->centroid_size == sizeof(KM_TYPE) ? context->centroids : NULL;
+}
+#endif
+
+#ifdef KM_DEFAULT_LOAD
+#undef KM_LOAD
+#undef KM_DEFAULT_LOAD
+#endif
+#undef KM_CONVERTED_DATA
+#undef KM_SUM
+#undef KM_WORKER
+#undef KM_DISTANCES_KERNEL
+#undef KM_NEAREST_KERNEL
+#undef KM_NAME
+#undef KM_CONCAT
+#undef KM_CONCAT_
@@ -0,0 +1,753 @@
+/*
+ * Copyright 2017 Maxime Schmitt <max.schmitt@math.unistra.fr>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#include <math.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "k-means_kernels.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define K_MEANS_X86_KERNELS
+#endif
+
+// This file is compiled with -ffp-contract=off: every kernel computes the
+// same sequence of IEEE operations per centroid, so the selected instruction
+// set never changes the clustering.
+
+__attribute__((always_inline)) static inline size_t
+nearest_scalar_f(size_t dimension, size_t k, const float *restrict point,
+                 const float *restrict centroids, size_t stride) {
+  size_t centroid_chosen = 0;
+  float closest_centroid = HUGE_VALF;
+  for (size_t centro = 0; centro < k; ++centro) {
+    float distance_square = 0.f;
+    for (size_t dim = 0; dim < dimension; ++dim) {
+      float diff = centroids[dim * stride + centro] - point[dim];
+      distance_square += diff * diff;
+    }
+    if (distance_square < closest_centroid) {
+      closest_centroid = distance_square;
+      centroid_chosen = centro;
+    }
+  }
+  return centroid_chosen;
+}
+
+__attribute__((always_inline)) static inline size_t
+nearest_scalar_d(size_t dimension, size_t k, const double *restrict point,
+                 const double *restrict centroids, size_t stride) {
+  size_t centroid_chosen = 0;
+  double closest_centroid = HUGE_VAL;
+  for (size_t centro = 0; centro < k; ++centro) {
+    double distance_square = 0.;
+    for (size_t dim = 0; dim < dimension; ++dim) {
+      double diff = centroids[dim * stride + centro] - point[dim];
+      distance_square += diff * diff;
+    }
+    if (distance_square < closest_centroid) {
+      closest_centroid = distance_square;
+      centroid_chosen = centro;
+    }
+  }
+  return centroid_chosen;
+}
+
+static void distances_scalar_f(size_t dimension, size_t k,
+                               const float *restrict point,
+                               const float *restrict centroids, size_t stride,
+                               float *restrict distances) {
+  for (size_t centro = 0; centro < k; ++centro) {
+    float distance_square = 0.f;
+    for (size_t dim = 0; dim < dimension; ++dim) {
+      float diff = centroids[dim * stride + centro] - point[dim];
+      distance_square += diff * diff;
+    }
+    distances[centro] = distance_square;
+  }
+}
+
+static void distances_scalar_d(size_t dimension, size_t k,
+                               const double *restrict point,
+                               const double *restrict centroids, size_t stride,
+                               double *restrict distances) {
+  for (size_t centro = 0; centro < k; ++centro) {
+    double distance_square = 0.;
+    for (size_t dim = 0; dim < dimension; ++dim) {
+      double diff = centroids[dim * stride + centro] - point[dim];
+      distance_square += diff * diff;
+    }
+    distances[centro] = distance_square;
+  }
+}
+
+// The GEMM kernels multiply a tile of points with a panel of transposed
+// centroids, each dot product being summed over the coordinates in order
+// whatever the instruction set. The distances of the panel are then compared
+// with the closest one of every point, only scanned one by one when one of
+// them is closer. The loops over the tile are unrolled to keep the
+// accumulators in registers.
+
+__attribute__((always_inline)) static inline void
+gemm_update(size_t count, const float *restrict distances, size_t panel,
+            float *restrict best, size_t *restrict nearest) {
+  for (size_t c = 0; c < count; ++c) {
+    if (distances[c] < *best) {
+      *best = distances[c];
+      *nearest = panel + c;
+    }
+  }
+}
+
+__attribute__((always_inline)) static inline void
+gemm_tile_scalar_f(size_t dimension, const float *const *rows,
+                   const float *restrict point_norms,
+                   const float *restrict centroids, size_t stride,
+                   const float *restrict centroid_norms, size_t panel,
+                   float *restrict best, size_t *restrict nearest) {
+  float dot[4][16] = {{0.f}};
+  for (size_t dim = 0; dim < dimension; ++dim)
+    #pragma GCC unroll 8
+    for (size_t p = 0; p < 4; ++p)
+      #pragma GCC unroll 16
+      for (size_t c = 0; c < 16; ++c)
+        dot[p][c] += rows[p][dim] * centroids[dim * stride + c];
+  #pragma GCC unroll 8
+  for (size_t p = 0; p < 4; ++p) {
+    float distances[16];
+    #pragma GCC unroll 16
+    for (size_t c = 0; c < 16; ++c)
+      distances[c] =
+          (point_norms[p] + centroid_norms[c]) - (dot[p][c] + dot[p][c]);
+    gemm_update(16, distances, panel, &best[p], &nearest[p]);
+  }
+}
+
+#ifdef K_MEANS_X86_KERNELS
+
+// The centroid indices are kept as floating point values in the same vector
+// as the distances (exact up to 2^24 for float), so the lanes can be blended
+// and reduced with the same instructions. Each lane keeps the first closest
+// centroid it has seen, the reduction then picks the lowest index among the
+// lanes holding the minimal distance.
+
+__attribute__((target("sse4.1"), always_inline)) static inline size_t
+nearest_sse41_f(size_t dimension, size_t k, const float *restrict point,
+                const float *restrict centroids, size_t stride) {
+  __m128 best = _mm_set1_ps(HUGE_VALF);
+  __m128 best_index = _mm_setzero_ps();
+  __m128 index = _mm_setr_ps(0.f, 1.f, 2.f, 3.f);
+  const __m128 step = _mm_set1_ps(4.f);
+  for (size_t block = 0; block < k; block += 4) {
+    __m128 distance = _mm_setzero_ps();
+    for (size_t dim = 0; dim < dimension; ++dim) {
+      __m128 diff = _mm_sub_ps(_mm_load_ps(&centroids[dim * stride + block]),
+                               _mm_set1_ps(point[dim]));
+      distance = _mm_add_ps(distance, _mm_mul_ps(diff, diff));
+    }
+    __m128 closer = _mm_cmplt_ps(distance, best);
+    best = _mm_blendv_ps(best, distance, closer);
+    best_index = _mm_blendv_ps(best_index, index, closer);
+    index = _mm_add_ps(index, step);
+  }
+  __m128 minimum = _mm_min_ps(best, _mm_shuffle_ps(best, best, 0x4e));
+  minimum = _mm_min_ps(minimum, _mm_shuffle_ps(minimum, minimum, 0xb1));
+  best_index = _mm_blendv_ps(_mm_set1_ps(HUGE_VALF), best_index,
+                             _mm_cmpeq_ps(best, minimum));
+  best_index =
+      _mm_min_ps(best_index, _mm_shuffle_ps(best_index, best_index, 0x4e));
+  best_index =
+      _mm_min_ps(best_index, _mm_shuffle_ps(best_index, best_index, 0xb1));
+  float centroid_chosen = _mm_cvtss_f32(best_index);
+  return (size_t)centroid_chosen;
+}
+
+__attribute__((target("sse4.1"), always_inline)) static inline size_t
+nearest_sse41_d(size_t dimension, size_t k, const double *restrict point,
+                const double *restrict centroids, size_t stride) {
+  __m128d best = _mm_set1_pd(HUGE_VAL);
+  __m128d best_index = _mm_setzero_pd();
+  __m128d index = _mm_setr_pd(0., 1.);
+  const __m128d step = _mm_set1_pd(2.);
+  for (size_t block = 0; block < k; block += 2) {
+    __m128d distance = _mm_setzero_pd();
+    for (size_t dim = 0; dim < dimension; ++dim) {
+      __m128d diff = _mm_sub_pd(_mm_load_pd(&centroids[dim * stride + block]),
+                                _mm_set1_pd(point[dim]));
+      distance = _mm_add_pd(distance, _mm_mul_pd(diff, diff));
+    }
+    __m128d closer = _mm_cmplt_pd(distance, best);
+    best = _mm_blendv_pd(best, distance, closer);
+    best_index = _mm_blendv_pd(best_index, index, closer);
+    index = _mm_add_pd(index, step);
+  }
+  __m128d minimum = _mm_min_pd(best, _mm_shuffle_pd(best, best, 1));
+  best_index = _mm_blendv_pd(_mm_set1_pd(HUGE_VAL), best_index,
+                             _mm_cmpeq_pd(best, minimum));
+  best_index =
+      _mm_min_pd(best_index, _mm_shuffle_pd(best_index, best_index, 1));
+  double centroid_chosen = _mm_cvtsd_f64(best_index);
+  return (size_t)centroid_chosen;
+}
+
+__attribute__((target("avx2"))) static inline __m256
+hmin_avx2_ps(__m256 value) {
+  value = _mm256_min_ps(value, _mm256_permute2f128_ps(value, value, 1));
+  value = _mm256_min_ps(value, _mm256_shuffle_ps(value, value, 0x4e));
+  return _mm256_min_ps(value, _mm256_shuffle_ps(value, value, 0xb1));
+}
+
+__attribute__((target("avx2"), always_inline)) static inline size_t
+nearest_avx2_f(size_t dimension, size_t k, const float *restrict point,
+               const float *restrict centroids, size_t stride) {
+  __m256 best = _mm256_set1_ps(HUGE_VALF);
+  __m256 best_index = _mm256_setzero_ps();
+  __m256 index = _mm256_setr_ps(0.f, 1.f, 2.f, 3.f, 4.f, 5.f, 6.f, 7.f);
+  const __m256 step = _mm256_set1_ps(8.f);
+  for (size_t block = 0; block < k; block += 8) {
+    __m256 distance = _mm256_setzero_ps();
+    for (size_t dim = 0; dim < dimension; ++dim) {
+      __m256 diff =
+          _mm256_sub_ps(_mm256_load_ps(&centroids[dim * stride + block]),
+                        _mm256_set1_ps(point[dim]));
+      distance = _mm256_add_ps(distance, _mm256_mul_ps(diff, diff));
+    }
+    __m256 closer = _mm256_cmp_ps(distance, best, _CMP_LT_OQ);
+    best = _mm256_blendv_ps(best, distance, closer);
+    best_index = _mm256_blendv_ps(best_index, index, closer);
+    index = _mm256_add_ps(index, step);
+  }
+  __m256 minimum = hmin_avx2_ps(best);
+  best_index = _mm256_blendv_ps(_mm256_set1_ps(HUGE_VALF), best_index,
+                                _mm256_cmp_ps(best, minimum, _CMP_EQ_OQ));
+  float centroid_chosen = _mm256_cvtss_f32(hmin_avx2_ps(best_index));
+  return (size_t)centroid_chosen;
+}
+
+__attribute__((target("avx2"))) static inline __m256d
+hmin_avx2_pd(__m256d value) {
+  value = _mm256_min_pd(value, _mm256_permute2f128_pd(value, value, 1));
+  return _mm256_min_pd(value, _mm256_shuffle_pd(value, value, 0x5));
+}
+
+__attribute__((target("avx2"), always_inline)) static inline size_t
+nearest_avx2_d(size_t dimension, size_t k, const double *restrict point,
+               const double *restrict centroids, size_t stride) {
+  __m256d best = _mm256_set1_pd(HUGE_VAL);
+  __m256d best_index = _mm256_setzero_pd();
+  __m256d index = _mm256_setr_pd(0., 1., 2., 3.);
+  const __m256d step = _mm256_set1_pd(4.);
+  for (size_t block = 0; block < k; block += 4) {
+    __m256d distance = _mm256_setzero_pd();
+    for (size_t dim = 0; dim < dimension; ++dim) {
+      __m256d diff =
+          _mm256_sub_pd(_mm256_load_pd(&centroids[dim * stride + block]),
+                        _mm256_set1_pd(point[dim]));
+      distance = _mm256_add_pd(distance, _mm256_mul_pd(diff, diff));
+    }
+    __m256d closer = _mm256_cmp_pd(distance, best, _CMP_LT_OQ);
+    best = _mm256_blendv_pd(best, distance, closer);
+    best_index = _mm256_blendv_pd(best_index, index, closer);
+    index = _mm256_add_pd(index, step);
+  }
+  __m256d minimum = hmin_avx2_pd(best);
+  best_index = _mm256_blendv_pd(_mm256_set1_pd(HUGE_VAL), best_index,
+                                _mm256_cmp_pd(best, minimum, _CMP_EQ_OQ));
+  double centroid_chosen = _mm256_cvtsd_f64(hmin_avx2_pd(best_index));
+  return (size_t)centroid_chosen;
+}
+
+__attribute__((target("avx512f"), always_inline)) static inline size_t
+nearest_avx512_f(size_t dimension, size_t k, const float *restrict point,
+                 const float *restrict centroids, size_t stride) {
+  __m512 best = _mm512_set1_ps(HUGE_VALF);
+  __m512 best_index = _mm512_setzero_ps();
+  __m512 index = _mm512_setr_ps(0.f, 1.f, 2.f, 3.f, 4.f, 5.f, 6.f, 7.f, 8.f,
+                                9.f, 10.f, 11.f, 12.f, 13.f, 14.f, 15.f);
+  const __m512 step = _mm512_set1_ps(16.f);
+  for (size_t block = 0; block < k; block += 16) {
+    __m512 distance = _mm512_setzero_ps();
+    for (size_t dim = 0; dim < dimension; ++dim) {
+      __m512 diff =
+          _mm512_sub_ps(_mm512_load_ps(&centroids[dim * stride + block]),
+                        _mm512_set1_ps(point[dim]));
+      distance = _mm512_add_ps(distance, _mm512_mul_ps(diff, diff));
+    }
+    __mmask16 closer = _mm512_cmp_ps_mask(distance, best, _CMP_LT_OQ);
+    best = _mm512_mask_mov_ps(best, closer, distance);
+    best_index = _mm512_mask_mov_ps(best_index, closer, index);
+    index = _mm512_add_ps(index, step);
+  }
+  __mmask16 minimal = _mm512_cmp_ps_mask(
+      best, _mm512_set1_ps(_mm512_reduce_min_ps(best)), _CMP_EQ_OQ);
+  float centroid_chosen = _mm512_mask_reduce_min_ps(minimal, best_index);
+  return (size_t)centroid_chosen;
+}
+
+__attribute__((target("avx512f"), always_inline)) static inline size_t
+nearest_avx512_d(size_t dimension, size_t k, const double *restrict point,
+                 const double *restrict centroids, size_t stride) {
+  __m512d best = _mm512_set1_pd(HUGE_VAL);
+  __m512d best_index = _mm512_setzero_pd();
+  __m512d index = _mm512_setr_pd(0., 1., 2., 3., 4., 5., 6., 7.);
+  const __m512d step = _mm512_set1_pd(8.);
+  for (size_t block = 0; block < k; block += 8) {
+    __m512d distance = _mm512_setzero_pd();
+    for (size_t dim = 0; dim < dimension; ++dim) {
+      __m512d diff =
+          _mm512_sub_pd(_mm512_load_pd(&centroids[dim * stride + block]),
+                        _mm512_set1_pd(point[dim]));
+      distance = _mm512_add_pd(distance, _mm512_mul_pd(diff, diff));
+    }
+    __mmask8 closer = _mm512_cmp_pd_mask(distance, best, _CMP_LT_OQ);
+    best = _mm512_mask_mov_pd(best, closer, distance);
+    best_index = _mm512_mask_mov_pd(best_index, closer, index);
+    index = _mm512_add_pd(index, step);
+  }
+  __mmask8 minimal = _mm512_cmp_pd_mask(
+      best, _mm512_set1_pd(_mm512_reduce_min_pd(best)), _CMP_EQ_OQ);
+  double centroid_chosen = _mm512_mask_reduce_min_pd(minimal, best_index);
+  return (size_t)centroid_chosen;
+}
+
+__attribute__((target("sse4.1"))) static void
+distances_sse41_f(size_t dimension, size_t k, const float *restrict point,
+                  const float *restrict centroids, size_t stride,
+                  float *restrict distances) {
+  for (size_t block = 0; block < k; block += 4) {
+    __m128 distance = _mm_setzero_ps();
+    for (size_t dim = 0; dim < dimension; ++dim) {
+      __m128 diff = _mm_sub_ps(_mm_load_ps(&centroids[dim * stride + block]),
+                               _mm_set1_ps(point[dim]));
+      distance = _mm_add_ps(distance, _mm_mul_ps(diff, diff));
+    }
+    _mm_store_ps(&distances[block], distance);
+  }
+}
+
+__attribute__((target("sse4.1"))) static void
+distances_sse41_d(size_t dimension, size_t k, const double *restrict point,
+                  const double *restrict centroids, size_t stride,
+                  double *restrict distances) {
+  for (size_t block = 0; block < k; block += 2) {
+    __m128d distance = _mm_setzero_pd();
+    for (size_t dim = 0; dim < dimension; ++dim) {
+      __m128d diff = _mm_sub_pd(_mm_load_pd(&centroids[dim * stride + block]),
+                                _mm_set1_pd(point[dim]));
+      distance = _mm_add_pd(distance, _mm_mul_pd(diff, diff));
+    }
+    _mm_store_pd(&distances[block], distance);
+  }
+}
+
+__attribute__((target("avx2"))) static void
+distances_avx2_f(size_t dimension, size_t k, const float *restrict point,
+                 const float *restrict centroids, size_t stride,
+                 float *restrict distances) {
+  for (size_t block = 0; block < k; block += 8) {
+    __m256 distance = _mm256_setzero_ps();
+    for (size_t dim = 0; dim < dimension; ++dim) {
+      __m256 diff =
+          _mm256_sub_ps(_mm256_load_ps(&centroids[dim * stride + block]),
+                        _mm256_set1_ps(point[dim]));
+      distance = _mm256_add_ps(distance, _mm256_mul_ps(diff, diff));
+    }
+    _mm256_store_ps(&distances[block], distance);
+  }
+}
+
+__attribute__((target("avx2"))) static void
+distances_avx2_d(size_t dimension, size_t k, const double *restrict point,
+                 const double *restrict centroids, size_t stride,
+                 double *restrict distances) {
+  for (size_t block = 0; block < k; block += 4) {
+    __m256d distance = _mm256_setzero_pd();
+    for (size_t dim = 0; dim < dimension; ++dim) {
+      __m256d diff =
+          _mm256_sub_pd(_mm256_load_pd(&centroids[dim * stride + block]),
+                        _mm256_set1_pd(point[dim]));
+      distance = _mm256_add_pd(distance, _mm256_mul_pd(diff, diff));
+    }
+    _mm256_store_pd(&distances[block], distance);
+  }
+}
+
+__attribute__((target("avx512f"))) static void
+distances_avx512_f(size_t dimension, size_t k, const float *restrict point,
+                   const float *restrict centroids, size_t stride,
+                   float *restrict distances) {
+  for (size_t block = 0; block < k; block += 16) {
+    __m512 distance = _mm512_setzero_ps();
+    for (size_t dim = 0; dim < dimension; ++dim) {
+      __m512 diff =
+          _mm512_sub_ps(_mm512_load_ps(&centroids[dim * stride + block]),
+                        _mm512_set1_ps(point[dim]));
+      distance = _mm512_add_ps(distance, _mm512_mul_ps(diff, diff));
+    }
+    _mm512_store_ps(&distances[block], distance);
+  }
+}
+
+__attribute__((target("avx512f"))) static void
+distances_avx512_d(size_t dimension, size_t k, const double *restrict point,
+                   const double *restrict centroids, size_t stride,
+                   double *restrict distances) {
+  for (size_t block = 0; block < k; block += 8) {
+    __m512d distance = _mm512_setzero_pd();
+    for (size_t dim = 0; dim < dimension; ++dim) {
+      __m512d diff =
+          _mm512_sub_pd(_mm512_load_pd(&centroids[dim * stride + block]),
+                        _mm512_set1_pd(point[dim]));
+      distance = _mm512_add_pd(distance, _mm512_mul_pd(diff, diff));
+    }
+    _mm512_store_pd(&distances[block], distance);
+  }
+}
+
+__attribute__((target("sse4.1"), always_inline)) static inline void
+gemm_tile_sse41_f(size_t dimension, const float *const *rows,
+                  const float *restrict point_norms,
+                  const float *restrict centroids, size_t stride,
+                  const float *restrict centroid_norms, size_t panel,
+                  float *restrict best, size_t *restrict nearest) {
+  __m128 dot[4][2];
+  #pragma GCC unroll 8
+  for (size_t p = 0; p < 4; ++p)
+    dot[p][0] = dot[p][1] = _mm_setzero_ps();
+  for (size_t dim = 0; dim < dimension; ++dim) {
+    __m128 low = _mm_load_ps(&centroids[dim * stride]);
+    __m128 high = _mm_load_ps(&centroids[dim * stride + 4]);
+    #pragma GCC unroll 8
+    for (size_t p = 0; p < 4; ++p) {
+      __m128 coordinate = _mm_set1_ps(rows[p][dim]);
+      dot[p][0] = _mm_add_ps(dot[p][0], _mm_mul_ps(coordinate, low));
+      dot[p][1] = _mm_add_ps(dot[p][1], _mm_mul_ps(coordinate, high));
+    }
+  }
+  __m128 norms_low = _mm_loadu_ps(centroid_norms);
+  __m128 norms_high = _mm_loadu_ps(&centroid_norms[4]);
+  #pragma GCC unroll 8
+  for (size_t p = 0; p < 4; ++p) {
+    __m128 point_norm = _mm_set1_ps(point_norms[p]);
+    __m128 low = _mm_sub_ps(_mm_add_ps(point_norm, norms_low),
+                            _mm_add_ps(dot[p][0], dot[p][0]));
+    __m128 high = _mm_sub_ps(_mm_add_ps(point_norm, norms_high),
+                             _mm_add_ps(dot[p][1], dot[p][1]));
+    __m128 closest = _mm_set1_ps(best[p]);
+    if (_mm_movemask_ps(_mm_or_ps(_mm_cmplt_ps(low, closest),
+                                  _mm_cmplt_ps(high, closest))) != 0) {
+      float distances[8];
+      _mm_storeu_ps(distances, low);
+      _mm_storeu_ps(&distances[4], high);
+      gemm_update(8, distances, panel, &best[p], &nearest[p]);
+    }
+  }
+}
+
+__attribute__((target("avx2"), always_inline)) static inline void
+gemm_tile_avx2_f(size_t dimension, const float *const *rows,
+                 const float *restrict point_norms,
+                 const float *restrict centroids, size_t stride,
+                 const float *restrict centroid_norms, size_t panel,
+                 float *restrict best, size_t *restrict nearest) {
+  __m256 dot[4][2];
+  #pragma GCC unroll 8
+  for (size_t p = 0; p < 4; ++p)
+    dot[p][0] = dot[p][1] = _mm256_setzero_ps();
+  for (size_t dim = 0; dim < dimension; ++dim) {
+    __m256 low = _mm256_load_ps(&centroids[dim * stride]);
+    __m256 high = _mm256_load_ps(&centroids[dim * stride + 8]);
+    #pragma GCC unroll 8
+    for (size_t p = 0; p < 4; ++p) {
+      __m256 coordinate = _mm256_set1_ps(rows[p][dim]);
+      dot[p][0] = _mm256_add_ps(dot[p][0], _mm256_mul_ps(coordinate, low));
+      dot[p][1] = _mm256_add_ps(dot[p][1], _mm256_mul_ps(coordinate, high));
+    }
+  }
+  __m256 norms_low = _mm256_loadu_ps(centroid_norms);
+  __m256 norms_high = _mm256_loadu_ps(&centroid_norms[8]);
+  #pragma GCC unroll 8
+  for (size_t p = 0; p < 4; ++p) {
+    __m256 point_norm = _mm256_set1_ps(point_norms[p]);
+    __m256 low = _mm256_sub_ps(_mm256_add_ps(point_norm, norms_low),
+                               _mm256_add_ps(dot[p][0], dot[p][0]));
+    __m256 high = _mm256_sub_ps(_mm256_add_ps(point_norm, norms_high),
+                                _mm256_add_ps(dot[p][1], dot[p][1]));
+    __m256 closest = _mm256_set1_ps(best[p]);
+    if (_mm256_movemask_ps(
+            _mm256_or_ps(_mm256_cmp_ps(low, closest, _CMP_LT_OQ),
+                         _mm256_cmp_ps(high, closest, _CMP_LT_OQ))) != 0) {
+      float distances[16];
+      _mm256_storeu_ps(distances, low);
+      _mm256_storeu_ps(&distances[8], high);
+      gemm_update(16, distances, panel, &best[p], &nearest[p]);
+    }
+  }
+}
+
+__attribute__((target("avx512f"), always_inline)) static inline void
+gemm_tile_avx512_f(size_t dimension, const float *const *rows,
+                   const float *restrict point_norms,
+                   const float *restrict centroids, size_t stride,
+                   const float *restrict centroid_norms, size_t panel,
+                   float *restrict best, size_t *restrict nearest) {
+  __m512 dot[8];
+  #pragma GCC unroll 8
+  for (size_t p = 0; p < 8; ++p)
+    dot[p] = _mm512_setzero_ps();
+  for (size_t dim = 0; dim < dimension; ++dim) {
+    __m512 centroid = _mm512_load_ps(&centroids[dim * stride]);
+    #pragma GCC unroll 8
+    for (size_t p = 0; p < 8; ++p)
+      dot[p] = _mm512_add_ps(
+          dot[p], _mm512_mul_ps(_mm512_set1_ps(rows[p][dim]), centroid));
+  }
+  __m512 norms = _mm512_loadu_ps(centroid_norms);
+  #pragma GCC unroll 8
+  for (size_t p = 0; p < 8; ++p) {
+    __m512 distance =
+        _mm512_sub_ps(_mm512_add_ps(_mm512_set1_ps(point_norms[p]), norms),
+                      _mm512_add_ps(dot[p], dot[p]));
+    if (_mm512_cmp_ps_mask(distance, _mm512_set1_ps(best[p]), _CMP_LT_OQ) !=
+        0) {
+      float distances[16];
+      _mm512_storeu_ps(distances, distance);
+      gemm_update(16, distances, panel, &best[p], &nearest[p]);
+    }
+  }
+}
+
+#endif // K_MEANS_X86_KERNELS
+
+// The centroids are walked by panels of tile_centroids, a divisor of the
+// stride, and the points by tiles of tile_points. A partial tile repeats its
+// last point. The norms of the padding centroids must be HUGE_VALF.
+#define NEAREST_GEMM(kernel, tile, target, tile_points, tile_centroids)        \
+  target static void kernel(size_t dimension, size_t k, size_t count,          \
+                            const float *points, const float *point_norms,     \
+                            const float *centroids, size_t stride,             \
+                            const float *centroid_norms, size_t *nearest) {    \
+    const size_t tiles = (count + tile_points - 1) / tile_points;              \
+    float norms[tiles * tile_points], best[tiles * tile_points];               \
+    size_t closest[tiles * tile_points];                                       \
+    for (size_t i = 0; i < tiles * tile_points; ++i) {                         \
+      norms[i] = point_norms[i < count ? i : count - 1];                       \
+      best[i] = HUGE_VALF;                                                     \
+      closest[i] = 0;                                                          \
+    }                                                                          \
+    for (size_t panel = 0; panel < k; panel += tile_centroids) {               \
+      for (size_t first = 0; first < count; first += tile_points) {            \
+        const float *rows[tile_points];                                        \
+        for (size_t p = 0; p < tile_points; ++p)                               \
+          rows[p] = &points[(first + p < count ? first + p : count - 1) *      \
+                            dimension];                                        \
+        tile(dimension, rows, &norms[first], &centroids[panel], stride,        \
+             &centroid_norms[panel], panel, &best[first], &closest[first]);    \
+      }                                                                        \
+    }                                                                          \
+    memcpy(nearest, closest, count * sizeof(*nearest));                        \
+  }
+
+NEAREST_GEMM(nearest_gemm_scalar_f, gemm_tile_scalar_f, , 4, 16)
+#ifdef K_MEANS_X86_KERNELS
+NEAREST_GEMM(nearest_gemm_sse41_f, gemm_tile_sse41_f,
+             __attribute__((target("sse4.1"))), 4, 8)
+NEAREST_GEMM(nearest_gemm_avx2_f, gemm_tile_avx2_f,
+             __attribute__((target("avx2"))), 4, 16)
+NEAREST_GEMM(nearest_gemm_avx512_f, gemm_tile_avx512_f,
+             __attribute__((target("avx512f"))), 8, 16)
+#endif
+
+static void half_to_float_scalar(size_t count, const k_means_half *halves,
+                                 float *values) {
+  for (size_t i = 0; i < count; ++i)
+    values[i] = k_means_half_to_float(halves[i]);
+}
+
+static void float_to_half_scalar(size_t count, const float *values,
+                                 k_means_half *halves) {
+  for (size_t i = 0; i < count; ++i) {
+    union {
+      float value;
+      uint32_t bits;
+    } single = {.value = values[i]};
+    uint16_t sign = (uint16_t)((single.bits >> 16) & 0x8000);
+    uint32_t magnitude = single.bits & 0x7fffffff;
+    uint16_t half;
+    if (magnitude > 0x7f800000) { // NaN, kept quiet
+      half = 0x7e00 | (uint16_t)((magnitude >> 13) & 0x3ff);
+    } else if (magnitude >= 0x477ff000) { // Rounded to infinity
+      half = 0x7c00;
+    } else if (magnitude < 0x38800000) { // Subnormal or zero
+      // The float addition rounds the value to a multiple of 2^-24, the
+      // smallest half subnormal
+      union {
+        float value;
+        uint32_t bits;
+      } sum = {.bits = magnitude}, offset = {.bits = 126u << 23};
+      sum.value += offset.value;
+      half = (uint16_t)(sum.bits - offset.bits);
+    } else {
+      uint32_t odd = (magnitude >> 13) & 1;
+      magnitude += ((uint32_t)(15 - 127) << 23) + 0xfff + odd;
+      half = (uint16_t)(magnitude >> 13);
+    }
+    halves[i].bits = sign | half;
+  }
+}
+
+#ifdef K_MEANS_X86_KERNELS
+__attribute__((target("avx,f16c"))) static void
+half_to_float_f16c(size_t count, const k_means_half *halves, float *values) {
+  size_t i = 0;
+  for (; i + 8 <= count; i += 8)
+    _mm256_storeu_ps(values + i, _mm256_cvtph_ps(_mm_loadu_si128(
+                                     (const __m128i *)(halves + i))));
+  for (; i < count; ++i)
+    values[i] = _cvtsh_ss(halves[i].bits);
+}
+
+__attribute__((target("avx,f16c"))) static void
+float_to_half_f16c(size_t count, const float *values, k_means_half *halves) {
+  size_t i = 0;
+  for (; i + 8 <= count; i += 8)
+    _mm_storeu_si128((__m128i *)(halves + i),
+                     _mm256_cvtps_ph(_mm256_loadu_ps(values + i),
+                                     _MM_FROUND_TO_NEAREST_INT));
+  for (; i < count; ++i)
+    halves[i].bits = _cvtss_sh(values[i], _MM_FROUND_TO_NEAREST_INT);
+}
+#endif
+
+// Instantiate a kernel for every specialized dimension so that the loop over
+// the coordinates is unrolled
+#define NEAREST_DIMENSION(kernel, target, type, dim)                           \
+  target static size_t kernel##_##dim(size_t dimension, size_t k,             \
+                                      const type *point,                       \
+                                      const type *centroids, size_t stride) {  \
+    (void)dimension;                                                           \
+    return kernel(dim, k, point, centroids, stride);                           \
+  }
+
+#define NEAREST_SPECIALIZATIONS(kernel, target, type)                          \
+  target static size_t kernel##_generic(size_t dimension, size_t k,            \
+                                        const type *point,                     \
+                                        const type *centroids,                 \
+                                        size_t stride) {                       \
+    return kernel(dimension, k, point, centroids, stride);                     \
+  }                                                                            \
+  NEAREST_DIMENSION(kernel, target, type, 1)                                   \
+  NEAREST_DIMENSION(kernel, target, type, 2)                                   \
+  NEAREST_DIMENSION(kernel, target, type, 3)                                   \
+  NEAREST_DIMENSION(kernel, target, type, 4)                                   \
+  NEAREST_DIMENSION(kernel, target, type, 5)                                   \
+  NEAREST_DIMENSION(kernel, target, type, 6)                                   \
+  NEAREST_DIMENSION(kernel, target, type, 7)                                   \
+  NEAREST_DIMENSION(kernel, target, type, 8)
+
+#define NEAREST_TABLE(kernel)                                                  \
+  {                                                                            \
+    kernel##_generic, kernel##_1, kernel##_2, kernel##_3, kernel##_4,          \
+        kernel##_5, kernel##_6, kernel##_7, kernel##_8                         \
+  }
+
+NEAREST_SPECIALIZATIONS(nearest_scalar_f, , float)
+NEAREST_SPECIALIZATIONS(nearest_scalar_d, , double)
+#ifdef K_MEANS_X86_KERNELS
+NEAREST_SPECIALIZATIONS(nearest_sse41_f, __attribute__((target("sse4.1"))),
+                        float)
+NEAREST_SPECIALIZATIONS(nearest_sse41_d, __attribute__((target("sse4.1"))),
+                        double)
+NEAREST_SPECIALIZATIONS(nearest_avx2_f, __attribute__((target("avx2"))), float)
+NEAREST_SPECIALIZATIONS(nearest_avx2_d, __attribute__((target("avx2"))),
+                        double)
+NEAREST_SPECIALIZATIONS(nearest_avx512_f, __attribute__((target("avx512f"))),
+                        float)
+NEAREST_SPECIALIZATIONS(nearest_avx512_d, __attribute__((target("avx512f"))),
+                        double)
+#endif
+
+static const struct k_means_kernels available_kernels[] = {
+#ifdef K_MEANS_X86_KERNELS
+    {"avx512f", NEAREST_TABLE(nearest_avx512_f),
+     NEAREST_TABLE(nearest_avx512_d), distances_avx512_f, distances_avx512_d,
+     nearest_gemm_avx512_f, half_to_float_f16c, float_to_half_f16c},
+    {"avx2", NEAREST_TABLE(nearest_avx2_f), NEAREST_TABLE(nearest_avx2_d),
+     distances_avx2_f, distances_avx2_d, nearest_gemm_avx2_f,
+     half_to_float_f16c, float_to_half_f16c},
+    {"sse4.1", NEAREST_TABLE(nearest_sse41_f), NEAREST_TABLE(nearest_sse41_d),
+     distances_sse41_f, distances_sse41_d, nearest_gemm_sse41_f,
+     half_to_float_scalar, float_to_half_scalar},
+#endif
+    {"scalar", NEAREST_TABLE(nearest_scalar_f),
+     NEAREST_TABLE(nearest_scalar_d), distances_scalar_f, distances_scalar_d,
+     nearest_gemm_scalar_f, half_to_float_scalar, float_to_half_scalar},
+};
+
+static const size_t num_available_kernels =
+    sizeof(available_kernels) / sizeof(available_kernels[0]);
+
+static bool kernel_supported(const struct k_means_kernels *kernels) {
+#ifdef K_MEANS_X86_KERNELS
+  __builtin_cpu_init();
+  // The processors of both have F16C, checked for the 16 bits floats
+  if (strcmp(kernels->name, "avx512f") == 0)
+    return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("f16c");
+  if (strcmp(kernels->name, "avx2") == 0)
+    return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("f16c");
+  if (strcmp(kernels->name, "sse4.1") == 0)
+    return __builtin_cpu_supports("sse4.1");
+#endif
+  return strcmp(kernels->name, "scalar") == 0;
+}
+
+static const struct k_means_kernels *selected_kernels = NULL;
+static pthread_once_t kernels_selection = PTHREAD_ONCE_INIT;
+
+static void select_kernels(void) {
+  const char *forced = getenv("KMEANS_KERNEL");
+  for (size_t i = 0; i < num_available_kernels; ++i) {
+    const struct k_means_kernels *kernels = &available_kernels[i];
+    if (forced != NULL && strcmp(forced, kernels->name) != 0)
+      continue;
+    if (kernel_supported(kernels)) {
+      selected_kernels = kernels;
+      return;
+    }
+  }
+  if (forced != NULL)
+    fprintf(stderr,
+            "The kernel \"%s\" is unknown or unsupported by this processor, "
+            "using the scalar one\n",
+            forced);
+  selected_kernels = &available_kernels[num_available_kernels - 1];
+}
+
+const struct k_means_kernels *k_means_kernels(void) {
+  pthread_once(&kernels_selection, select_kernels);
+  return selected_kernels;
+}
@@ -0,0 +1,299 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "k-means_npy.h"
+
+// https://numpy.org/doc/stable/reference/generated/numpy.lib.format.html
+static const char npy_magic[] = "\x93NUMPY";
+#define NPY_MAGIC_SIZE 6
+#define NPY_HEADER_ALIGNMENT 64
+
+static const struct {
+  const char *descr;
+  size_t size;
+} npy_types[] = {
+    [npy_float32] = {"f4", sizeof(float)},
+    [npy_float64] = {"f8", sizeof(double)},
+    [npy_uint8] = {"u1", sizeof(uint8_t)},
+    [npy_uint16] = {"u2", sizeof(uint16_t)},
+    [npy_uint32] = {"u4", sizeof(uint32_t)},
+};
+
+static bool host_is_little_endian(void) {
+  const uint16_t endianness = 1;
+  return *(const uint8_t *)&endianness == 1;
+}
+
+// Value of a key of the header dictionary, NULL when missing
+static const char *npy_header_value(const char *header, size_t length,
+                                    const char *key) {
+  size_t key_length = strlen(key);
+  for (size_t pos = 0; pos + key_length <= length; ++pos) {
+    if (memcmp(&header[pos], key, key_length) != 0)
+      continue;
+    pos += key_length;
+    while (pos < length && (header[pos] == ' ' || header[pos] == ':'))
+      ++pos;
+    return pos < length ? &header[pos] : NULL;
+  }
+  return NULL;
+}
+
+// Parses the header dictionary, which is neither terminated nor trusted: every
+// read stops at header + length
+static bool parse_npy_header(const char *header, size_t length,
+                             struct npy_matrix *matrix) {
+  const char *end = header + length;
+  const char *descr = npy_header_value(header, length, "'descr'");
+  const char *fortran_order =
+      npy_header_value(header, length, "'fortran_order'");
+  const char *shape = npy_header_value(header, length, "'shape'");
+  if (descr == NULL || fortran_order == NULL || shape == NULL ||
+      end - descr < 5 || end - fortran_order < 5)
+    return false;
+
+  // '<f4', the byte order is irrelevant for single bytes
+  if (descr[0] != '\'' ||
+      (descr[1] != '<' && descr[1] != '|' &&
+       !(descr[1] == '=' && host_is_little_endian()))) {
+    fprintf(stderr, "Only the little endian matrices are supported\n");
+    return false;
+  }
+  const size_t num_types = sizeof(npy_types) / sizeof(npy_types[0]);
+  size_t type = 0;
+  while (type < num_types &&
+         (memcmp(&descr[2], npy_types[type].descr, 2) != 0 ||
+          descr[4] != '\''))
+    ++type;
+  if (type == num_types) {
+    fprintf(stderr, "Unsupported element type %.5s\n", descr);
+    return false;
+  }
+  matrix->type = (enum npy_type)type;
+  if (memcmp(fortran_order, "False", 5) != 0) {
+    fprintf(stderr, "Only the matrices in C order are supported\n");
+    return false;
+  }
+
+  // (rows,) or (rows, columns)
+  size_t dims[2] = {0, 1}, num_dims = 0;
+  if (shape[0] != '(')
+    return false;
+  const char *pos = shape + 1;
+  while (pos < end && *pos != ')') {
+    if (*pos < '0' || *pos > '9' || num_dims == 2)
+      return false;
+    size_t value = 0;
+    for (; pos < end && *pos >= '0' && *pos <= '9'; ++pos) {
+      size_t digit = (size_t)(*pos - '0');
+      if (value > (SIZE_MAX - digit) / 10)
+        return false;
+      value = value * 10 + digit;
+    }
+    dims[num_dims++] = value;
+    while (pos < end && (*pos == ',' || *pos == ' '))
+      ++pos;
+  }
+  if (pos == end || num_dims == 0)
+    return false;
+  matrix->rows = dims[0];
+  matrix->columns = dims[1];
+  return true;
+}
+
+bool map_npy(const char *filename, struct npy_matrix *matrix) {
+  if (!host_is_little_endian()) {
+    fprintf(stderr, "The npy files are only mapped on little endian hosts\n");
+    return false;
+  }
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0) {
+    int saved_errno = errno;
+    fprintf(stderr, "Failed to open npy file %s: ", filename);
+    errno = saved_errno;
+    perror(NULL);
+    return false;
+  }
+  struct stat file_stat;
+  if (fstat(fd, &file_stat) != 0) {
+    perror(filename);
+    close(fd);
+    return false;
+  }
+  matrix->mapping_size = (size_t)file_stat.st_size;
+  matrix->mapping = matrix->mapping_size == 0
+                        ? MAP_FAILED
+                        : mmap(NULL, matrix->mapping_size, PROT_READ,
+                               MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (matrix->mapping == MAP_FAILED) {
+    fprintf(stderr, "Failed to map npy file %s\n", filename);
+    return false;
+  }
+
+  const unsigned char *bytes = matrix->mapping;
+  size_t header_offset, header_length;
+  if (matrix->mapping_size < NPY_MAGIC_SIZE + 4 ||
+      memcmp(bytes, npy_magic, NPY_MAGIC_SIZE) != 0)
+    goto invalid;
+  if (bytes[NPY_MAGIC_SIZE] == 1) {
+    header_offset = NPY_MAGIC_SIZE + 4;
+    header_length = bytes[8] | (size_t)bytes[9] << 8;
+  } else {
+    header_offset = NPY_MAGIC_SIZE + 6;
+    if (matrix->mapping_size < header_offset)
+      goto invalid;
+    header_length = bytes[8] | (size_t)bytes[9] << 8 |
+                    (size_t)bytes[10] << 16 | (size_t)bytes[11] << 24;
+  }
+  if (matrix->mapping_size < header_offset + header_length ||
+      !parse_npy_header((const char *)&bytes[header_offset], header_length,
+                        matrix))
+    goto invalid;
+
+  size_t data_offset = header_offset + header_length;
+  size_t value_size = npy_types[matrix->type].size;
+  if (matrix->columns != 0 &&
+      matrix->rows > (matrix->mapping_size - data_offset) / value_size /
+                         matrix->columns)
+    goto invalid;
+  matrix->data = (unsigned char *)matrix->mapping + data_offset;
+  if (data_offset % value_size != 0) {
+    fprintf(stderr, "The data of npy file %s is not aligned\n", filename);
+    unmap_npy(matrix);
+    return false;
+  }
+  // Every iteration reads the matrix from start to end
+  madvise(matrix->mapping, matrix->mapping_size, MADV_SEQUENTIAL);
+  return true;
+
+invalid:
+  fprintf(stderr, "Invalid or truncated npy file %s\n", filename);
+  unmap_npy(matrix);
+  return false;
+}
+
+int open_npy(const char *filename, struct npy_matrix *matrix,
+             off_t *data_offset) {
+  if (!host_is_little_endian()) {
+    fprintf(stderr, "The npy files are only read on little endian hosts\n");
+    return -1;
+  }
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0) {
+    int saved_errno = errno;
+    fprintf(stderr, "Failed to open npy file %s: ", filename);
+    errno = saved_errno;
+    perror(NULL);
+    return -1;
+  }
+  struct stat file_stat;
+  unsigned char prefix[NPY_MAGIC_SIZE + 6];
+  char *header = NULL;
+  size_t header_offset, header_length;
+  if (fstat(fd, &file_stat) != 0 ||
+      pread(fd, prefix, sizeof(prefix), 0) != (ssize_t)sizeof(prefix) ||
+      memcmp(prefix, npy_magic, NPY_MAGIC_SIZE) != 0)
+    goto invalid;
+  if (prefix[NPY_MAGIC_SIZE] == 1) {
+    header_offset = NPY_MAGIC_SIZE + 4;
+    header_length = prefix[8] | (size_t)prefix[9] << 8;
+  } else {
+    header_offset = NPY_MAGIC_SIZE + 6;
+    header_length = prefix[8] | (size_t)prefix[9] << 8 |
+                    (size_t)prefix[10] << 16 | (size_t)prefix[11] << 24;
+  }
+  header = malloc(header_length);
+  if (header == NULL ||
+      pread(fd, header, header_length, (off_t)header_offset) !=
+          (ssize_t)header_length ||
+      !parse_npy_header(header, header_length, matrix))
+    goto invalid;
+  free(header);
+  header = NULL;
+
+  size_t file_size = (size_t)file_stat.st_size;
+  size_t offset = header_offset + header_length;
+  size_t value_size = npy_types[matrix->type].size;
+  if (matrix->columns != 0 &&
+      matrix->rows > (file_size - offset) / value_size / matrix->columns)
+    goto invalid;
+  matrix->data = NULL;
+  matrix->mapping = NULL;
+  matrix->mapping_size = 0;
+  *data_offset = (off_t)offset;
+  return fd;
+
+invalid:
+  free(header);
+  close(fd);
+  fprintf(stderr, "Invalid or truncated npy file %s\n", filename);
+  return -1;
+}
+
+void unmap_npy(struct npy_matrix *matrix) {
+  if (matrix->mapping != NULL && matrix->mapping != MAP_FAILED)
+    munmap(matrix->mapping, matrix->mapping_size);
+  matrix->mapping = NULL;
+  matrix->data = NULL;
+}
+
+bool write_npy(const char *filename, enum npy_type type, size_t rows,
+               size_t columns, const void *data) {
+  if (!host_is_little_endian()) {
+    fprintf(stderr, "The npy files are only written on little endian hosts\n");
+    return false;
+  }
+  // The header is padded with spaces up to a multiple of 64 bytes with the
+  // prefix, and ends with a new line
+  char header[256];
+  int length;
+  if (columns == 1)
+    length = snprintf(header, sizeof(header),
+                      "{'descr': '%c%s', 'fortran_order': False, "
+                      "'shape': (%zu,), }",
+                      type == npy_uint8 ? '|' : '<', npy_types[type].descr,
+                      rows);
+  else
+    length = snprintf(header, sizeof(header),
+                      "{'descr': '%c%s', 'fortran_order': False, "
+                      "'shape': (%zu, %zu), }",
+                      type == npy_uint8 ? '|' : '<', npy_types[type].descr,
+                      rows, columns);
+  size_t header_length = (size_t)length + 1;
+  size_t padded_length =
+      (NPY_MAGIC_SIZE + 4 + header_length + NPY_HEADER_ALIGNMENT - 1) /
+          NPY_HEADER_ALIGNMENT * NPY_HEADER_ALIGNMENT -
+      (NPY_MAGIC_SIZE + 4);
+  memset(&header[length], ' ', padded_length - (size_t)length);
+  header[padded_length - 1] = '\n';
+
+  FILE *npy_file = fopen(filename, "wb");
+  if (npy_file == NULL) {
+    int saved_errno = errno;
+    fprintf(stderr, "Failed to open file '%s' for writing: ", filename);
+    errno = saved_errno;
+    perror(NULL);
+    return false;
+  }
+  const unsigned char prefix[NPY_MAGIC_SIZE + 4] = {
+      0x93, 'N', 'U', 'M', 'P', 'Y', 1, 0, (unsigned char)padded_length,
+      (unsigned char)(padded_length >> 8)};
+  size_t values = rows * columns;
+  bool written =
+      fwrite(prefix, sizeof(prefix), 1, npy_file) == 1 &&
+      fwrite(header, padded_length, 1, npy_file) == 1 &&
+      fwrite(data, npy_types[type].size, values, npy_file) == values;
+  if (fclose(npy_file) != 0 || !written) {
+    fprintf(stderr, "Failed to write npy file %s\n", filename);
+    return false;
+  }
+  return true;
+}
@@ -1,9 +1,18 @@
+// The input of deflate is read only
+#define ZLIB_CONST
+
 #include <errno.h>
 #include <png.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+#include "k-means.h"
+#include "k-means_png.h"
 
 #define PNG_BYTES_TO_CHECK 8
 static bool check_if_png(FILE *fp) {
@@ -19,9 +28,95 @@ static bool check_if_png(FILE *fp) {
   return (!png_sig_cmp(buf, 0, PNG_BYTES_TO_CHECK));
 }
 
-bool read_png(const char *filename, uint16_t **image, uint32_t *height,
-              uint32_t *width) {
-  *image = NULL;
+// The row samples of the current pass are stored into the points, as the
+// interlaced passes fill the rows in several steps the previous samples are
+// loaded back first. The 8 bits samples were expanded by replication, the
+// high byte is the original sample.
+static void store_row(enum png_point_type type, void *points,
+                      size_t first_value, size_t count, const uint16_t *row) {
+  for (size_t i = 0; i < count; ++i) {
+    switch (type) {
+    case png_points_double:
+      ((double *)points)[first_value + i] = row[i];
+      break;
+    case png_points_uint8:
+      ((uint8_t *)points)[first_value + i] = (uint8_t)(row[i] >> 8);
+      break;
+    case png_points_uint16:
+      ((uint16_t *)points)[first_value + i] = row[i];
+      break;
+    default:
+      ((float *)points)[first_value + i] = row[i];
+      break;
+    }
+  }
+}
+
+static void load_row(enum png_point_type type, const void *points,
+                     size_t first_value, size_t count, uint16_t *row) {
+  for (size_t i = 0; i < count; ++i) {
+    switch (type) {
+    case png_points_double:
+      row[i] = (uint16_t)((const double *)points)[first_value + i];
+      break;
+    case png_points_uint8:
+      row[i] = (uint16_t)(((const uint8_t *)points)[first_value + i] * 257);
+      break;
+    case png_points_uint16:
+      row[i] = ((const uint16_t *)points)[first_value + i];
+      break;
+    default:
+      row[i] = (uint16_t)((const float *)points)[first_value + i];
+      break;
+    }
+  }
+}
+
+size_t png_point_value_size(enum png_point_type type) {
+  switch (type) {
+  case png_points_double:
+    return sizeof(double);
+  case png_points_uint8:
+    return sizeof(uint8_t);
+  case png_points_uint16:
+  case png_points_half:
+  case png_points_bfloat16:
+    return sizeof(uint16_t);
+  default:
+    return sizeof(float);
+  }
+}
+
+// Record which channels vary over the image and which ones differ from the
+// previous channels
+static void track_channels(const uint16_t *row, uint32_t width,
+                           unsigned channels, const uint16_t *first_pixel,
+                           bool varies[4], bool differs[4][4]) {
+  for (uint32_t x = 0; x < width; ++x) {
+    const uint16_t *pixel = &row[(size_t)x * channels];
+    for (unsigned c = 0; c < channels; ++c) {
+      varies[c] |= pixel[c] != first_pixel[c];
+      for (unsigned d = 0; d < c; ++d)
+        differs[c][d] |= pixel[c] != pixel[d];
+    }
+  }
+}
+
+static void compact_channels(size_t value_size, void *points,
+                             size_t num_points, unsigned channels,
+                             const unsigned *kept, unsigned num_kept) {
+  // The destination never overtakes the source
+  char *values = points;
+  for (size_t point = 0; point < num_points; ++point)
+    for (unsigned c = 0; c < num_kept; ++c)
+      memmove(&values[(point * num_kept + c) * value_size],
+              &values[(point * channels + kept[c]) * value_size], value_size);
+}
+
+bool read_png_points(const char *filename, enum png_point_type *type,
+                     void **points, uint32_t *height, uint32_t *width,
+                     size_t *dimension, struct png_channels *layout) {
+  *points = NULL;
   FILE *png_file = fopen(filename, "rb");
   if (png_file == NULL) {
     int saved_errno = errno;
@@ -51,13 +146,14 @@ bool read_png(const char *filename, uint16_t **image, uint32_t *height,
     return false;
   }
 
-  uint16_t **rows = NULL;
+  uint16_t *row = NULL;
   if (setjmp(png_jmpbuf(png_ptr))) {
     /* Free all of the memory associated with the png_ptr and info_ptr. */
     png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
     fclose(png_file);
-    free(*image);
-    free(rows);
+    free(*points);
+    *points = NULL;
+    free(row);
     /* If we get here, we had a problem reading the file. */
     return false;
   }
@@ -77,39 +173,170 @@ bool read_png(const char *filename, uint16_t **image, uint32_t *height,
   if (png_get_valid(png_ptr, info_ptr, PNG_INFO_tRNS) != 0)
     png_set_tRNS_to_alpha(png_ptr);
 
+  // Grey images keep a single channel, the samples are 16 bits in the host
+  // byte order
+  if (*type == png_points_integer)
+    *type = bit_depth <= 8 ? png_points_uint8 : png_points_uint16;
   if (bit_depth < 16)
     png_set_expand_16(png_ptr);
+  const uint16_t endianness = 1;
+  if (*(const uint8_t *)&endianness == 1)
+    png_set_swap(png_ptr);
 
-  if (color_type == PNG_COLOR_TYPE_GRAY ||
-      color_type == PNG_COLOR_TYPE_GRAY_ALPHA)
-    png_set_gray_to_rgb(png_ptr);
-
-  if (color_type == PNG_COLOR_TYPE_RGB || color_type == PNG_COLOR_TYPE_GRAY)
-    png_set_add_alpha(png_ptr, 0xffff, PNG_FILLER_AFTER);
-
-  if (bit_depth < 16)
-    png_set_expand_16(png_ptr);
-
+  int passes = png_set_interlace_handling(png_ptr);
   png_read_update_info(png_ptr, info_ptr);
 
+  unsigned channels = png_get_channels(png_ptr, info_ptr);
+  size_t row_values = (size_t)*width * channels;
   size_t row_bytes = png_get_rowbytes(png_ptr, info_ptr);
-  if (row_bytes != *width * 8) {
-    fprintf(stderr, "Wrong row bytes me %d, png %zu\n", *width * 8, row_bytes);
-    exit(EXIT_FAILURE);
+  if (channels > 4 || row_bytes != row_values * sizeof(uint16_t)) {
+    fprintf(stderr, "Wrong row bytes me %zu, png %zu\n",
+            row_values * sizeof(uint16_t), row_bytes);
+    png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+    fclose(png_file);
+    return false;
+  }
+  size_t value_size = png_point_value_size(*type);
+  size_t num_points = (size_t)*height * *width;
+  row = malloc(row_bytes);
+  *points = malloc(num_points * channels * value_size);
+  if (row == NULL || *points == NULL) {
+    fprintf(stderr, "Failed to allocate the points of png file %s\n",
+            filename);
+    png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+    fclose(png_file);
+    free(*points);
+    *points = NULL;
+    free(row);
+    return false;
   }
-  rows = malloc(*height * sizeof(*rows));
-  *image = malloc(sizeof(uint16_t[*height][*width * 4]));
-  for (png_uint_32 row_id = 0; row_id < *height; row_id++) {
-    rows[row_id] = &(*image)[*width * 4 * row_id];
+
+  uint16_t first_pixel[4] = {0};
+  bool varies[4] = {false}, differs[4][4] = {{false}};
+  for (int pass = 0; pass < passes; ++pass) {
+    bool last_pass = pass == passes - 1;
+    for (uint32_t y = 0; y < *height; ++y) {
+      if (pass > 0)
+        load_row(*type, *points, y * row_values, row_values, row);
+      png_read_row(png_ptr, (png_bytep)row, NULL);
+      store_row(*type, *points, y * row_values, row_values, row);
+      if (last_pass) {
+        if (y == 0)
+          memcpy(first_pixel, row, channels * sizeof(*row));
+        track_channels(row, *width, channels, first_pixel, varies, differs);
+      }
+    }
   }
-  png_read_image(png_ptr, (unsigned char **)rows);
-  png_read_end(png_ptr, info_ptr);
+  png_read_end(png_ptr, NULL);
   png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
   fclose(png_file);
-  free(rows);
+  free(row);
+
+  unsigned kept[4], num_kept = 0;
+  for (unsigned c = 0; c < channels; ++c) {
+    bool repeated = false;
+    for (unsigned d = 0; d < c; ++d)
+      repeated |= !differs[c][d];
+    if (varies[c] && !repeated)
+      kept[num_kept++] = c;
+  }
+  // A uniform image keeps its first channel
+  if (num_kept == 0)
+    kept[num_kept++] = 0;
+  if (num_kept < channels) {
+    compact_channels(value_size, *points, num_points, channels, kept,
+                     num_kept);
+    void *shrunk = realloc(*points, num_points * num_kept * value_size);
+    if (shrunk != NULL)
+      *points = shrunk;
+  }
+  *dimension = num_kept;
+
+  if (layout != NULL) {
+    layout->channels = channels;
+    for (unsigned c = 0, k = 0; c < channels; ++c) {
+      unsigned repeated = c;
+      for (unsigned d = 0; d < c && repeated == c; ++d)
+        if (!differs[c][d])
+          repeated = d;
+      if (k < num_kept && kept[k] == c) {
+        layout->source[c] = k++;
+      } else if (repeated != c) {
+        layout->source[c] = layout->source[repeated];
+        layout->constant[c] = layout->constant[repeated];
+      } else {
+        layout->source[c] = num_kept;
+        layout->constant[c] = first_pixel[c];
+      }
+    }
+  }
   return true;
 }
 
+static double point_value(enum png_point_type type, const void *points,
+                          size_t value) {
+  switch (type) {
+  case png_points_double:
+    return ((const double *)points)[value];
+  case png_points_uint8:
+    return ((const uint8_t *)points)[value];
+  case png_points_uint16:
+    return ((const uint16_t *)points)[value];
+  default:
+    return ((const float *)points)[value];
+  }
+}
+
+static void set_point_value(enum png_point_type type, void *points,
+                            size_t value, double sample) {
+  switch (type) {
+  case png_points_double:
+    ((double *)points)[value] = sample;
+    break;
+  case png_points_uint8:
+    ((uint8_t *)points)[value] = (uint8_t)(sample + .5);
+    break;
+  case png_points_uint16:
+    ((uint16_t *)points)[value] = (uint16_t)(sample + .5);
+    break;
+  default:
+    ((float *)points)[value] = (float)sample;
+    break;
+  }
+}
+
+void *downsample_png_points(enum png_point_type type, const void *points,
+                            uint32_t height, uint32_t width, size_t dimension,
+                            uint32_t *half_height, uint32_t *half_width) {
+  *half_height = (height + 1) / 2;
+  *half_width = (width + 1) / 2;
+  void *half = malloc((size_t)*half_height * *half_width * dimension *
+                      png_point_value_size(type));
+  if (half == NULL) {
+    fprintf(stderr, "Failed to allocate the downsampled image\n");
+    exit(EXIT_FAILURE);
+  }
+  for (uint32_t y = 0; y < *half_height; ++y) {
+    uint32_t rows = 2 * y + 1 < height ? 2 : 1;
+    for (uint32_t x = 0; x < *half_width; ++x) {
+      uint32_t columns = 2 * x + 1 < width ? 2 : 1;
+      size_t half_point = (size_t)y * *half_width + x;
+      for (size_t dim = 0; dim < dimension; ++dim) {
+        double sum = 0.;
+        for (uint32_t row = 0; row < rows; ++row)
+          for (uint32_t column = 0; column < columns; ++column)
+            sum += point_value(
+                type, points,
+                (((size_t)2 * y + row) * width + 2 * x + column) * dimension +
+                    dim);
+        set_point_value(type, half, half_point * dimension + dim,
+                        sum / (rows * columns));
+      }
+    }
+  }
+  return half;
+}
+
 // write 8bit grey values
 bool write_grey_png(const char *filename, uint32_t height, uint32_t width,
                     uint8_t image[height][width]) {
@@ -159,3 +386,344 @@ bool write_grey_png(const char *filename, uint32_t height, uint32_t width,
   free(rows);
   return true;
 }
+
+void png_palette(const struct png_channels *channels, enum png_point_type type,
+                 size_t k, size_t dimension, const double *centroids,
+                 uint8_t palette[k][4]) {
+  // The 8 bits points hold the samples, the others the 16 bits samples
+  const double scale = type == png_points_uint8 ? 1. : 1. / 257.;
+  for (size_t centro = 0; centro < k; ++centro) {
+    uint8_t samples[4] = {0};
+    for (unsigned c = 0; c < channels->channels; ++c) {
+      double sample =
+          channels->source[c] < dimension
+              ? centroids[centro * dimension + channels->source[c]] * scale
+              : channels->constant[c] / 257.;
+      samples[c] = sample <= 0.     ? 0
+                   : sample >= 255. ? 255
+                                    : (uint8_t)(sample + .5);
+    }
+    bool grey = channels->channels <= 2;
+    bool alpha = channels->channels == 2 || channels->channels == 4;
+    palette[centro][0] = samples[0];
+    palette[centro][1] = grey ? samples[0] : samples[1];
+    palette[centro][2] = grey ? samples[0] : samples[2];
+    palette[centro][3] = alpha ? samples[channels->channels - 1] : 255;
+  }
+}
+
+// The encoded image: one filter byte followed by the packed samples per row
+struct png_strips {
+  uint32_t height;
+  size_t row_bytes, pixel_bytes;
+  const uint8_t *raw;   // height rows of row_bytes
+  uint8_t *filtered;    // height rows of 1 + row_bytes
+  enum png_filter filter;
+  const struct png_encoder *encoder;
+  unsigned num_strips;
+  pthread_barrier_t barrier;
+};
+
+struct png_strip {
+  pthread_t thread;
+  struct png_strips *strips;
+  uint32_t first_row, last_row;
+  uint8_t *compressed;
+  size_t compressed_size;
+  uLong adler;
+  bool failed;
+};
+
+#define PNG_DEFLATE_WINDOW ((size_t)1 << 15)
+
+static uint8_t paeth_predictor(uint8_t a, uint8_t b, uint8_t c) {
+  int p = a + b - c;
+  int pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+  return pa <= pb && pa <= pc ? a : pb <= pc ? b : c;
+}
+
+// Filters a row with the previous one (NULL for the first row), returns the
+// sum of the absolute values of the signed filtered bytes
+static size_t filter_row(enum png_filter filter, size_t row_bytes,
+                         size_t pixel_bytes, const uint8_t *row,
+                         const uint8_t *previous, uint8_t *filtered) {
+  size_t sum = 0;
+  filtered[0] = (uint8_t)filter;
+  for (size_t i = 0; i < row_bytes; ++i) {
+    uint8_t a = i >= pixel_bytes ? row[i - pixel_bytes] : 0;
+    uint8_t b = previous != NULL ? previous[i] : 0;
+    uint8_t c = i >= pixel_bytes && previous != NULL
+                    ? previous[i - pixel_bytes]
+                    : 0;
+    uint8_t value;
+    switch (filter) {
+    case png_filter_sub:
+      value = (uint8_t)(row[i] - a);
+      break;
+    case png_filter_up:
+      value = (uint8_t)(row[i] - b);
+      break;
+    case png_filter_average:
+      value = (uint8_t)(row[i] - (a + b) / 2);
+      break;
+    case png_filter_paeth:
+      value = (uint8_t)(row[i] - paeth_predictor(a, b, c));
+      break;
+    default:
+      value = row[i];
+      break;
+    }
+    filtered[1 + i] = value;
+    sum += (size_t)abs((int8_t)value);
+  }
+  return sum;
+}
+
+static void *encode_strip(void *arg) {
+  struct png_strip *strip = arg;
+  struct png_strips *strips = strip->strips;
+  const size_t row_bytes = strips->row_bytes;
+  const size_t filtered_bytes = 1 + row_bytes;
+
+  for (uint32_t row = strip->first_row; row < strip->last_row; ++row) {
+    const uint8_t *raw = &strips->raw[row * row_bytes];
+    const uint8_t *previous = row != 0 ? raw - row_bytes : NULL;
+    uint8_t *filtered = &strips->filtered[row * filtered_bytes];
+    if (strips->filter != png_filter_adaptive) {
+      filter_row(strips->filter, row_bytes, strips->pixel_bytes, raw, previous,
+                 filtered);
+      continue;
+    }
+    // The filter of the smallest sum is applied again to the row
+    size_t best_sum = SIZE_MAX;
+    enum png_filter best = png_filter_none;
+    for (enum png_filter filter = png_filter_none; filter <= png_filter_paeth;
+         ++filter) {
+      size_t sum = filter_row(filter, row_bytes, strips->pixel_bytes, raw,
+                              previous, filtered);
+      if (sum < best_sum) {
+        best_sum = sum;
+        best = filter;
+      }
+    }
+    filter_row(best, row_bytes, strips->pixel_bytes, raw, previous, filtered);
+  }
+  // The dictionary of a strip is the end of the previous one
+  if (strips->num_strips > 1)
+    pthread_barrier_wait(&strips->barrier);
+
+  const uint8_t *input = &strips->filtered[strip->first_row * filtered_bytes];
+  size_t input_size = (strip->last_row - strip->first_row) * filtered_bytes;
+  bool last = strip->last_row == strips->height;
+  strip->adler = adler32(adler32(0, NULL, 0), input, (uInt)input_size);
+  z_stream stream = {.zalloc = Z_NULL, .zfree = Z_NULL, .opaque = Z_NULL};
+  strip->failed =
+      deflateInit2(&stream, strips->encoder->level, Z_DEFLATED, -15, 8,
+                   strips->encoder->strategy) != Z_OK;
+  if (strip->failed)
+    return NULL;
+  if (strip->first_row != 0) {
+    size_t dictionary_size = strip->first_row * filtered_bytes;
+    if (dictionary_size > PNG_DEFLATE_WINDOW)
+      dictionary_size = PNG_DEFLATE_WINDOW;
+    deflateSetDictionary(&stream, input - dictionary_size,
+                         (uInt)dictionary_size);
+  }
+  // The strips but the last end on a byte boundary, without the final block
+  size_t capacity = deflateBound(&stream, input_size) + 16;
+  strip->compressed = malloc(capacity);
+  strip->failed = strip->compressed == NULL;
+  if (strip->failed) {
+    fprintf(stderr, "Failed to allocate a compressed png strip\n");
+    deflateEnd(&stream);
+    return NULL;
+  }
+  stream.next_in = input;
+  stream.avail_in = (uInt)input_size;
+  stream.next_out = strip->compressed;
+  stream.avail_out = (uInt)capacity;
+  int status = deflate(&stream, last ? Z_FINISH : Z_SYNC_FLUSH);
+  strip->failed = last ? status != Z_STREAM_END
+                       : status != Z_OK || stream.avail_in != 0;
+  strip->compressed_size = capacity - stream.avail_out;
+  deflateEnd(&stream);
+  return NULL;
+}
+
+static void put_uint32(uint8_t bytes[4], uint32_t value) {
+  bytes[0] = (uint8_t)(value >> 24);
+  bytes[1] = (uint8_t)(value >> 16);
+  bytes[2] = (uint8_t)(value >> 8);
+  bytes[3] = (uint8_t)value;
+}
+
+static bool write_chunk(FILE *file, const char type[4], const uint8_t *data,
+                        size_t size) {
+  uint8_t length[4], crc[4];
+  put_uint32(length, (uint32_t)size);
+  uLong chunk_crc = crc32(crc32(0, NULL, 0), (const Bytef *)type, 4);
+  if (size != 0)
+    chunk_crc = crc32(chunk_crc, data, (uInt)size);
+  put_uint32(crc, (uint32_t)chunk_crc);
+  return fwrite(length, 4, 1, file) == 1 && fwrite(type, 4, 1, file) == 1 &&
+         (size == 0 || fwrite(data, size, 1, file) == 1) &&
+         fwrite(crc, 4, 1, file) == 1;
+}
+
+// Writes the rows of samples of the given bit depth, grey levels or indices
+// in the palette of colours entries. The chunks are written by hand as the
+// zlib stream is made of the strips compressed apart.
+static bool write_rows_png(const char *filename, uint32_t height,
+                           uint32_t width, unsigned bit_depth,
+                           const uint8_t *rows, const uint8_t (*palette)[4],
+                           size_t colours, const struct png_encoder *encoder) {
+  struct png_strips strips = {
+      .height = height,
+      .row_bytes = ((size_t)width * bit_depth + 7) / 8,
+      .pixel_bytes = 1,
+      .raw = rows,
+      .filter = encoder->filter,
+      .encoder = encoder,
+      .num_strips = encoder->threads != 0 ? encoder->threads : 1,
+  };
+  // libpng's choice: the palettes and the sub-byte samples compress better
+  // unfiltered
+  if (strips.filter == png_filter_default)
+    strips.filter = palette == NULL && bit_depth == 8 ? png_filter_adaptive
+                                                      : png_filter_none;
+  if (strips.num_strips > height)
+    strips.num_strips = height;
+  strips.filtered = malloc(height * (1 + strips.row_bytes));
+  struct png_strip *strip = calloc(strips.num_strips, sizeof(*strip));
+  if (strips.filtered == NULL || strip == NULL) {
+    fprintf(stderr, "Failed to allocate the filtered rows of png file %s\n",
+            filename);
+    free(strip);
+    free(strips.filtered);
+    return false;
+  }
+  if (strips.num_strips > 1)
+    pthread_barrier_init(&strips.barrier, NULL, strips.num_strips);
+  for (unsigned i = 0; i < strips.num_strips; ++i) {
+    strip[i].strips = &strips;
+    strip[i].first_row = (uint32_t)((uint64_t)height * i / strips.num_strips);
+    strip[i].last_row =
+        (uint32_t)((uint64_t)height * (i + 1) / strips.num_strips);
+    if (i != 0 && pthread_create(&strip[i].thread, NULL, encode_strip,
+                                 &strip[i]) != 0) {
+      fprintf(stderr, "Failed to create a png encoding thread\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+  encode_strip(&strip[0]);
+  bool failed = strip[0].failed;
+  uLong adler = strip[0].adler;
+  for (unsigned i = 1; i < strips.num_strips; ++i) {
+    pthread_join(strip[i].thread, NULL);
+    failed |= strip[i].failed;
+    adler = adler32_combine(
+        adler, strip[i].adler,
+        (z_off_t)(strip[i].last_row - strip[i].first_row) *
+            (z_off_t)(1 + strips.row_bytes));
+  }
+  if (strips.num_strips > 1)
+    pthread_barrier_destroy(&strips.barrier);
+
+  FILE *png_file = failed ? NULL : fopen(filename, "wb");
+  if (png_file == NULL && !failed) {
+    int saved_errno = errno;
+    fprintf(stderr, "Failed to open file '%s' for writing: ", filename);
+    errno = saved_errno;
+    perror(NULL);
+  }
+  bool written = png_file != NULL;
+  if (written) {
+    static const uint8_t signature[8] = {137, 80, 78, 71, 13, 10, 26, 10};
+    uint8_t header[13];
+    put_uint32(&header[0], width);
+    put_uint32(&header[4], height);
+    header[8] = (uint8_t)bit_depth;
+    header[9] = palette != NULL ? PNG_COLOR_TYPE_PALETTE : PNG_COLOR_TYPE_GRAY;
+    header[10] = header[11] = header[12] = 0; // Deflate, adaptive, progressive
+    written = fwrite(signature, sizeof(signature), 1, png_file) == 1 &&
+              write_chunk(png_file, "IHDR", header, sizeof(header));
+    if (written && palette != NULL) {
+      uint8_t colours_rgb[256 * 3], alphas[256];
+      bool opaque = true;
+      for (size_t colour = 0; colour < colours; ++colour) {
+        memcpy(&colours_rgb[3 * colour], palette[colour], 3);
+        alphas[colour] = palette[colour][3];
+        opaque &= alphas[colour] == 255;
+      }
+      written = write_chunk(png_file, "PLTE", colours_rgb, 3 * colours) &&
+                (opaque || write_chunk(png_file, "tRNS", alphas, colours));
+    }
+    // zlib header with the level hint, the strips, then the checksum
+    int level = encoder->level < 0 ? Z_DEFAULT_COMPRESSION : encoder->level;
+    unsigned level_hint = level == Z_DEFAULT_COMPRESSION ? 2
+                          : level < 2                    ? 0
+                          : level < 6                    ? 1
+                          : level == 6                   ? 2
+                                                         : 3;
+    uint8_t zlib_header[2] = {0x78, (uint8_t)(level_hint << 6)};
+    zlib_header[1] += (uint8_t)(31 - (0x78 * 256 + zlib_header[1]) % 31);
+    uint8_t checksum[4];
+    put_uint32(checksum, (uint32_t)adler);
+    written = written && write_chunk(png_file, "IDAT", zlib_header, 2);
+    for (unsigned i = 0; written && i < strips.num_strips; ++i)
+      written = write_chunk(png_file, "IDAT", strip[i].compressed,
+                            strip[i].compressed_size);
+    written = written && write_chunk(png_file, "IDAT", checksum, 4) &&
+              write_chunk(png_file, "IEND", NULL, 0);
+    written &= fclose(png_file) == 0;
+  }
+  if (!written)
+    fprintf(stderr, "Failed to write png file %s\n", filename);
+
+  for (unsigned i = 0; i < strips.num_strips; ++i)
+    free(strip[i].compressed);
+  free(strip);
+  free(strips.filtered);
+  return written;
+}
+
+bool write_labels_png(const char *filename, uint32_t height, uint32_t width,
+                      size_t k, const void *point_to_centroid_map,
+                      const uint8_t (*palette)[4],
+                      const struct png_encoder *encoder) {
+  static const struct png_encoder default_encoder = PNG_ENCODER_DEFAULT;
+  if (encoder == NULL)
+    encoder = &default_encoder;
+  if (palette != NULL && k > 256) {
+    fprintf(stderr, "The palette holds at most 256 colours, not %zu\n", k);
+    return false;
+  }
+  unsigned bit_depth = palette == NULL ? 8
+                       : k <= 2        ? 1
+                       : k <= 4        ? 2
+                       : k <= 16       ? 4
+                                       : 8;
+  size_t row_bytes = ((size_t)width * bit_depth + 7) / 8;
+  uint8_t *rows = calloc(height, row_bytes);
+  if (rows == NULL) {
+    fprintf(stderr, "Failed to allocate the labels image\n");
+    return false;
+  }
+  size_t multiplier = UINT8_MAX / k;
+  for (size_t i = 0; i < height; ++i) {
+    uint8_t *row = &rows[i * row_bytes];
+    for (size_t j = 0; j < width; ++j) {
+      size_t label = k_means_label(point_to_centroid_map, k, i * width + j);
+      if (palette == NULL)
+        row[j] = (uint8_t)(multiplier != 0 ? label * multiplier
+                                           : label * UINT8_MAX / k);
+      else // Packed from the most significant bits
+        row[j * bit_depth / 8] |=
+            (uint8_t)(label << (8 - bit_depth - j * bit_depth % 8));
+    }
+  }
+  bool written = write_rows_png(filename, height, width, bit_depth, rows,
+                                palette, k, encoder);
+  free(rows);
+  return written;
+}
@@ -0,0 +1,212 @@
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "k-means_synthetic.h"
+
+// Philox4x32-10 of Salmon et al., "Parallel random numbers: as easy as 1, 2,
+// 3" (SC 2011). The value of a counter does not depend on the previous ones.
+#define PHILOX_M0 0xd2511f53u
+#define PHILOX_M1 0xcd9e8d57u
+#define PHILOX_W0 0x9e3779b9u
+#define PHILOX_W1 0xbb67ae85u
+#define PHILOX_ROUNDS 10
+
+// The independent sequences drawn from a counter
+enum synthetic_stream {
+  synthetic_stream_values,
+  synthetic_stream_blobs,
+  synthetic_stream_centres,
+};
+
+static void philox(uint64_t index, uint32_t block, uint32_t stream,
+                   unsigned long seed, uint32_t out[4]) {
+  uint32_t c0 = (uint32_t)index, c1 = (uint32_t)(index >> 32), c2 = block,
+           c3 = stream;
+  uint32_t k0 = (uint32_t)seed, k1 = (uint32_t)((uint64_t)seed >> 32);
+  for (int round = 0; round < PHILOX_ROUNDS; ++round) {
+    uint64_t product0 = (uint64_t)PHILOX_M0 * c0;
+    uint64_t product1 = (uint64_t)PHILOX_M1 * c2;
+    uint32_t next0 = (uint32_t)(product1 >> 32) ^ c1 ^ k0;
+    uint32_t next2 = (uint32_t)(product0 >> 32) ^ c3 ^ k1;
+    c1 = (uint32_t)product1;
+    c3 = (uint32_t)product0;
+    c0 = next0;
+    c2 = next2;
+    k0 += PHILOX_W0;
+    k1 += PHILOX_W1;
+  }
+  out[0] = c0;
+  out[1] = c1;
+  out[2] = c2;
+  out[3] = c3;
+}
+
+// Two uniforms in [0, 1) from the 128 bits of a counter
+static void synthetic_uniforms(uint64_t index, uint32_t block, uint32_t stream,
+                               unsigned long seed, double uniform[2]) {
+  uint32_t bits[4];
+  philox(index, block, stream, seed, bits);
+  for (int i = 0; i < 2; ++i) {
+    uint64_t word = (uint64_t)bits[2 * i] << 32 | bits[2 * i + 1];
+    uniform[i] = (double)(word >> 11) * 0x1.0p-53;
+  }
+}
+
+struct synthetic_slice {
+  const struct synthetic_options *options;
+  const double *centres; // blobs * dimension
+  const double *cumulative_weights; // blobs, the last one is 1
+  float *data_f;
+  double *data_d;
+  uint32_t *labels;
+  size_t first, end;
+};
+
+static size_t synthetic_blob(const struct synthetic_slice *slice,
+                             size_t point) {
+  const struct synthetic_options *options = slice->options;
+  double uniform[2];
+  synthetic_uniforms(point, 0, synthetic_stream_blobs, options->seed, uniform);
+  size_t low = 0, high = options->blobs - 1;
+  while (low < high) {
+    size_t middle = low + (high - low) / 2;
+    if (uniform[0] < slice->cumulative_weights[middle])
+      high = middle;
+    else
+      low = middle + 1;
+  }
+  return low;
+}
+
+static void *synthetic_fill(void *arg) {
+  const struct synthetic_slice *slice = arg;
+  const struct synthetic_options *options = slice->options;
+  const size_t dimension = options->dimension;
+  const double deviation = options->spread * options->max;
+  for (size_t point = slice->first; point < slice->end; ++point) {
+    size_t blob = options->blobs > 0 ? synthetic_blob(slice, point) : 0;
+    const double *centre = slice->centres + blob * dimension;
+    for (size_t dim = 0; dim < dimension; dim += 2) {
+      double value[2];
+      synthetic_uniforms(point, (uint32_t)(dim / 2), synthetic_stream_values,
+                         options->seed, value);
+      if (options->blobs > 0) { // Box-Muller, 1 - u avoids the log of 0
+        double radius = sqrt(-2. * log(1. - value[0]));
+        double angle = 2. * M_PI * value[1];
+        value[0] = centre[dim] + deviation * radius * cos(angle);
+        if (dim + 1 < dimension)
+          value[1] = centre[dim + 1] + deviation * radius * sin(angle);
+      } else {
+        value[0] *= options->max;
+        value[1] *= options->max;
+      }
+      size_t count = dim + 1 < dimension ? 2 : 1;
+      for (size_t i = 0; i < count; ++i) {
+        if (slice->data_d != NULL)
+          slice->data_d[point * dimension + dim + i] = value[i];
+        else
+          slice->data_f[point * dimension + dim + i] = (float)value[i];
+      }
+    }
+    if (slice->labels != NULL)
+      slice->labels[point] = (uint32_t)blob;
+  }
+  return NULL;
+}
+
+static bool synthetic_points(const struct synthetic_options *options,
+                             float *data_f, double *data_d, uint32_t *labels) {
+  const size_t blobs = options->blobs, dimension = options->dimension;
+  double *centres = NULL, *cumulative_weights = NULL;
+  if (blobs > 0) {
+    centres = malloc(blobs * dimension * sizeof(*centres));
+    cumulative_weights = malloc(blobs * sizeof(*cumulative_weights));
+    if (centres == NULL || cumulative_weights == NULL) {
+      fprintf(stderr, "Failed to allocate the synthetic blobs\n");
+      free(cumulative_weights);
+      free(centres);
+      return false;
+    }
+    for (size_t blob = 0; blob < blobs; ++blob)
+      for (size_t dim = 0; dim < dimension; dim += 2) {
+        double uniform[2];
+        synthetic_uniforms(blob, (uint32_t)(dim / 2), synthetic_stream_centres,
+                           options->seed, uniform);
+        centres[blob * dimension + dim] = uniform[0] * options->max;
+        if (dim + 1 < dimension)
+          centres[blob * dimension + dim + 1] = uniform[1] * options->max;
+      }
+    // Geometric weights from 1 down to 1 / imbalance
+    double total = 0.;
+    for (size_t blob = 0; blob < blobs; ++blob) {
+      double exponent = blobs > 1 ? (double)blob / (double)(blobs - 1) : 0.;
+      double weight = pow(options->imbalance, -exponent);
+      total += weight;
+      cumulative_weights[blob] = total;
+    }
+    for (size_t blob = 0; blob < blobs; ++blob)
+      cumulative_weights[blob] /= total;
+    cumulative_weights[blobs - 1] = 1.;
+  }
+
+  unsigned num_threads = options->threads > 0 ? options->threads : 1;
+  if (num_threads > options->points)
+    num_threads = options->points > 0 ? (unsigned)options->points : 1;
+  struct synthetic_slice *slices = malloc(num_threads * sizeof(*slices));
+  pthread_t *threads = malloc(num_threads * sizeof(*threads));
+  if (slices == NULL || threads == NULL) {
+    fprintf(stderr, "Failed to allocate the generator threads\n");
+    free(threads);
+    free(slices);
+    free(cumulative_weights);
+    free(centres);
+    return false;
+  }
+  bool success = true;
+  unsigned spawned = 0;
+  for (unsigned thread = 0; thread < num_threads; ++thread) {
+    slices[thread] = (struct synthetic_slice){
+        .options = options,
+        .centres = centres,
+        .cumulative_weights = cumulative_weights,
+        .data_f = data_f,
+        .data_d = data_d,
+        .labels = labels,
+        .first = options->points * thread / num_threads,
+        .end = options->points * (thread + 1) / num_threads,
+    };
+    if (thread == 0)
+      continue; // Filled by the calling thread
+    int error =
+        pthread_create(&threads[thread], NULL, synthetic_fill, &slices[thread]);
+    if (error != 0) {
+      fprintf(stderr, "Failed to create a generator thread: %s\n",
+              strerror(error));
+      success = false;
+      break;
+    }
+    spawned = thread;
+  }
+  if (success)
+    synthetic_fill(&slices[0]);
+  for (unsigned thread = 1; thread <= spawned; ++thread)
+    pthread_join(threads[thread], NULL);
+  free(threads);
+  free(slices);
+  free(cumulative_weights);
+  free(centres);
+  return success;
+}
+
+bool synthetic_points_f(const struct synthetic_options *options, float *data,
+                        uint32_t *labels) {
+  return synthetic_points(options, data, NULL, labels);
+}
+
+bool synthetic_points_d(const struct synthetic_options *options, double *data,
+                        uint32_t *labels) {
+  return synthetic_points(options, NULL, data, labels);
+}
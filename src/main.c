@@ -25,48 +25,283 @@
 #include <getopt.h>
 #include <inttypes.h>
 #include <limits.h>
+#include <math.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <zlib.h>
 
 #include "k-means.h"
+#include "k-means_batch.h"
+#include "k-means_kernels.h"
+#include "k-means_npy.h"
 #include "k-means_png.h"
+#include "k-means_synthetic.h"
 #include "time_measurement.h"
 
-static void rand_init_data_f(size_t num_values, size_t dimension,
-                             float array[num_values][dimension],
-                             float max_of_generated_value) {
-  for (size_t i = 0; i < num_values; ++i) {
-    for (size_t j = 0; j < dimension; ++j) {
-      array[i][j] = random() / (float)RAND_MAX * max_of_generated_value;
-    }
+static size_t run_k_means(struct k_means_context *context,
+                          enum png_point_type type, size_t points,
+                          size_t dimension, size_t k, void *data,
+                          void *point_centroid_map,
+                          const struct k_means_config *config,
+                          struct k_means_stats *stats) {
+  switch (type) {
+  case png_points_double:
+    return k_means_with_context_d(context, points, dimension, k, data,
+                                  point_centroid_map, config, stats);
+  case png_points_uint8:
+    return k_means_with_context_u8(context, points, dimension, k, data,
+                                   point_centroid_map, config, stats);
+  case png_points_uint16:
+    return k_means_with_context_u16(context, points, dimension, k, data,
+                                    point_centroid_map, config, stats);
+  case png_points_half:
+    return k_means_with_context_h(context, points, dimension, k, data,
+                                  point_centroid_map, config, stats);
+  case png_points_bfloat16:
+    return k_means_with_context_bf16(context, points, dimension, k, data,
+                                     point_centroid_map, config, stats);
+  default:
+    return k_means_with_context_f(context, points, dimension, k, data,
+                                  point_centroid_map, config, stats);
+  }
+}
+
+// Runs restarts concurrent k-means, the labels and context are those of the
+// best one
+static size_t run_restarts(struct k_means_context *context,
+                           enum png_point_type type, size_t points,
+                           size_t dimension, size_t k, void *data,
+                           void *point_centroid_map,
+                           const struct k_means_config *config,
+                           size_t restarts, double abandon_margin,
+                           struct k_means_stats *stats,
+                           struct k_means_restart *restart_results) {
+  switch (type) {
+  case png_points_double:
+    return k_means_restarts_d(context, points, dimension, k, data,
+                              point_centroid_map, config, restarts,
+                              abandon_margin, stats, restart_results);
+  case png_points_uint8:
+    return k_means_restarts_u8(context, points, dimension, k, data,
+                               point_centroid_map, config, restarts,
+                               abandon_margin, stats, restart_results);
+  case png_points_uint16:
+    return k_means_restarts_u16(context, points, dimension, k, data,
+                                point_centroid_map, config, restarts,
+                                abandon_margin, stats, restart_results);
+  case png_points_half:
+    return k_means_restarts_h(context, points, dimension, k, data,
+                              point_centroid_map, config, restarts,
+                              abandon_margin, stats, restart_results);
+  case png_points_bfloat16:
+    return k_means_restarts_bf16(context, points, dimension, k, data,
+                                 point_centroid_map, config, restarts,
+                                 abandon_margin, stats, restart_results);
+  default:
+    return k_means_restarts_f(context, points, dimension, k, data,
+                              point_centroid_map, config, restarts,
+                              abandon_margin, stats, restart_results);
   }
 }
 
-static void rand_init_data_d(size_t num_values, size_t dimension,
-                             double array[num_values][dimension],
-                             double max_of_generated_value) {
-  for (size_t i = 0; i < num_values; ++i) {
-    for (size_t j = 0; j < dimension; ++j) {
-      array[i][j] = random() / (double)RAND_MAX * max_of_generated_value;
+// Runs k-means on images halved levels times, from the smallest one to the
+// image itself. Each level starts from the centroids of the previous one.
+// Returns false when a level could not be partitioned.
+static bool run_pyramid(struct k_means_context *context,
+                        enum png_point_type type, uint32_t height,
+                        uint32_t width, size_t dimension, size_t k,
+                        void *data, void *point_centroid_map,
+                        const struct k_means_config *config, size_t levels,
+                        struct k_means_stats *stats) {
+  void *level_data[levels + 1];
+  uint32_t level_height[levels + 1], level_width[levels + 1];
+  level_data[0] = data;
+  level_height[0] = height;
+  level_width[0] = width;
+
+  // The smallest level keeps at least k points
+  time_measure build_start, build_end;
+  get_current_time(&build_start);
+  size_t num_levels = 1;
+  for (; num_levels <= levels; ++num_levels) {
+    const size_t previous = num_levels - 1;
+    size_t half_points = (size_t)((level_height[previous] + 1) / 2) *
+                         ((level_width[previous] + 1) / 2);
+    if (level_height[previous] * level_width[previous] == 1 ||
+        half_points < k)
+      break;
+    level_data[num_levels] = downsample_png_points(
+        type, level_data[previous], level_height[previous],
+        level_width[previous], dimension, &level_height[num_levels],
+        &level_width[num_levels]);
+  }
+  get_current_time(&build_end);
+  fprintf(stdout, "Pyramid of %zu levels built in %.4fs\n", num_levels,
+          measuring_difftime(build_start, build_end));
+
+  const size_t centroids_size =
+      k * dimension *
+      (type == png_points_double ? sizeof(double) : sizeof(float));
+  void *centroids = malloc(centroids_size);
+  struct k_means_config level_config = *config;
+  bool success = true;
+  for (size_t level = num_levels; level-- > 0;) {
+    const size_t points = (size_t)level_height[level] * level_width[level];
+    void *map = level == 0 ? point_centroid_map
+                           : malloc(points * K_MEANS_LABEL_SIZE(k));
+    // The iterations of the image only are reported
+    if (level != 0)
+      level_config.iteration_callback = NULL;
+    else
+      level_config.iteration_callback = config->iteration_callback;
+
+    time_measure level_start, level_end;
+    get_current_time(&level_start);
+    // The smaller levels are still released after a failure
+    success = success &&
+              run_k_means(context, type, points, dimension, k,
+                          level_data[level], map, &level_config,
+                          stats) != K_MEANS_ERROR;
+    get_current_time(&level_end);
+    if (!success) {
+      if (level != 0) {
+        free(map);
+        free(level_data[level]);
+      }
+      continue;
+    }
+    fprintf(stdout, "Level %zu %" PRIu32 "x%" PRIu32 ": %zu steps in %.4fs, "
+                    "inertia %.6g\n",
+            level, level_width[level], level_height[level], stats->iterations,
+            measuring_difftime(level_start, level_end), stats->inertia);
+
+    memcpy(centroids,
+           type == png_points_double
+               ? (const void *)k_means_context_centroids_d(context)
+               : (const void *)k_means_context_centroids_f(context),
+           centroids_size);
+    level_config.init = k_means_init_given;
+    level_config.initial_centroids = centroids;
+    if (level != 0) {
+      free(map);
+      free(level_data[level]);
     }
   }
+  free(centroids);
+  return success;
 }
 
+static const char *const filter_names[] = {
+    [png_filter_none] = "none",         [png_filter_sub] = "sub",
+    [png_filter_up] = "up",             [png_filter_average] = "average",
+    [png_filter_paeth] = "paeth",       [png_filter_adaptive] = "adaptive",
+    [png_filter_default] = "default",
+};
+
+static const struct {
+  const char *name;
+  int strategy;
+} strategies[] = {
+    {"default", Z_DEFAULT_STRATEGY}, {"filtered", Z_FILTERED},
+    {"huffman", Z_HUFFMAN_ONLY},     {"rle", Z_RLE},
+    {"fixed", Z_FIXED},
+};
+
+#ifdef K_MEANS_STATS
+struct iteration_output {
+  FILE *file;
+  bool json;
+  double inertia_scale; // Undoes the scaling of the fp16 points
+};
+
+static void print_iteration(const struct k_means_iteration_stats *stats,
+                            void *data) {
+  struct iteration_output *output = data;
+  if (output->json)
+    fprintf(output->file,
+            "%s\n  {\"iteration\": %zu, \"assign_time\": %.6e,"
+            " \"update_time\": %.6e, \"reassigned\": %zu,"
+            " \"inertia\": %.10g, \"empty_clusters\": %zu,"
+            " \"shift\": %.6e, \"cycles\": %" PRId64
+            ", \"cache_misses\": %" PRId64 ", \"bandwidth\": %.6e,"
+            " \"io_wait_time\": %.6e}",
+            stats->iteration == 1 ? "[" : ",", stats->iteration,
+            stats->assign_time, stats->update_time, stats->reassigned,
+            stats->inertia * output->inertia_scale, stats->empty_clusters,
+            stats->shift,
+            stats->cycles, stats->cache_misses, stats->bandwidth,
+            stats->io_wait_time);
+  else
+    fprintf(output->file,
+            "%s%zu,%.6e,%.6e,%zu,%.10g,%zu,%.6e,%" PRId64 ",%" PRId64
+            ",%.6e,%.6e\n",
+            stats->iteration == 1
+                ? "iteration,assign_time,update_time,reassigned,inertia,"
+                  "empty_clusters,shift,cycles,cache_misses,bandwidth,"
+                  "io_wait_time\n"
+                : "",
+            stats->iteration, stats->assign_time, stats->update_time,
+            stats->reassigned, stats->inertia * output->inertia_scale,
+            stats->empty_clusters,
+            stats->shift, stats->cycles, stats->cache_misses,
+            stats->bandwidth, stats->io_wait_time);
+}
+#endif
+
 static struct option opt_options[] = {
     {"input-png", required_argument, 0, 'i'},
     {"output-png", required_argument, 0, 'o'},
     {"num-centroids", required_argument, 0, 'c'},
     {"random-data", required_argument, 0, 'r'},
     {"random-seed", required_argument, 0, 's'},
+    {"threads", required_argument, 0, 't'},
+    {"algorithm", required_argument, 0, 'a'},
+    {"init", required_argument, 0, 'n'},
+    {"max-iterations", required_argument, 0, 'x'},
+    {"tolerance", required_argument, 0, 'e'},
+    {"inertia-tolerance", required_argument, 0, 'E'},
+    {"reassigned", required_argument, 0, 'f'},
+    {"time-budget", required_argument, 0, 'b'},
+    {"stats", required_argument, 0, 'S'},
+    {"integer", no_argument, 0, 'I'},
+    {"unique-colors", no_argument, 0, 'u'},
+    {"pyramid", required_argument, 0, 'p'},
+    {"data", required_argument, 0, 'D'},
+    {"labels", required_argument, 0, 'L'},
+    {"centroids", required_argument, 0, 'C'},
+    {"batch", required_argument, 0, 'B'},
+    {"batch-output", required_argument, 0, 'O'},
+    {"jobs", required_argument, 0, 'j'},
+    {"palette", no_argument, 0, 'P'},
+    {"png-level", required_argument, 0, 'z'},
+    {"png-strategy", required_argument, 0, 'Z'},
+    {"png-filter", required_argument, 0, 'F'},
+    {"png-threads", required_argument, 0, 'T'},
+    {"restarts", required_argument, 0, 'R'},
+    {"abandon", required_argument, 0, 'A'},
+    {"numa", no_argument, 0, 'N'},
+    {"stream", required_argument, 0, 'M'},
+    {"sequence", required_argument, 0, 'V'},
+    {"delta-update", no_argument, 0, 'U'},
+    {"half", required_argument, 0, 'H'},
+    {"gemm", required_argument, 0, 'G'},
+    {"blobs", required_argument, 0, 'K'},
+    {"spread", required_argument, 0, 'W'},
+    {"imbalance", required_argument, 0, 'Y'},
+    {"truth", required_argument, 0, 'g'},
+    {"double", no_argument, 0, 'X'},
     {"help", no_argument, 0, 'h'},
     {0, 0, 0, 0}};
 
-static const char options[] = ":i:o:c:r:d:m:s:h";
+static const char options[] =
+    ":i:o:c:r:d:m:s:t:a:n:x:e:E:f:b:S:Iup:D:L:C:B:O:j:Pz:Z:F:T:R:A:NM:V:UH:G:K:W:"
+    "Y:g:Xh";
 
-static const char help_string[] =
+// Split in groups, a string literal is at most 4095 characters in C99
+static const char *const help_strings[] = {
     "Options:"
     "\n  -i --input-png        : The png file to partition"
     "\n  -o --output-png       : The result of the partitioning (greyscale)"
@@ -77,17 +312,133 @@ static const char help_string[] =
     "\n  -s --random-seed      : The random seed used by the pseudo-random "
     "generator to"
     "\n                       initalize the algorithm and the random data"
-    "\n  -h --help             : Print this help";
+    "\n  -K --blobs            : The random data is a mixture of this number of"
+    "\n                       gaussian blobs (default the number of"
+    "\n                       centroids, 0 uniform values)"
+    "\n  -W --spread           : Standard deviation of the blobs relative to"
+    "\n                       the maximum value (default 0.05)"
+    "\n  -Y --imbalance        : Ratio of the sizes of the largest and the"
+    "\n                       smallest blob (default 1)"
+    "\n  -g --truth            : Write the blob of every random point to this"
+    "\n                       npy file"
+    "\n  -X --double           : Partition the png file or the random data in"
+    "\n                       double precision",
+    "\n  -t --threads          : Number of threads used by the kernel (default"
+    "\n                       1, 0 uses every online processor)"
+    "\n  -a --algorithm        : lloyd (default), hamerly, elkan or yinyang."
+    "\n                       The last three skip the distances ruled out by"
+    "\n                       the triangle inequality, with the same result."
+    "\n                       Yinyang scales best with the number of"
+    "\n                       partitions"
+    "\n  -n --init             : kmeans++ (default), kmeans|| or random. The"
+    "\n                       seeding of the centroids"
+    "\n  -x --max-iterations   : Stop after this number of iterations"
+    "\n  -e --tolerance        : Stop when the centroids move by less than"
+    "\n                       this fraction of their norm"
+    "\n  -E --inertia-tolerance: Stop when the inertia decreases by less than"
+    "\n                       this fraction"
+    "\n  -f --reassigned       : Stop when at most this fraction of the points"
+    "\n                       change of centroid"
+    "\n  -b --time-budget      : Stop after this number of seconds"
+    "\n  -S --stats            : Write the measurements of every iteration to"
+    "\n                       this file, JSON when it ends with .json and"
+    "\n                       CSV otherwise, - for the standard output."
+    "\n                       Requires a build with KMEANS_STATS=ON"
+    "\n  -I --integer          : Cluster the 8 or 16 bits samples of the png"
+    "\n                       file without converting them to floating point"
+    "\n  -u --unique-colors    : Partition the distinct colours of the png file"
+    "\n                       weighted by their number of pixels, which is"
+    "\n                       much faster when few colours are used"
+    "\n  -p --pyramid          : Cluster the png file halved this number of"
+    "\n                       times first, then each larger image from the"
+    "\n                       centroids of the smaller one"
+    "\n  -D --data             : Partition the rows of a float32 or float64"
+    "\n                       matrix stored in a NumPy .npy file, mapped in"
+    "\n                       memory without any copy"
+    "\n  -L --labels           : Write the centroid of every point to this"
+    "\n                       .npy file (uint8, uint16 or uint32 vector)"
+    "\n  -C --centroids        : Write the final centroids to this .npy file",
+    "\n  -B --batch            : Partition every png file of this directory,"
+    "\n                       or listed in this file one per line. The"
+    "\n                       decoding, partitioning and encoding of"
+    "\n                       different images overlap"
+    "\n  -O --batch-output     : Directory of the batch results, named after"
+    "\n                       the images (not written by default)"
+    "\n  -j --jobs             : Decoding, partitioning and encoding threads"
+    "\n                       of the batch as D,P,E (default from the online"
+    "\n                       processors). -t gives the threads partitioning"
+    "\n                       one image"
+    "\n  -P --palette          : Write the output as an indexed png of the"
+    "\n                       colours of the centroids, on 1, 2, 4 or 8 bits"
+    "\n                       depending on the number of partitions"
+    "\n  -z --png-level        : zlib compression level of the output, 0 to 9"
+    "\n  -Z --png-strategy     : zlib strategy: default, filtered, huffman, rle"
+    "\n                       or fixed"
+    "\n  -F --png-filter       : Row filter: none, sub, up, average, paeth,"
+    "\n                       adaptive or default (adaptive for grey levels"
+    "\n                       and none for palettes)"
+    "\n  -T --png-threads      : Threads compressing strips of rows of the"
+    "\n                       output (default 1)"
+    "\n  -R --restarts         : Run this number of seedings concurrently,"
+    "\n                       each on -t threads, and keep the lowest inertia"
+    "\n  -A --abandon          : Abandon a restart whose inertia exceeds the"
+    "\n                       lowest one at the same iteration by this"
+    "\n                       fraction (default 0.1, 0 never abandons)"
+    "\n  -N --numa             : Bind the threads to the NUMA nodes, place"
+    "\n                       the points on the node of the thread reading"
+    "\n                       them and merge the partial sums node by node"
+    "\n  -M --stream           : Read the npy file of -D in chunks of this"
+    "\n                       number of rows at every iteration (0 for 16"
+    "\n                       MiB) rather than mapping it, for the data"
+    "\n                       larger than the memory. Lloyd iterations only"
+    "\n  -V --sequence         : Partition the frames of a video, the png"
+    "\n                       files of this directory or listed in this file,"
+    "\n                       each one starting from the centroids of the"
+    "\n                       previous one. -O names the output directory"
+    "\n  -U --delta-update     : Update the sums of the clusters with the"
+    "\n                       points which changed of cluster only"
+    "\n  -H --half             : Store the float points as fp16 (IEEE half"
+    "\n                       precision) or bf16 (bfloat16) values,"
+    "\n                       converted back as they are read, the fp16"
+    "\n                       points scaled into its range"
+    "\n  -G --gemm             : Lloyd assignments of the float points from"
+    "\n                       this dimension compute the distances from the"
+    "\n                       dot products of blocks of points and centroids"
+    "\n                       (default 32, 0 never)"
+    "\n  -h --help             : Print this help",
+};
 
 int main(int argc, char **argv) {
   unsigned random_seed = 42;
   char *png_input_file = NULL;
   char *png_output_file = NULL;
+  char *npy_input_file = NULL;
+  char *npy_labels_file = NULL;
+  char *npy_centroids_file = NULL;
+  struct batch_options batch = {.input = NULL, .output_directory = NULL};
+  struct png_encoder encoder = PNG_ENCODER_DEFAULT;
+  bool use_palette = false;
   bool use_double = false;
+  bool use_integer = false;
+  bool use_unique = false;
+  bool use_numa = false;
+  bool use_stream = false;
+  bool use_sequence = false;
+  // png_points_half or png_points_bfloat16 when the points are rounded
+  enum png_point_type half_type = png_points_float;
+  size_t stream_rows = 0;
+  size_t pyramid_levels = 0;
+  size_t num_restarts = 1;
+  double abandon_margin = .1;
   size_t num_dims = 1;
-  uint8_t num_centroids = 4;
+  size_t num_centroids = 4;
   size_t num_points = 0;
   double max_rand_val = 250.;
+  struct synthetic_options synthetic = SYNTHETIC_DEFAULT_OPTIONS;
+  synthetic.blobs = SIZE_MAX; // The number of centroids
+  char *npy_truth_file = NULL;
+  struct k_means_config config = K_MEANS_DEFAULT_CONFIG;
+  char *stats_file = NULL;
 
   while (true) {
     int sscanf_return;
@@ -102,12 +453,14 @@ int main(int argc, char **argv) {
       png_output_file = optarg;
       break;
     case 'c':
-      sscanf_return = sscanf(optarg, "%" SCNu8, &num_centroids);
-      if (sscanf_return == EOF || sscanf_return == 0 || num_centroids == 0) {
+      sscanf_return = sscanf(optarg, "%zu", &num_centroids);
+      if (sscanf_return == EOF || sscanf_return == 0 || num_centroids == 0 ||
+          num_centroids > K_MEANS_MAX_K) {
         fprintf(stderr,
-                "Please enter a positive integer for the number of centroids "
-                "instead of \"-%c %s\"\n",
-                optchar, optarg);
+                "Please enter a positive integer up to %zu for the number of "
+                "centroids instead of \"-%c %s\"\n",
+                K_MEANS_MAX_K, optchar, optarg);
+        num_centroids = 4;
       }
       break;
     case 'r':
@@ -146,8 +499,280 @@ int main(int argc, char **argv) {
                 optchar, optarg);
       }
       break;
+    case 't':
+      sscanf_return = sscanf(optarg, "%u", &config.num_threads);
+      if (sscanf_return == EOF || sscanf_return == 0) {
+        fprintf(stderr,
+                "Please enter a positive integer for the number of threads "
+                "instead of \"-%c %s\"\n",
+                optchar, optarg);
+      }
+      break;
+    case 'a':
+      if (strcmp(optarg, "lloyd") == 0) {
+        config.algorithm = k_means_lloyd;
+      } else if (strcmp(optarg, "hamerly") == 0) {
+        config.algorithm = k_means_hamerly;
+      } else if (strcmp(optarg, "elkan") == 0) {
+        config.algorithm = k_means_elkan;
+      } else if (strcmp(optarg, "yinyang") == 0) {
+        config.algorithm = k_means_yinyang;
+      } else {
+        fprintf(stderr,
+                "Please choose lloyd, hamerly, elkan or yinyang as the "
+                "algorithm instead of \"-%c %s\"\n",
+                optchar, optarg);
+      }
+      break;
+    case 'n':
+      if (strcmp(optarg, "random") == 0) {
+        config.init = k_means_init_random;
+      } else if (strcmp(optarg, "kmeans++") == 0) {
+        config.init = k_means_init_plusplus;
+      } else if (strcmp(optarg, "kmeans||") == 0) {
+        config.init = k_means_init_parallel;
+      } else {
+        fprintf(stderr,
+                "Please choose kmeans++, kmeans|| or random as the seeding "
+                "instead of \"-%c %s\"\n",
+                optchar, optarg);
+      }
+      break;
+    case 'x':
+      sscanf_return =
+          sscanf(optarg, "%zu", &config.termination.max_iterations);
+      if (sscanf_return == EOF || sscanf_return == 0) {
+        fprintf(stderr,
+                "Please enter a positive integer for the maximum number of "
+                "iterations instead of \"-%c %s\"\n",
+                optchar, optarg);
+      }
+      break;
+    case 'e':
+    case 'E':
+    case 'f':
+    case 'b': {
+      double *criterion =
+          optchar == 'e'   ? &config.termination.shift_tolerance
+          : optchar == 'E' ? &config.termination.inertia_tolerance
+          : optchar == 'f' ? &config.termination.reassigned_fraction
+                           : &config.termination.time_budget;
+      sscanf_return = sscanf(optarg, "%lf", criterion);
+      if (sscanf_return == EOF || sscanf_return == 0 || *criterion < 0.) {
+        fprintf(stderr,
+                "Please enter a positive floating point number for the "
+                "stopping criterion instead of \"-%c %s\"\n",
+                optchar, optarg);
+        *criterion = 0.;
+      }
+    } break;
+    case 'S':
+      stats_file = optarg;
+      break;
+    case 'I':
+      use_integer = true;
+      break;
+    case 'u':
+      use_unique = true;
+      break;
+    case 'p':
+      sscanf_return = sscanf(optarg, "%zu", &pyramid_levels);
+      if (sscanf_return == EOF || sscanf_return == 0) {
+        fprintf(stderr,
+                "Please enter a positive integer for the number of pyramid "
+                "levels instead of \"-%c %s\"\n",
+                optchar, optarg);
+        pyramid_levels = 0;
+      }
+      break;
+    case 'D':
+      npy_input_file = optarg;
+      break;
+    case 'L':
+      npy_labels_file = optarg;
+      break;
+    case 'C':
+      npy_centroids_file = optarg;
+      break;
+    case 'B':
+      batch.input = optarg;
+      use_sequence = false;
+      break;
+    case 'V':
+      batch.input = optarg;
+      use_sequence = true;
+      break;
+    case 'O':
+      batch.output_directory = optarg;
+      break;
+    case 'j':
+      sscanf_return =
+          sscanf(optarg, "%u,%u,%u", &batch.threads[batch_decode],
+                 &batch.threads[batch_cluster], &batch.threads[batch_encode]);
+      if (sscanf_return != 3 || batch.threads[batch_decode] == 0 ||
+          batch.threads[batch_cluster] == 0 ||
+          batch.threads[batch_encode] == 0) {
+        fprintf(stderr,
+                "Please enter three positive integers D,P,E for the batch "
+                "threads instead of \"-%c %s\"\n",
+                optchar, optarg);
+        batch.threads[batch_decode] = 0;
+      }
+      break;
+    case 'P':
+      use_palette = true;
+      break;
+    case 'z':
+      sscanf_return = sscanf(optarg, "%d", &encoder.level);
+      if (sscanf_return == EOF || sscanf_return == 0 || encoder.level < 0 ||
+          encoder.level > 9) {
+        fprintf(stderr,
+                "Please enter an integer from 0 to 9 for the compression "
+                "level instead of \"-%c %s\"\n",
+                optchar, optarg);
+        encoder.level = Z_DEFAULT_COMPRESSION;
+      }
+      break;
+    case 'Z': {
+      size_t strategy = 0, num_strategies = sizeof(strategies) /
+                                            sizeof(strategies[0]);
+      while (strategy < num_strategies &&
+             strcmp(strategies[strategy].name, optarg) != 0)
+        ++strategy;
+      if (strategy == num_strategies)
+        fprintf(stderr,
+                "Please choose default, filtered, huffman, rle or fixed as the "
+                "zlib strategy instead of \"-%c %s\"\n",
+                optchar, optarg);
+      else
+        encoder.strategy = strategies[strategy].strategy;
+    } break;
+    case 'F': {
+      size_t filter = 0,
+             num_filters = sizeof(filter_names) / sizeof(filter_names[0]);
+      while (filter < num_filters && strcmp(filter_names[filter], optarg) != 0)
+        ++filter;
+      if (filter == num_filters)
+        fprintf(stderr,
+                "Please choose none, sub, up, average, paeth, adaptive or "
+                "default as the png filter instead of \"-%c %s\"\n",
+                optchar, optarg);
+      else
+        encoder.filter = (enum png_filter)filter;
+    } break;
+    case 'T':
+      sscanf_return = sscanf(optarg, "%u", &encoder.threads);
+      if (sscanf_return == EOF || sscanf_return == 0 || encoder.threads == 0) {
+        fprintf(stderr,
+                "Please enter a positive integer for the number of encoding "
+                "threads instead of \"-%c %s\"\n",
+                optchar, optarg);
+        encoder.threads = 1;
+      }
+      break;
+    case 'R':
+      sscanf_return = sscanf(optarg, "%zu", &num_restarts);
+      if (sscanf_return == EOF || sscanf_return == 0 || num_restarts == 0) {
+        fprintf(stderr,
+                "Please enter a positive integer for the number of restarts "
+                "instead of \"-%c %s\"\n",
+                optchar, optarg);
+        num_restarts = 1;
+      }
+      break;
+    case 'A':
+      sscanf_return = sscanf(optarg, "%lf", &abandon_margin);
+      if (sscanf_return == EOF || sscanf_return == 0 || abandon_margin < 0.) {
+        fprintf(stderr,
+                "Please enter a positive floating point number for the "
+                "abandon margin instead of \"-%c %s\"\n",
+                optchar, optarg);
+        abandon_margin = .1;
+      }
+      break;
+    case 'N':
+      use_numa = true;
+      break;
+    case 'U':
+      config.delta_update = true;
+      break;
+    case 'G': {
+      size_t gemm_dimension;
+      sscanf_return = sscanf(optarg, "%zu", &gemm_dimension);
+      if (sscanf_return == EOF || sscanf_return == 0) {
+        fprintf(stderr,
+                "Please enter a positive integer for the dimension of the "
+                "GEMM assignment instead of \"-%c %s\"\n",
+                optchar, optarg);
+        gemm_dimension = K_MEANS_GEMM_DIMENSION;
+      }
+      config.gemm_dimension = gemm_dimension == 0 ? SIZE_MAX : gemm_dimension;
+    } break;
+    case 'K':
+      sscanf_return = sscanf(optarg, "%zu", &synthetic.blobs);
+      if (sscanf_return == EOF || sscanf_return == 0) {
+        fprintf(stderr,
+                "Please enter a positive integer for the number of blobs "
+                "instead of \"-%c %s\"\n",
+                optchar, optarg);
+        synthetic.blobs = SIZE_MAX;
+      }
+      break;
+    case 'W':
+      sscanf_return = sscanf(optarg, "%lf", &synthetic.spread);
+      if (sscanf_return == EOF || sscanf_return == 0 ||
+          !(synthetic.spread >= 0.)) {
+        fprintf(stderr,
+                "Please enter a positive floating point number for the spread "
+                "of the blobs instead of \"-%c %s\"\n",
+                optchar, optarg);
+        synthetic.spread = SYNTHETIC_DEFAULT_OPTIONS.spread;
+      }
+      break;
+    case 'Y':
+      sscanf_return = sscanf(optarg, "%lf", &synthetic.imbalance);
+      if (sscanf_return == EOF || sscanf_return == 0 ||
+          !(synthetic.imbalance >= 1.)) {
+        fprintf(stderr,
+                "Please enter a floating point number from 1 for the "
+                "imbalance of the blobs instead of \"-%c %s\"\n",
+                optchar, optarg);
+        synthetic.imbalance = SYNTHETIC_DEFAULT_OPTIONS.imbalance;
+      }
+      break;
+    case 'g':
+      npy_truth_file = optarg;
+      break;
+    case 'X':
+      use_double = true;
+      break;
+    case 'H':
+      if (strcmp(optarg, "fp16") == 0)
+        half_type = png_points_half;
+      else if (strcmp(optarg, "bf16") == 0)
+        half_type = png_points_bfloat16;
+      else
+        fprintf(stderr,
+                "Please enter fp16 or bf16 for the storage of the points "
+                "instead of \"-%c %s\"\n",
+                optchar, optarg);
+      break;
+    case 'M':
+      sscanf_return = sscanf(optarg, "%zu", &stream_rows);
+      if (sscanf_return == EOF || sscanf_return == 0) {
+        fprintf(stderr,
+                "Please enter a positive integer for the rows of the streamed "
+                "chunks instead of \"-%c %s\"\n",
+                optchar, optarg);
+        stream_rows = 0;
+      }
+      use_stream = true;
+      break;
     case 'h':
-      printf("Usage: %s <options>\n%s\n", argv[0], help_string);
+      printf("Usage: %s <options>\n", argv[0]);
+      for (size_t i = 0; i < sizeof(help_strings) / sizeof(*help_strings); ++i)
+        fputs(help_strings[i], stdout);
+      putchar('\n');
       return EXIT_SUCCESS;
     case ':':
       if (optopt == 'o') {
@@ -163,99 +788,454 @@ int main(int argc, char **argv) {
       break;
     }
   }
-  srandom(random_seed);
+  config.seed = random_seed;
 
-  if (png_input_file != NULL) // PNG has 4 dims (RGBA)
-    num_dims = 4;
+  if (config.num_threads == 0) {
+    long online_processors = sysconf(_SC_NPROCESSORS_ONLN);
+    config.num_threads =
+        online_processors > 0 ? (unsigned)online_processors : 1;
+  }
+
+  if (use_palette && num_centroids > 256) {
+    fprintf(stderr, "The palette holds at most 256 colours\n");
+    exit(EXIT_FAILURE);
+  }
+  if (batch.input != NULL) {
+    if (use_unique || pyramid_levels > 0 || use_double || num_restarts > 1 ||
+        use_numa || use_stream || half_type != png_points_float) {
+      fprintf(stderr, "The batch and the sequence do not merge the unique "
+                      "colours, build pyramids, restart, stream, round the "
+                      "samples nor place the images on the NUMA nodes\n");
+      exit(EXIT_FAILURE);
+    }
+    // Half of the processors partition, the others decode and encode
+    if (batch.threads[batch_decode] == 0) {
+      long online_processors = sysconf(_SC_NPROCESSORS_ONLN);
+      unsigned processors =
+          online_processors > 0 ? (unsigned)online_processors : 1;
+      batch.threads[batch_cluster] = processors > 1 ? processors / 2 : 1;
+      batch.threads[batch_decode] = processors > 3 ? processors / 4 : 1;
+      batch.threads[batch_encode] = processors > 3 ? processors / 4 : 1;
+    }
+    batch.queue_capacity = 2 * (size_t)batch.threads[batch_cluster];
+    batch.k = num_centroids;
+    batch.config = config;
+    batch.type = use_integer ? png_points_integer : png_points_float;
+    batch.palette = use_palette;
+    batch.encoder = encoder;
+    if (use_sequence)
+      return run_sequence(&batch) ? EXIT_SUCCESS : EXIT_FAILURE;
+    return run_batch(&batch) ? EXIT_SUCCESS : EXIT_FAILURE;
+  }
 
-  float(*data_f)[num_dims] = NULL;
-  double(*data_d)[num_dims] = NULL;
+  if (use_integer && use_double) {
+    fprintf(stderr, "The integer samples are not converted to double "
+                    "precision\n");
+    exit(EXIT_FAILURE);
+  }
+  if ((use_integer || use_unique) && png_input_file == NULL) {
+    fprintf(stderr, "The integer samples and the unique colours require a png "
+                    "input file\n");
+    exit(EXIT_FAILURE);
+  }
+  if (pyramid_levels > 0 && (png_input_file == NULL || use_unique)) {
+    fprintf(stderr, "The pyramid requires a png input file and does not "
+                    "merge the unique colours\n");
+    exit(EXIT_FAILURE);
+  }
+  if (pyramid_levels > 0 && num_restarts > 1) {
+    fprintf(stderr, "The pyramid levels are not restarted\n");
+    exit(EXIT_FAILURE);
+  }
+  if (npy_truth_file != NULL &&
+      (npy_input_file != NULL || png_input_file != NULL)) {
+    fprintf(stderr, "The ground truth labels exist for random data only\n");
+    exit(EXIT_FAILURE);
+  }
+  if (npy_input_file != NULL && png_input_file != NULL) {
+    fprintf(stderr, "Please choose either a png or a npy input file\n");
+    exit(EXIT_FAILURE);
+  }
+  if (use_stream &&
+      (npy_input_file == NULL || num_restarts > 1 || use_numa)) {
+    fprintf(stderr, "The streaming requires a npy input file and does not "
+                    "restart nor place the points on the NUMA nodes\n");
+    exit(EXIT_FAILURE);
+  }
+  if (half_type != png_points_float &&
+      (use_integer || use_double || use_stream || pyramid_levels > 0)) {
+    fprintf(stderr, "The 16 bits floats do not hold the integer samples nor "
+                    "the double precision points, and are neither streamed "
+                    "nor downsampled in a pyramid\n");
+    exit(EXIT_FAILURE);
+  }
+  enum png_point_type point_type = use_integer  ? png_points_integer
+                                   : use_double ? png_points_double
+                                                : png_points_float;
 
+  // The png images give the dimension, the opaque RGB ones have 3
   uint32_t height = 0, width = 0;
-  if (png_input_file != NULL) { // Read data from png file
-    uint16_t *image = NULL;
-    bool read_success = read_png(png_input_file, &image, &height, &width);
+  struct png_channels channels;
+  void *data = NULL;
+  struct npy_matrix npy_data = {.mapping = NULL};
+  int stream_fd = -1;
+  off_t stream_offset = 0;
+  if (npy_input_file != NULL) { // Rows of the matrix, used in place
+    if (use_stream) // Only the header is read
+      stream_fd = open_npy(npy_input_file, &npy_data, &stream_offset);
+    if (use_stream ? stream_fd < 0 : !map_npy(npy_input_file, &npy_data))
+      exit(EXIT_FAILURE);
+    if ((npy_data.type != npy_float32 && npy_data.type != npy_float64) ||
+        npy_data.rows == 0 || npy_data.columns == 0) {
+      fprintf(stderr, "The npy file must hold a non empty float32 or float64 "
+                      "matrix\n");
+      exit(EXIT_FAILURE);
+    }
+    point_type = npy_data.type == npy_float64 ? png_points_double
+                                              : png_points_float;
+    if (half_type != png_points_float && point_type == png_points_double) {
+      fprintf(stderr, "The 16 bits floats store float32 matrices only\n");
+      exit(EXIT_FAILURE);
+    }
+    data = npy_data.data;
+    num_points = npy_data.rows;
+    num_dims = npy_data.columns;
+  } else if (png_input_file != NULL) { // Read data from png file
+    bool read_success =
+        read_png_points(png_input_file, &point_type, &data, &height, &width,
+                        &num_dims, &channels);
     if (!read_success)
       exit(EXIT_FAILURE);
     num_points = width;
     num_points *= height;
-    if (use_double) {
-      data_d = malloc(sizeof(double[num_points][num_dims]));
-      double(*data_d_tab)[width][4] = (double(*)[width][4])data_d;
-      uint16_t(*image_tab)[width][4] = (uint16_t(*)[width][4])image;
-      for (size_t i = 0; i < width; ++i) {
-        for (size_t j = 0; j < height; ++j) {
-          data_d_tab[i][j][0] = image_tab[i][j][0];
-          data_d_tab[i][j][1] = image_tab[i][j][1];
-          data_d_tab[i][j][2] = image_tab[i][j][2];
-          data_d_tab[i][j][3] = image_tab[i][j][3];
-        }
-      }
-
-    } else {
-      data_f = malloc(sizeof(float[num_points][num_dims]));
-      float(*data_f_tab)[width][4] = (float(*)[width][4])data_f;
-      uint16_t(*image_tab)[width][4] = (uint16_t(*)[width][4])image;
-      for (size_t i = 0; i < height; ++i) {
-        for (size_t j = 0; j < width; ++j) {
-          data_f_tab[i][j][0] = image_tab[i][j][0];
-          data_f_tab[i][j][1] = image_tab[i][j][1];
-          data_f_tab[i][j][2] = image_tab[i][j][2];
-          data_f_tab[i][j][3] = image_tab[i][j][3];
-        }
-      }
-    }
-    free(image);
   } else { // Init random
     if (num_points == 0) {
       fprintf(stdout, "Neither PNG file nor random data size have been "
                       "selected.\nExiting as nothing needs to be done.\n");
       return EXIT_SUCCESS;
     }
+    synthetic.points = num_points;
+    synthetic.dimension = num_dims;
+    synthetic.max = max_rand_val;
+    synthetic.seed = random_seed;
+    synthetic.threads = config.num_threads;
+    if (synthetic.blobs == SIZE_MAX)
+      synthetic.blobs = num_centroids;
+    uint32_t *truth =
+        npy_truth_file != NULL ? malloc(num_points * sizeof(*truth)) : NULL;
+    time_measure generation_start, generation_end;
+    get_current_time(&generation_start);
+    bool generated;
     if (use_double) {
-      data_d = malloc(sizeof(double([num_points][num_dims])));
-      rand_init_data_d(num_points, num_dims, data_d, max_rand_val);
+      data = malloc(sizeof(double([num_points][num_dims])));
+      generated = synthetic_points_d(&synthetic, data, truth);
     } else {
-      data_f = malloc(sizeof(float([num_points][num_dims])));
-      rand_init_data_f(num_points, num_dims, data_f, (float)max_rand_val);
+      data = malloc(sizeof(float([num_points][num_dims])));
+      generated = synthetic_points_f(&synthetic, data, truth);
+    }
+    get_current_time(&generation_end);
+    if (!generated)
+      exit(EXIT_FAILURE);
+    fprintf(stdout, "Generated %zu points in %.4fs on %u thread%s\n",
+            num_points, measuring_difftime(generation_start, generation_end),
+            synthetic.threads, synthetic.threads > 1 ? "s" : "");
+    if (truth != NULL) {
+      write_npy(npy_truth_file, npy_uint32, num_points, 1, truth);
+      free(truth);
     }
   }
 
-  uint8_t *point_centroid_map =
-      malloc(num_points * sizeof(*point_centroid_map));
-  size_t steps_to_convergence = 0;
+  void *point_centroid_map =
+      malloc(num_points * K_MEANS_LABEL_SIZE(num_centroids));
+  struct k_means_stats stats;
+
+  // The distinct colours are partitioned in place of the pixels
+  size_t num_pixels = num_points;
+  uint32_t *pixel_color = NULL, *color_weights = NULL;
+  void *pixel_centroid_map = point_centroid_map;
+  time_measure compaction_start, compaction_end;
+  get_current_time(&compaction_start);
+  if (use_unique) {
+    size_t row_size = num_dims * png_point_value_size(point_type);
+    void *colors = malloc(num_pixels * row_size);
+    color_weights = malloc(num_pixels * sizeof(*color_weights));
+    pixel_color = malloc(num_pixels * sizeof(*pixel_color));
+    num_points = k_means_unique_points(num_pixels, row_size, data, colors,
+                                       color_weights, pixel_color);
+    if (num_points == K_MEANS_ERROR)
+      exit(EXIT_FAILURE);
+    free(data);
+    data = realloc(colors, num_points * row_size);
+    point_centroid_map = malloc(num_points * K_MEANS_LABEL_SIZE(num_centroids));
+    config.weights = color_weights;
+  }
+  get_current_time(&compaction_end);
+
+#ifdef K_MEANS_STATS
+  struct iteration_output iteration_output = {stdout, false, 1.};
+  if (stats_file != NULL) {
+    size_t length = strlen(stats_file);
+    iteration_output.json =
+        length >= 5 && strcmp(stats_file + length - 5, ".json") == 0;
+    if (strcmp(stats_file, "-") != 0 &&
+        (iteration_output.file = fopen(stats_file, "w")) == NULL) {
+      perror(stats_file);
+      exit(EXIT_FAILURE);
+    }
+    config.iteration_callback = print_iteration;
+    config.callback_data = &iteration_output;
+    config.hardware_counters = true;
+  }
+#else
+  if (stats_file != NULL) {
+    fprintf(stderr, "The per-iteration statistics require a build with the "
+                    "KMEANS_STATS CMake option\n");
+    exit(EXIT_FAILURE);
+  }
+#endif
 
+  // The points are rounded once, the runs convert them back as they read them.
+  // The largest half is 65504, the 16 bits samples of the png files are
+  // divided by 257 into the 8 bits range and the other points by the power of
+  // two bringing them below it. The centroids and the inertia are scaled back.
+  double point_scale = 1.;
+  if (half_type != png_points_float) {
+    size_t values = num_points * num_dims;
+    void *rounded = malloc(values * png_point_value_size(half_type));
+    const float *points = data;
+    if (half_type == png_points_half) {
+      float largest = 0.f;
+      for (size_t i = 0; i < values; ++i)
+        if (isfinite(points[i]) && fabsf(points[i]) > largest)
+          largest = fabsf(points[i]);
+      if (png_input_file != NULL) {
+        point_scale = 1. / 257.;
+      } else if (largest > 65504.f) {
+        int exponent;
+        frexp((double)largest / 65504., &exponent);
+        point_scale = ldexp(1., -exponent);
+      }
+      // Scaled by blocks, the mapped npy files are read only
+      float block[1024];
+      for (size_t first = 0; first < values; first += 1024) {
+        size_t count = values - first < 1024 ? values - first : 1024;
+        for (size_t i = 0; i < count; ++i)
+          block[i] = (float)((double)points[first + i] * point_scale);
+        k_means_float_to_half(count, block,
+                              (k_means_half *)rounded + first);
+      }
+      for (size_t i = 0; i < values; ++i) {
+        if ((((k_means_half *)rounded)[i].bits & 0x7fff) == 0x7c00 &&
+            isfinite(points[i])) {
+          fprintf(stderr, "The points exceed the range of fp16, please use "
+                          "bf16\n");
+          exit(EXIT_FAILURE);
+        }
+      }
+    } else {
+      k_means_float_to_bfloat16(values, data, rounded);
+    }
+    if (npy_data.mapping != NULL)
+      unmap_npy(&npy_data);
+    else
+      free(data);
+    data = rounded;
+    point_type = half_type;
+  }
+#ifdef K_MEANS_STATS
+  iteration_output.inertia_scale = 1. / (point_scale * point_scale);
+#endif
+
+  // The points are copied to pages first touched by the threads of the nodes
+  // reading them
+  size_t row_size = num_dims * png_point_value_size(point_type);
+  if (use_numa) {
+    void *placed =
+        k_means_numa_alloc(num_points, row_size, config.num_threads);
+    if (placed == NULL) {
+      fprintf(stderr, "Failed to allocate the points on the NUMA nodes\n");
+      exit(EXIT_FAILURE);
+    }
+    memcpy(placed, data, num_points * row_size);
+    if (npy_data.mapping != NULL)
+      unmap_npy(&npy_data);
+    else
+      free(data);
+    data = placed;
+    config.numa = true;
+  }
+
+  struct k_means_context *context = k_means_context_create();
+  struct k_means_restart *restarts = NULL;
+  size_t best_restart = 0;
+  bool clustered = true;
   time_measure startTime, endTime;
   get_current_time(&startTime);
-  if (use_double)
-    steps_to_convergence = k_means(num_points, num_dims, num_centroids, data_d,
-                                   point_centroid_map);
-  else
-    steps_to_convergence = k_means(num_points, num_dims, num_centroids, data_f,
-                                   point_centroid_map);
+  if (use_stream) {
+    if (point_type == png_points_double)
+      clustered = k_means_stream_d(context, stream_fd, stream_offset,
+                                   num_points, num_dims, num_centroids,
+                                   stream_rows, point_centroid_map, &config,
+                                   &stats) != K_MEANS_ERROR;
+    else
+      clustered = k_means_stream_f(context, stream_fd, stream_offset,
+                                   num_points, num_dims, num_centroids,
+                                   stream_rows, point_centroid_map, &config,
+                                   &stats) != K_MEANS_ERROR;
+  } else if (pyramid_levels > 0) {
+    clustered = run_pyramid(context, point_type, height, width, num_dims,
+                            num_centroids, data, point_centroid_map, &config,
+                            pyramid_levels, &stats);
+  } else if (num_restarts > 1) {
+    restarts = malloc(num_restarts * sizeof(*restarts));
+    best_restart = run_restarts(context, point_type, num_points, num_dims,
+                                num_centroids, data, point_centroid_map,
+                                &config, num_restarts, abandon_margin, &stats,
+                                restarts);
+    clustered = best_restart != K_MEANS_ERROR;
+  } else
+    clustered = run_k_means(context, point_type, num_points, num_dims,
+                            num_centroids, data, point_centroid_map, &config,
+                            &stats) != K_MEANS_ERROR;
   get_current_time(&endTime);
+  if (!clustered) {
+    fprintf(stderr, "The k-means partition failed\n");
+    exit(EXIT_FAILURE);
+  }
+  if (use_unique) {
+    k_means_scatter_labels(num_pixels, num_centroids, pixel_color,
+                           point_centroid_map, pixel_centroid_map);
+    free(point_centroid_map);
+    point_centroid_map = pixel_centroid_map;
+    fprintf(stdout, "%zu unique colours for %zu pixels (%.2f%%) merged in "
+                    "%.4fs\n",
+            num_points, num_pixels,
+            100. * (double)num_points / (double)num_pixels,
+            measuring_difftime(compaction_start, compaction_end));
+  }
+
+#ifdef K_MEANS_STATS
+  if (stats_file != NULL) {
+    if (iteration_output.json)
+      fprintf(iteration_output.file, "%s\n]\n",
+              stats.iterations == 0 ? "[" : "");
+    if (iteration_output.file != stdout)
+      fclose(iteration_output.file);
+  }
+#endif
 
   if (png_input_file != NULL && png_output_file != NULL) {
-    uint8_t(*out_image)[width] = malloc(sizeof(uint8_t[height][width]));
-    uint8_t multiplier = UINT8_MAX / num_centroids;
-    uint8_t(*pcm_tab)[width] = (uint8_t(*)[width])point_centroid_map;
-    for (size_t i = 0; i < height; ++i) {
-      for (size_t j = 0; j < width; ++j) {
-        out_image[i][j] = pcm_tab[i][j] * multiplier;
-      }
+    uint8_t(*palette)[4] = NULL;
+    if (use_palette) {
+      // The colours of the centroids, read in the precision of the run
+      palette = malloc(num_centroids * sizeof(*palette));
+      double *centroids = malloc(num_centroids * num_dims * sizeof(double));
+      const float *centroids_f = k_means_context_centroids_f(context);
+      const double *centroids_d = k_means_context_centroids_d(context);
+      for (size_t i = 0; i < num_centroids * num_dims; ++i)
+        centroids[i] =
+            (centroids_d != NULL ? centroids_d[i] : (double)centroids_f[i]) /
+            point_scale;
+      png_palette(&channels, point_type, num_centroids, num_dims, centroids,
+                  palette);
+      free(centroids);
     }
-    write_grey_png(png_output_file, height, width, out_image);
-    free(out_image);
+    time_measure encode_start, encode_end;
+    get_current_time(&encode_start);
+    write_labels_png(png_output_file, height, width, num_centroids,
+                     point_centroid_map, (const uint8_t(*)[4])palette,
+                     &encoder);
+    get_current_time(&encode_end);
+    fprintf(stdout, "Encoded in %.4fs on %u thread%s\n",
+            measuring_difftime(encode_start, encode_end), encoder.threads,
+            encoder.threads > 1 ? "s" : "");
+    free(palette);
   }
 
-  fprintf(stdout, "Converged in %zu steps\nKernel time %.4fs\n",
-          steps_to_convergence, measuring_difftime(startTime, endTime));
+  if (npy_labels_file != NULL)
+    write_npy(npy_labels_file,
+              K_MEANS_LABEL_SIZE(num_centroids) == 1   ? npy_uint8
+              : K_MEANS_LABEL_SIZE(num_centroids) == 2 ? npy_uint16
+                                                       : npy_uint32,
+              num_pixels, 1, point_centroid_map);
+  if (npy_centroids_file != NULL) {
+    if (point_type == png_points_double)
+      write_npy(npy_centroids_file, npy_float64, num_centroids, num_dims,
+                k_means_context_centroids_d(context));
+    else if (point_scale < 1.) { // fp16 points
+      const float *centroids_f = k_means_context_centroids_f(context);
+      float *centroids = malloc(num_centroids * num_dims * sizeof(*centroids));
+      for (size_t i = 0; i < num_centroids * num_dims; ++i)
+        centroids[i] = (float)((double)centroids_f[i] / point_scale);
+      write_npy(npy_centroids_file, npy_float32, num_centroids, num_dims,
+                centroids);
+      free(centroids);
+    } else
+      write_npy(npy_centroids_file, npy_float32, num_centroids, num_dims,
+                k_means_context_centroids_f(context));
+  }
+
+  double kernel_time = measuring_difftime(startTime, endTime);
+  double point_steps = (double)num_points * (double)stats.iterations;
+  static const char *const stop_reasons[] = {
+      [k_means_stop_converged] = "Converged",
+      [k_means_stop_max_iterations] = "Reached the maximum iterations",
+      [k_means_stop_shift_tolerance] = "Reached the centroid shift tolerance",
+      [k_means_stop_inertia_tolerance] = "Reached the inertia tolerance",
+      [k_means_stop_reassigned_fraction] = "Reached the reassigned fraction",
+      [k_means_stop_time_budget] = "Exhausted the time budget",
+      [k_means_stop_abandoned] = "Abandoned",
+  };
+  stats.inertia /= point_scale * point_scale;
+  if (restarts != NULL) {
+    for (size_t restart = 0; restart < num_restarts; ++restart)
+      fprintf(stdout, "%c Restart %zu (seed %lu): %s in %zu steps, inertia "
+                      "%.6g\n",
+              restart == best_restart ? '*' : ' ', restart,
+              restarts[restart].seed, stop_reasons[restarts[restart].stop_reason],
+              restarts[restart].iterations,
+              restarts[restart].inertia / (point_scale * point_scale));
+    free(restarts);
+  }
+  if (use_stream)
+    fprintf(stdout, "I/O wait %.4fs, compute %.4fs\n", stats.io_wait_time,
+            stats.iteration_time - stats.io_wait_time);
+  fprintf(stdout,
+          "%s in %zu steps\nKernel time %.4fs on %u thread%s (%s)\n"
+          "Seeding %.4fs, iterations %.4fs\n"
+          "Throughput %.2f Mpoint-steps/s (%.2f per thread)\n"
+          "Distance computations %zu, %zu avoided (%.1f%%)\n"
+          "%s distances, %.2f GFLOP/s of point-centroid dot products\n"
+          "Memory bandwidth %.2f GB/s of points per iteration\n"
+          "Inertia %.6g\n",
+          stop_reasons[stats.stop_reason], stats.iterations, kernel_time,
+          config.num_threads,
+          config.num_threads > 1 ? "s" : "", k_means_kernels()->name,
+          stats.seeding_time, stats.iteration_time,
+          point_steps / stats.iteration_time / 1e6,
+          point_steps / stats.iteration_time / 1e6 / config.num_threads,
+          stats.distance_computations, stats.distance_computations_avoided,
+          100. * (double)stats.distance_computations_avoided /
+              ((double)stats.distance_computations +
+               (double)stats.distance_computations_avoided),
+          stats.gemm ? "GEMM" : "Loop",
+          2. * (double)stats.distance_computations * (double)num_dims /
+              stats.iteration_time / 1e9,
+          point_steps * (double)row_size / stats.iteration_time / 1e9,
+          stats.inertia);
 
+  k_means_context_destroy(context);
   free(point_centroid_map);
-  if (use_double)
-    free(data_d);
+  free(pixel_color);
+  free(color_weights);
+  if (stream_fd >= 0)
+    close(stream_fd);
+  if (use_numa)
+    k_means_numa_free(data, num_points, row_size);
+  else if (npy_data.mapping != NULL)
+    unmap_npy(&npy_data);
   else
-    free(data_f);
+    free(data);
 
   return EXIT_SUCCESS;
 }